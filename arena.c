@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Reserve/commit arenas.  The whole arena is reserved PROT_NONE up front
+ * and chunks are committed from the fault handler on first touch.  Each
+ * chunk has two bits: committed, and referenced since the last trim.
+ *
+ * A trim runs alongside the threads using the arena.  It marks the
+ * committed chunks as being trimmed, waits for handlers already at work
+ * on them, protects them and only then takes their referenced bits; a
+ * handler that sees the mark retries the access once the trim is done.
+ * A chunk is thus either protected with its bit clear, or its bit is
+ * set, and a chunk found cold cannot have been written since it was
+ * last protected.
+ */
+
+#include "fault.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define WORD_BITS	(sizeof(unsigned long) * CHAR_BIT)
+
+struct faultarena {
+	char			*fa_base;
+	size_t			 fa_size,
+				 fa_chunk,
+				 fa_nchunks;
+	int			 fa_flags;
+	atomic_size_t		 fa_brk;
+	atomic_ulong		*fa_committed,
+				*fa_referenced,
+				*fa_trimming;
+	atomic_uint		*fa_busy;	/* handlers at work, per chunk */
+};
+
+static int
+arena_fault(int flt, const struct faultinfo *fi, void *arg)
+{
+	struct faultarena *fa = arg;
+	size_t chunk = ((char *) fi->fi_addr - fa->fa_base) / fa->fa_chunk;
+	unsigned long bit = 1UL << chunk % WORD_BITS;
+	int res = 1;
+
+	atomic_fetch_add(&fa->fa_busy[chunk], 1);
+	atomic_fetch_or(&fa->fa_referenced[chunk / WORD_BITS], bit);
+
+	/* being trimmed: the trim keeps it, try again afterwards */
+	if (!(atomic_load(&fa->fa_trimming[chunk / WORD_BITS]) & bit)) {
+		if (mprotect(fa->fa_base + chunk * fa->fa_chunk, fa->fa_chunk,
+		    PROT_READ | PROT_WRITE) == 0)
+			atomic_fetch_or(&fa->fa_committed[chunk / WORD_BITS],
+			    bit);
+		else
+			res = 0;
+	}
+	atomic_fetch_sub(&fa->fa_busy[chunk], 1);
+
+	return res;
+}
+
+struct faultarena *
+fault_arena_create(size_t size, size_t chunk, int flags)
+{
+	struct faultarena *fa;
+	size_t page_size = sysconf(_SC_PAGESIZE), nwords, granule;
+
+	if (chunk == 0)
+		chunk = page_size;
+	if (chunk % page_size != 0 || size == 0 ||
+	    (flags & ~FAULT_ARENA_ZERO) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	size = (size + chunk - 1) / chunk * chunk;
+
+	if ((fa = calloc(1, sizeof(*fa))) == NULL)
+		return NULL;
+
+	fa->fa_size = size;
+	fa->fa_chunk = chunk;
+	fa->fa_nchunks = size / chunk;
+	fa->fa_flags = flags;
+	atomic_init(&fa->fa_brk, 0);
+
+	nwords = (fa->fa_nchunks + WORD_BITS - 1) / WORD_BITS;
+	fa->fa_committed = calloc(nwords, sizeof(fa->fa_committed[0]));
+	fa->fa_referenced = calloc(nwords, sizeof(fa->fa_referenced[0]));
+	fa->fa_trimming = calloc(nwords, sizeof(fa->fa_trimming[0]));
+	fa->fa_busy = calloc(fa->fa_nchunks, sizeof(fa->fa_busy[0]));
+	if (fa->fa_committed == NULL || fa->fa_referenced == NULL ||
+	    fa->fa_trimming == NULL || fa->fa_busy == NULL)
+		goto fail;
+
+	/* power-of-two chunks are aligned, so huge pages can back them */
+	granule = (chunk & (chunk - 1)) == 0 ? chunk : 0;
+	if ((fa->fa_base = fault_reserve(size, granule)) == NULL)
+		goto fail;
+
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = fa->fa_base,
+		.fr_len = size,
+		.fr_act = { .fa_fun = arena_fault, .fa_arg = fa },
+		.fr_granule = granule
+	    }) != 0) {
+		munmap(fa->fa_base, size);
+		goto fail;
+	}
+
+	return fa;
+
+fail:
+	free(fa->fa_committed);
+	free(fa->fa_referenced);
+	free(fa->fa_trimming);
+	free(fa->fa_busy);
+	free(fa);
+	return NULL;
+}
+
+void
+fault_arena_destroy(struct faultarena *fa)
+{
+	fault_unregister(fa->fa_base);
+	munmap(fa->fa_base, fa->fa_size);
+	free(fa->fa_committed);
+	free(fa->fa_referenced);
+	free(fa->fa_trimming);
+	free(fa->fa_busy);
+	free(fa);
+}
+
+void *
+fault_arena_base(const struct faultarena *fa)
+{
+	return fa->fa_base;
+}
+
+/*
+ * Hand out address space; nothing is committed until it is touched.
+ */
+void *
+fault_arena_alloc(struct faultarena *fa, size_t len, size_t align)
+{
+	size_t off, noff;
+
+	if (align == 0)
+		align = sizeof(void *);
+
+	off = atomic_load_explicit(&fa->fa_brk, memory_order_relaxed);
+	do {
+		noff = (off + align - 1) / align * align + len;
+		if (noff > fa->fa_size || noff < off) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	} while (!atomic_compare_exchange_weak(&fa->fa_brk, &off, noff));
+
+	return fa->fa_base + noff - len;
+}
+
+/*
+ * Give the chunks wholly inside [addr, addr + len) back to the system.
+ * Their contents are lost: they read as zero again with FAULT_ARENA_ZERO,
+ * and are undefined otherwise (MADV_FREE lets the kernel take its time).
+ */
+int
+fault_arena_decommit(struct faultarena *fa, void *addr, size_t len)
+{
+	size_t first = ((char *) addr - fa->fa_base + fa->fa_chunk - 1) /
+	    fa->fa_chunk,
+	    last = ((char *) addr - fa->fa_base + len) / fa->fa_chunk;
+	int advice = MADV_DONTNEED;
+
+	if ((char *) addr < fa->fa_base ||
+	    (char *) addr + len > fa->fa_base + fa->fa_size) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (first >= last)
+		return 0;
+
+#if defined(MADV_FREE)
+	if (!(fa->fa_flags & FAULT_ARENA_ZERO))
+		advice = MADV_FREE;
+#endif
+
+	for (size_t c = first; c < last; c++) {
+		unsigned long bit = 1UL << c % WORD_BITS;
+
+		atomic_fetch_and(&fa->fa_committed[c / WORD_BITS], ~bit);
+		atomic_fetch_and(&fa->fa_referenced[c / WORD_BITS], ~bit);
+	}
+
+	len = (last - first) * fa->fa_chunk;
+	addr = fa->fa_base + first * fa->fa_chunk;
+	if (mprotect(addr, len, PROT_NONE) != 0 ||
+	    madvise(addr, len, advice) != 0)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Apply fun to each run of chunks whose bit is set in bits.
+ */
+static int
+arena_runs(struct faultarena *fa, const atomic_ulong *bits,
+    int (*fun)(void *, size_t, int), int arg)
+{
+	size_t run = 0;
+	int res = 0;
+
+	for (size_t c = 0; c <= fa->fa_nchunks; c++) {
+		if (c < fa->fa_nchunks &&
+		    (atomic_load(&bits[c / WORD_BITS]) & 1UL << c % WORD_BITS))
+			continue;
+		if (c > run && fun(fa->fa_base + run * fa->fa_chunk,
+		    (c - run) * fa->fa_chunk, arg) != 0)
+			res = -1;
+		run = c + 1;
+	}
+
+	return res;
+}
+
+/*
+ * Decommit every chunk that has not been touched since the previous
+ * trim, and re-arm the rest so the next touch marks them referenced
+ * again.  Runs of chunks in the same state are handled with a single
+ * mprotect/madvise each.  Returns the number of chunks decommitted.
+ * Safe to call while other threads use the arena, though not from two
+ * threads at once.
+ */
+ssize_t
+fault_arena_trim(struct faultarena *fa)
+{
+	size_t nwords = (fa->fa_nchunks + WORD_BITS - 1) / WORD_BITS,
+	    ncold = 0;
+	int advice = MADV_DONTNEED, res = 0;
+	atomic_ulong *cold;
+
+#if defined(MADV_FREE)
+	if (!(fa->fa_flags & FAULT_ARENA_ZERO))
+		advice = MADV_FREE;
+#endif
+
+	if ((cold = calloc(nwords, sizeof(cold[0]))) == NULL)
+		return -1;
+
+	for (size_t w = 0; w < nwords; w++)
+		atomic_store(&fa->fa_trimming[w],
+		    atomic_load(&fa->fa_committed[w]));
+	for (size_t c = 0; c < fa->fa_nchunks; c++)
+		if (atomic_load(&fa->fa_trimming[c / WORD_BITS]) &
+		    1UL << c % WORD_BITS)
+			while (atomic_load(&fa->fa_busy[c]) != 0)
+				sched_yield();
+
+	if (arena_runs(fa, fa->fa_trimming, mprotect, PROT_NONE) != 0) {
+		res = -1;
+		goto out;
+	}
+
+	for (size_t w = 0; w < nwords; w++) {
+		unsigned long trim = atomic_load(&fa->fa_trimming[w]),
+		    c = trim & ~atomic_fetch_and(&fa->fa_referenced[w], ~trim);
+
+		atomic_fetch_and(&fa->fa_committed[w], ~c);
+		atomic_store(&cold[w], c);
+		ncold += __builtin_popcountl(c);
+	}
+	if (arena_runs(fa, cold, madvise, advice) != 0)
+		res = -1;
+
+out:
+	for (size_t w = 0; w < nwords; w++)
+		atomic_store(&fa->fa_trimming[w], 0);
+	free(cold);
+
+	return res == 0 ? (ssize_t) ncold : -1;
+}
+
+size_t
+fault_arena_committed(const struct faultarena *fa)
+{
+	size_t n = 0;
+
+	for (size_t w = 0; w < (fa->fa_nchunks + WORD_BITS - 1) / WORD_BITS;
+	     w++)
+		n += __builtin_popcountl(atomic_load(&fa->fa_committed[w]));
+
+	return n * fa->fa_chunk;
+}
@@ -0,0 +1,467 @@
+#include "fault.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+/*
+ * Fault handling benchmarks.  Every result is printed as one JSON object
+ * per line, so runs can be collected and compared mechanically:
+ *
+ *	{"bench":"latency","threads":1,"iters":100000,"unit":"ns",
+ *	 "min":..,"p50":..,"p90":..,"p99":..,"max":..,"mean":..}
+ */
+
+static long
+page_size;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+report(const char *name, int threads, uint64_t *samples, size_t n)
+{
+	uint64_t sum = 0;
+
+	qsort(samples, n, sizeof(samples[0]), cmp);
+	for (size_t i = 0; i < n; i++)
+		sum += samples[i];
+
+	printf("{\"bench\":\"%s\",\"threads\":%d,\"iters\":%zu,\"unit\":\"ns\","
+	    "\"min\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,"
+	    "\"max\":%llu,\"mean\":%llu}\n", name, threads, n,
+	    (unsigned long long) samples[0],
+	    (unsigned long long) samples[n / 2],
+	    (unsigned long long) samples[n * 9 / 10],
+	    (unsigned long long) samples[n * 99 / 100],
+	    (unsigned long long) samples[n - 1],
+	    (unsigned long long) (sum / n));
+	fflush(stdout);
+}
+
+static void *
+map(size_t npages, int prot)
+{
+	void *addr = mmap(NULL, npages * page_size, prot,
+	    MAP_PRIVATE | MAP_ANON, -1, 0);
+
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	return addr;
+}
+
+static volatile _Thread_local uint64_t
+t_fault;
+
+static int
+stamp_retry(int flt, const struct faultinfo *fi, void *arg)
+{
+	if (t_fault == 0)
+		t_fault = now();
+
+	return mprotect((void *) ((uintptr_t) fi->fi_addr & -page_size),
+	    page_size, PROT_READ | PROT_WRITE) == 0;
+}
+
+/*
+ * Time from the faulting access to the first instruction of the handler.
+ */
+static void
+bench_latency(size_t iters)
+{
+	volatile char *page = map(1, PROT_NONE);
+	uint64_t *samples = calloc(iters, sizeof(samples[0]));
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+		.fa_fun = stamp_retry
+	}, NULL);
+
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t start;
+
+		mprotect((void *) page, page_size, PROT_NONE);
+		t_fault = 0;
+		start = now();
+		*page = 1;
+		samples[i] = t_fault - start;
+	}
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) { 0 }, NULL);
+	report("latency", 1, samples, iters);
+	free(samples);
+	munmap((void *) page, page_size);
+}
+
+/*
+ * Full round trip: fault, handler mprotects the page and returns 1, the
+ * access is retried and completes.
+ */
+static void
+bench_retry(size_t iters)
+{
+	volatile char *page = map(1, PROT_NONE);
+	uint64_t *samples = calloc(iters, sizeof(samples[0]));
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+		.fa_fun = stamp_retry
+	}, NULL);
+
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t start;
+
+		mprotect((void *) page, page_size, PROT_NONE);
+		start = now();
+		*page = 1;
+		samples[i] = now() - start;
+	}
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) { 0 }, NULL);
+	report("retry", 1, samples, iters);
+	free(samples);
+	munmap((void *) page, page_size);
+}
+
+static int
+emulate(int flt, const struct faultinfo *fi, void *arg)
+{
+	struct faultaccess fc;
+
+	if (fault_decode(fi, &fc) != 0)
+		return 0;
+
+	return fault_emulate(fi, (char *) arg +
+	    ((uintptr_t) fc.fc_addr & (page_size - 1))) == 0;
+}
+
+/*
+ * Same round trip, but the handler emulates the access against a shadow
+ * page and the protected page stays protected.
+ */
+static void
+bench_emulate(size_t iters)
+{
+	volatile char *page = map(1, PROT_NONE);
+	char *shadow = map(1, PROT_READ | PROT_WRITE);
+	uint64_t *samples = calloc(iters, sizeof(samples[0]));
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+		.fa_fun = emulate,
+		.fa_arg = shadow
+	}, NULL);
+
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t start = now();
+
+		*page = 1;
+		samples[i] = now() - start;
+	}
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) { 0 }, NULL);
+	report("emulate", 1, samples, iters);
+	free(samples);
+	munmap((void *) page, page_size);
+	munmap(shadow, page_size);
+}
+
+static sigjmp_buf
+env;
+
+static int
+escape(int flt, const struct faultinfo *fi, void *arg)
+{
+	siglongjmp(env, 1);
+}
+
+/*
+ * Fault and leave the handler with siglongjmp, including the sigsetjmp
+ * that has to precede every guarded access.
+ */
+static void
+bench_longjmp(size_t iters)
+{
+	volatile char *page = map(1, PROT_NONE);
+	uint64_t *samples = calloc(iters, sizeof(samples[0]));
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+		.fa_fun = escape
+	}, NULL);
+
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t start = now();
+
+		if (!sigsetjmp(env, 1))
+			(void) *page;
+		samples[i] = now() - start;
+	}
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) { 0 }, NULL);
+	report("longjmp", 1, samples, iters);
+	free(samples);
+	munmap((void *) page, page_size);
+}
+
+/*
+ * fault_fetch32 on a readable page and on a PROT_NONE one; compare with
+ * longjmp above.
+ */
+static void
+bench_probe(size_t iters)
+{
+	char *pages = map(2, PROT_READ);
+	uint64_t *samples = calloc(iters, sizeof(samples[0]));
+	uint32_t val;
+
+	fault_probe_init();
+	mprotect(pages + page_size, page_size, PROT_NONE);
+
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t start = now();
+
+		fault_fetch32(pages, &val);
+		samples[i] = now() - start;
+	}
+	report("probe", 1, samples, iters);
+
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t start = now();
+
+		fault_fetch32(pages + page_size, &val);
+		samples[i] = now() - start;
+	}
+	report("probe_fault", 1, samples, iters);
+
+	free(samples);
+	munmap(pages, 2 * page_size);
+}
+
+/*
+ * malloc and free of small blocks, plain and through a guard pool at the
+ * default sampling rate.  Timed in batches, since one pair costs less
+ * than reading the clock.
+ */
+#define GUARD_BATCH	100
+
+static void
+bench_guard(size_t iters)
+{
+	struct faultguard *gu = fault_guard_create(256, 0, NULL, NULL);
+	uint64_t *samples = calloc(iters, sizeof(samples[0]));
+	void *volatile p;
+
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t start = now();
+
+		for (int j = 0; j < GUARD_BATCH; j++) {
+			p = malloc(64);
+			free(p);
+		}
+		samples[i] = (now() - start) / GUARD_BATCH;
+	}
+	report("malloc", 1, samples, iters);
+
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t start = now();
+
+		for (int j = 0; j < GUARD_BATCH; j++) {
+			if ((p = fault_guard_malloc(gu, 64)) == NULL)
+				p = malloc(64);
+			if (fault_guard_free(gu, p) != 0)
+				free(p);
+		}
+		samples[i] = (now() - start) / GUARD_BATCH;
+	}
+	report("guard_malloc", 1, samples, iters);
+
+	free(samples);
+	fault_guard_destroy(gu);
+}
+
+static void
+bench_install(size_t iters)
+{
+	uint64_t *samples = calloc(iters, sizeof(samples[0]));
+
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t start = now();
+
+		fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+			.fa_fun = escape
+		}, NULL);
+		fault(FAULT_BAD_ACCESS, &(struct faultaction) { 0 }, NULL);
+		samples[i] = now() - start;
+	}
+	report("install", 1, samples, iters);
+
+	for (size_t i = 0; i < iters; i++) {
+		uint64_t start = now();
+
+		fault_thread(FAULT_BAD_ACCESS, &(struct faultaction) {
+			.fa_fun = escape
+		}, NULL);
+		fault_thread(FAULT_BAD_ACCESS, &(struct faultaction) { 0 },
+		    NULL);
+		samples[i] = now() - start;
+	}
+	report("install_thread", 1, samples, iters);
+
+	free(samples);
+}
+
+struct worker {
+	pthread_t		 thread;
+	volatile char		*page;
+	size_t			 iters;
+	uint64_t		*samples;
+	pthread_barrier_t	*barrier;
+};
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	pthread_barrier_wait(w->barrier);
+
+	for (size_t i = 0; i < w->iters; i++) {
+		uint64_t start;
+
+		mprotect((void *) w->page, page_size, PROT_NONE);
+		start = now();
+		*w->page = 1;
+		w->samples[i] = now() - start;
+	}
+
+	return NULL;
+}
+
+/*
+ * N threads faulting concurrently, each on its own page or all on the
+ * same one.  Besides per-fault latency, reports aggregate throughput in
+ * faults per second.
+ */
+static void
+bench_scaling(size_t iters, int maxthreads, int shared)
+{
+	const char *name = shared ? "scaling_shared" : "scaling_private";
+	char *pages = map(maxthreads, PROT_NONE);
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+		.fa_fun = stamp_retry
+	}, NULL);
+
+	for (int n = 1; n <= maxthreads; n *= 2) {
+		struct worker workers[n];
+		pthread_barrier_t barrier;
+		uint64_t *samples = calloc(n * iters, sizeof(samples[0])),
+		    start, elapsed;
+
+		pthread_barrier_init(&barrier, NULL, n + 1);
+		for (int i = 0; i < n; i++) {
+			workers[i] = (struct worker) {
+				.page = pages + (shared ? 0 : i) * page_size,
+				.iters = iters,
+				.samples = samples + i * iters,
+				.barrier = &barrier
+			};
+			pthread_create(&workers[i].thread, NULL, worker_main,
+			    &workers[i]);
+		}
+
+		pthread_barrier_wait(&barrier);
+		start = now();
+		for (int i = 0; i < n; i++)
+			pthread_join(workers[i].thread, NULL);
+		elapsed = now() - start;
+
+		report(name, n, samples, n * iters);
+		printf("{\"bench\":\"%s_throughput\",\"threads\":%d,"
+		    "\"iters\":%zu,\"unit\":\"faults/s\",\"value\":%.0f}\n",
+		    name, n, n * iters, n * iters * 1e9 / elapsed);
+		fflush(stdout);
+
+		pthread_barrier_destroy(&barrier);
+		free(samples);
+	}
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) { 0 }, NULL);
+	munmap(pages, maxthreads * page_size);
+}
+
+int
+main(int argc, char *argv[])
+{
+	size_t iters = 100000;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN), ch;
+	const char *only = NULL;
+
+	while ((ch = getopt(argc, argv, "b:n:t:")) != -1) {
+		switch (ch) {
+		case 'b':
+			only = optarg;
+			break;
+		case 'n':
+			iters = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b bench] [-n iters] "
+			    "[-t threads]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (iters == 0 || threads < 1) {
+		fprintf(stderr, "%s: bad iteration or thread count\n", argv[0]);
+		return 1;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	if (only == NULL || strcmp(only, "latency") == 0)
+		bench_latency(iters);
+	if (only == NULL || strcmp(only, "retry") == 0)
+		bench_retry(iters);
+	if (only == NULL || strcmp(only, "emulate") == 0)
+		bench_emulate(iters);
+	if (only == NULL || strcmp(only, "longjmp") == 0)
+		bench_longjmp(iters);
+	if (only == NULL || strcmp(only, "probe") == 0)
+		bench_probe(iters);
+	if (only == NULL || strcmp(only, "guard") == 0)
+		bench_guard(iters);
+	if (only == NULL || strcmp(only, "install") == 0)
+		bench_install(iters);
+	if (only == NULL || strcmp(only, "scaling") == 0) {
+		bench_scaling(iters, threads, 0);
+		bench_scaling(iters, threads, 1);
+	}
+
+	return 0;
+}
@@ -0,0 +1,498 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Compressed memory.  The range is a shared memory object mapped twice:
+ * once for the application and once, always read-write, for us.  Each
+ * scan works like a clock: resident pages that were touched since the
+ * previous scan are put on probation by making them PROT_NONE, and pages
+ * still on probation are compressed and their memory handed back.  A
+ * fault on a page on probation just reopens it; a fault on a compressed
+ * page decompresses it through the second mapping, where nobody else can
+ * see it half done, before reopening it.
+ *
+ * Pages that are all one repeated word (zero, most of the time) are kept
+ * as that word.  Others go through a small LZ77 codec; pages that do not
+ * shrink to COMP_MAXRATIO stay resident.
+ *
+ * The fault handler cannot free, so a decompressed page keeps its buffer
+ * until the next scan gets round to it.
+ */
+
+#include "fault.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#if defined(__linux__)
+# include <linux/memfd.h>
+# include <sys/syscall.h>
+#endif
+
+#define COMP_HOT	0
+#define COMP_PROBATION	1
+#define COMP_STORED	2
+#define COMP_BUSY	3
+
+/* compressed pages must come to at most this much of a page, in 1/8ths */
+#define COMP_MAXRATIO	6
+
+#define LZ_HASHBITS	12
+#define LZ_MINMATCH	4
+
+struct comppage {
+	atomic_uint		 cp_state;
+	uint32_t		 cp_len;
+	uint64_t		 cp_fill;	/* when cp_data is NULL */
+	unsigned char		*cp_data;
+};
+
+struct faultcomp {
+	char			*fc_base,
+				*fc_alias;
+	size_t			 fc_len,
+				 fc_npages,
+				 fc_pagesz;
+	int			 fc_fd;
+	struct comppage		*fc_pages;
+	pthread_mutex_t		 fc_lock;
+	unsigned char		*fc_buf;
+	atomic_size_t		 fc_stored,
+				 fc_filled,
+				 fc_bytes;
+	atomic_uint_least64_t	 fc_faults,
+				 fc_ns;
+};
+
+static uint32_t
+lz_hash(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return (v * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+
+static unsigned char *
+lz_putlen(unsigned char *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+/*
+ * Compress n bytes (at most 64 KiB) into out, which has room for max.
+ * Sequences are a token byte (literal count << 4 | match length - 4,
+ * either nibble 15 meaning more length bytes follow), the literals, and
+ * a little-endian 16-bit match distance.  The last sequence is literals
+ * only.  Returns the compressed length, or 0 if it did not fit.
+ */
+static size_t
+lz_compress(const unsigned char *in, size_t n, unsigned char *out, size_t max)
+{
+	uint16_t table[1 << LZ_HASHBITS] = { 0 };
+	const unsigned char *ip = in, *anchor = in, *end = in + n,
+	    *limit = end - LZ_MINMATCH;
+	unsigned char *op = out, *oend = out + max;
+
+	while (ip < limit) {
+		const unsigned char *ref;
+		uint32_t h = lz_hash(ip);
+		size_t lit, mlen;
+
+		ref = in + table[h];
+		table[h] = ip - in;
+		if (ref >= ip || ip - ref > UINT16_MAX ||
+		    memcmp(ref, ip, LZ_MINMATCH) != 0) {
+			ip++;
+			continue;
+		}
+
+		for (mlen = LZ_MINMATCH; ip + mlen < end &&
+		    ref[mlen] == ip[mlen]; mlen++)
+			;
+
+		lit = ip - anchor;
+		if (op + 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 > oend)
+			return 0;
+		*op = (lit < 15 ? lit : 15) << 4 |
+		    (mlen - LZ_MINMATCH < 15 ? mlen - LZ_MINMATCH : 15);
+		op++;
+		if (lit >= 15)
+			op = lz_putlen(op, lit - 15);
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+		if (mlen - LZ_MINMATCH >= 15)
+			op = lz_putlen(op, mlen - LZ_MINMATCH - 15);
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	n = end - anchor;
+	if (op + 1 + n / 255 + 1 + n > oend)
+		return 0;
+	*op++ = (n < 15 ? n : 15) << 4;
+	if (n >= 15)
+		op = lz_putlen(op, n - 15);
+	memcpy(op, anchor, n);
+	op += n;
+
+	return op - out;
+}
+
+static size_t
+lz_getlen(const unsigned char **ip, size_t len)
+{
+	if (len == 15) {
+		unsigned char c;
+
+		do
+			len += (c = *(*ip)++);
+		while (c == 255);
+	}
+
+	return len;
+}
+
+/*
+ * Decompress our own output; no checking.  Safe to call from the fault
+ * handler.
+ */
+static void
+lz_decompress(const unsigned char *ip, size_t n, unsigned char *out)
+{
+	const unsigned char *end = ip + n;
+	unsigned char *op = out;
+
+	for (;;) {
+		unsigned int token = *ip++;
+		size_t len = lz_getlen(&ip, token >> 4), dist;
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		if (ip >= end)
+			break;
+
+		dist = ip[0] | ip[1] << 8;
+		ip += 2;
+		len = lz_getlen(&ip, token & 15) + LZ_MINMATCH;
+		/* byte by byte: the match may overlap what it produces */
+		for (; len > 0; len--, op++)
+			*op = op[-dist];
+	}
+}
+
+static uint64_t
+comp_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Fill a page back in through the alias.  Runs in the fault handler.
+ */
+static void
+comp_restore(struct faultcomp *fc, size_t page)
+{
+	struct comppage *cp = &fc->fc_pages[page];
+	char *alias = fc->fc_alias + page * fc->fc_pagesz;
+
+	if (cp->cp_data != NULL) {
+		lz_decompress(cp->cp_data, cp->cp_len, (unsigned char *) alias);
+		atomic_fetch_sub(&fc->fc_bytes, cp->cp_len);
+	} else if (cp->cp_fill != 0) {
+		for (size_t i = 0; i < fc->fc_pagesz; i += sizeof(cp->cp_fill))
+			memcpy(alias + i, &cp->cp_fill, sizeof(cp->cp_fill));
+		atomic_fetch_sub(&fc->fc_filled, 1);
+	} else {
+		/* a hole reads as zero already */
+		atomic_fetch_sub(&fc->fc_filled, 1);
+	}
+	atomic_fetch_sub(&fc->fc_stored, 1);
+}
+
+static int
+comp_fault(int flt, const struct faultinfo *fi, void *arg)
+{
+	struct faultcomp *fc = arg;
+	size_t page = ((char *) fi->fi_addr - fc->fc_base) / fc->fc_pagesz;
+	atomic_uint *state = &fc->fc_pages[page].cp_state;
+	unsigned int st = atomic_load(state);
+
+	while (st == COMP_PROBATION || st == COMP_STORED) {
+		uint64_t start;
+
+		if (!atomic_compare_exchange_weak(state, &st, COMP_BUSY))
+			continue;
+
+		if (st == COMP_STORED) {
+			start = comp_now();
+			comp_restore(fc, page);
+			atomic_fetch_add(&fc->fc_faults, 1);
+			atomic_fetch_add(&fc->fc_ns, comp_now() - start);
+		}
+
+		if (mprotect(fc->fc_base + page * fc->fc_pagesz, fc->fc_pagesz,
+		    PROT_READ | PROT_WRITE) != 0) {
+			atomic_store(state, st == COMP_STORED ?
+			    COMP_PROBATION : st);
+			return 0;
+		}
+		atomic_store(state, COMP_HOT);
+		return 1;
+	}
+
+	while (st == COMP_BUSY) {
+		sched_yield();
+		st = atomic_load(state);
+	}
+
+	return 1;
+}
+
+static int
+comp_open(size_t len)
+{
+	int fd;
+
+#if defined(__linux__)
+	fd = syscall(SYS_memfd_create, "faultcomp", MFD_CLOEXEC);
+#else
+	char name[64];
+
+	snprintf(name, sizeof(name), "/faultcomp.%ld.%p", (long) getpid(),
+	    (void *) &name);
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0)
+		shm_unlink(name);
+#endif
+	if (fd >= 0 && ftruncate(fd, len) != 0) {
+		close(fd);
+		fd = -1;
+	}
+
+	return fd;
+}
+
+struct faultcomp *
+fault_comp_create(size_t len)
+{
+	struct faultcomp *fc;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	if (len == 0 || page_size > 65536) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((fc = calloc(1, sizeof(*fc))) == NULL)
+		return NULL;
+
+	fc->fc_pagesz = page_size;
+	fc->fc_npages = (len + page_size - 1) / page_size;
+	fc->fc_len = fc->fc_npages * page_size;
+	fc->fc_base = fc->fc_alias = MAP_FAILED;
+	fc->fc_fd = -1;
+	pthread_mutex_init(&fc->fc_lock, NULL);
+
+	if ((fc->fc_pages = calloc(fc->fc_npages,
+	    sizeof(fc->fc_pages[0]))) == NULL ||
+	    (fc->fc_buf = malloc(page_size)) == NULL ||
+	    (fc->fc_fd = comp_open(fc->fc_len)) < 0)
+		goto fail;
+
+	fc->fc_base = mmap(NULL, fc->fc_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fc->fc_fd, 0);
+	fc->fc_alias = mmap(NULL, fc->fc_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, fc->fc_fd, 0);
+	if (fc->fc_base == MAP_FAILED || fc->fc_alias == MAP_FAILED)
+		goto fail;
+
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = fc->fc_base,
+		.fr_len = fc->fc_len,
+		.fr_act = { .fa_fun = comp_fault, .fa_arg = fc }
+	    }) != 0)
+		goto fail;
+
+	return fc;
+
+fail:
+	if (fc->fc_base != MAP_FAILED)
+		munmap(fc->fc_base, fc->fc_len);
+	if (fc->fc_alias != MAP_FAILED)
+		munmap(fc->fc_alias, fc->fc_len);
+	if (fc->fc_fd >= 0)
+		close(fc->fc_fd);
+	free(fc->fc_buf);
+	free(fc->fc_pages);
+	free(fc);
+	return NULL;
+}
+
+void *
+fault_comp_base(const struct faultcomp *fc)
+{
+	return fc->fc_base;
+}
+
+/*
+ * Compress a page on probation, which nobody can touch while it is busy.
+ * Leaves it on probation if it does not compress well enough.
+ */
+static int
+comp_store(struct faultcomp *fc, size_t page)
+{
+	struct comppage *cp = &fc->fc_pages[page];
+	char *alias = fc->fc_alias + page * fc->fc_pagesz;
+	uint64_t fill;
+	size_t i, n;
+
+	free(cp->cp_data);
+	cp->cp_data = NULL;
+
+	memcpy(&fill, alias, sizeof(fill));
+	for (i = sizeof(fill); i < fc->fc_pagesz; i += sizeof(fill))
+		if (memcmp(alias + i, &fill, sizeof(fill)) != 0)
+			break;
+
+	if (i >= fc->fc_pagesz) {
+		cp->cp_fill = fill;
+		atomic_fetch_add(&fc->fc_filled, 1);
+	} else {
+		n = lz_compress((const unsigned char *) alias, fc->fc_pagesz,
+		    fc->fc_buf, fc->fc_pagesz * COMP_MAXRATIO / 8);
+		if (n == 0 || (cp->cp_data = malloc(n)) == NULL)
+			return -1;
+		memcpy(cp->cp_data, fc->fc_buf, n);
+		cp->cp_len = n;
+		atomic_fetch_add(&fc->fc_bytes, n);
+	}
+
+#if defined(MADV_REMOVE)
+	madvise(alias, fc->fc_pagesz, MADV_REMOVE);
+#endif
+	atomic_fetch_add(&fc->fc_stored, 1);
+
+	return 0;
+}
+
+/*
+ * One turn of the clock.  Returns the number of pages compressed.
+ */
+ssize_t
+fault_comp_scan(struct faultcomp *fc)
+{
+	size_t stored = 0, run = 0;
+
+	pthread_mutex_lock(&fc->fc_lock);
+
+	for (size_t page = 0; page <= fc->fc_npages; page++) {
+		struct comppage *cp = &fc->fc_pages[page];
+		unsigned int st;
+
+		if (page < fc->fc_npages) {
+			st = atomic_load(&cp->cp_state);
+			if (st == COMP_HOT) {
+				/* decompressed since the last scan */
+				free(cp->cp_data);
+				cp->cp_data = NULL;
+				cp->cp_fill = 0;
+				atomic_store(&cp->cp_state, COMP_PROBATION);
+				run++;
+				continue;
+			}
+		}
+
+		/* close off a run of pages put on probation */
+		if (run > 0 && mprotect(fc->fc_base +
+		    (page - run) * fc->fc_pagesz, run * fc->fc_pagesz,
+		    PROT_NONE) != 0) {
+			for (size_t i = page - run; i < page; i++)
+				atomic_store(&fc->fc_pages[i].cp_state,
+				    COMP_HOT);
+		}
+		run = 0;
+		if (page == fc->fc_npages)
+			break;
+
+		st = COMP_PROBATION;
+		if (!atomic_compare_exchange_strong(&cp->cp_state, &st,
+		    COMP_BUSY))
+			continue;
+		if (comp_store(fc, page) == 0) {
+			atomic_store(&cp->cp_state, COMP_STORED);
+			stored++;
+		} else {
+			atomic_store(&cp->cp_state, COMP_PROBATION);
+		}
+	}
+
+	pthread_mutex_unlock(&fc->fc_lock);
+
+	return stored;
+}
+
+int
+fault_comp_stats(const struct faultcomp *fc, struct faultcompstats *cs)
+{
+	*cs = (struct faultcompstats) {
+		.cs_pages = fc->fc_npages,
+		.cs_stored = atomic_load(&fc->fc_stored),
+		.cs_filled = atomic_load(&fc->fc_filled),
+		.cs_bytes = atomic_load(&fc->fc_bytes),
+		.cs_faults = atomic_load(&fc->fc_faults),
+		.cs_ns = atomic_load(&fc->fc_ns)
+	};
+
+	return 0;
+}
+
+void
+fault_comp_destroy(struct faultcomp *fc)
+{
+	fault_unregister(fc->fc_base);
+	munmap(fc->fc_base, fc->fc_len);
+	munmap(fc->fc_alias, fc->fc_len);
+	close(fc->fc_fd);
+	for (size_t page = 0; page < fc->fc_npages; page++)
+		free(fc->fc_pages[page].cp_data);
+	free(fc->fc_pages);
+	free(fc->fc_buf);
+	pthread_mutex_destroy(&fc->fc_lock);
+	free(fc);
+}
@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Concurrent compaction.  The heap is a shared memory object mapped twice,
+ * once for the mutators and once, always read-write, for copying.  Pages
+ * picked for evacuation are made PROT_NONE in one batch; from then on
+ * they are copied out by whoever gets to them first, the collector or a
+ * mutator that faults on one.  Once a page has been evacuated, accesses
+ * to it are carried out against the new copy: the forwarding hook says
+ * where each address went, and the access is emulated there.
+ *
+ *	IDLE -> SELECTED -> COPYING -> EVACUATED -> RELEASING -> IDLE
+ *
+ * The copy hook runs on whichever thread claims the page, quite possibly
+ * in the fault handler.
+ */
+
+#include "fault.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#if defined(__linux__)
+# include <linux/memfd.h>
+# include <sys/syscall.h>
+#endif
+
+#define COMPACT_IDLE		0
+#define COMPACT_SELECTED	1
+#define COMPACT_COPYING		2
+#define COMPACT_EVACUATED	3
+#define COMPACT_RELEASING	4	/* evacuated, taken by a release */
+
+struct faultcompact {
+	char			*cm_base,
+				*cm_alias;
+	size_t			 cm_len,
+				 cm_npages,
+				 cm_pagesz;
+	int			 cm_fd;
+	struct faultcompactops	 cm_ops;
+	void			*cm_arg;
+	atomic_uchar		*cm_state;
+	struct faultpages	*cm_pages;
+	pthread_mutex_t		 cm_lock;
+	atomic_uint_least64_t	 cm_copied,
+				 cm_assists,
+				 cm_forwarded;
+};
+
+/*
+ * Make sure page has been evacuated, copying it here if nobody has yet;
+ * -1 if it was never selected.  Safe in the fault handler, as far as
+ * the copy hook is.
+ */
+static int
+compact_evacuate(struct faultcompact *cm, size_t page,
+    atomic_uint_least64_t *count)
+{
+	atomic_uchar *state = &cm->cm_state[page];
+	unsigned char st = atomic_load(state);
+	size_t off = page * cm->cm_pagesz;
+
+	for (;;) {
+		switch (st) {
+		case COMPACT_IDLE:
+			errno = EINVAL;
+			return -1;
+		case COMPACT_SELECTED:
+			if (!atomic_compare_exchange_weak(state, &st,
+			    COMPACT_COPYING))
+				continue;
+			if (cm->cm_ops.co_copy(cm->cm_alias + off,
+			    cm->cm_base + off, cm->cm_pagesz, cm->cm_arg) != 0) {
+				atomic_store(state, COMPACT_SELECTED);
+				errno = EIO;
+				return -1;
+			}
+			atomic_store(state, COMPACT_EVACUATED);
+			atomic_fetch_add(count, 1);
+			return 0;
+		case COMPACT_COPYING:
+			sched_yield();
+			st = atomic_load(state);
+			break;
+		default:
+			return 0;
+		}
+	}
+}
+
+static int
+compact_fault(int flt, const struct faultinfo *fi, void *arg)
+{
+	struct faultcompact *cm = arg;
+	size_t page = ((char *) fi->fi_addr - cm->cm_base) / cm->cm_pagesz;
+	void *to;
+
+	if (compact_evacuate(cm, page, &cm->cm_assists) != 0)
+		/* released in the meantime, so open again */
+		return atomic_load(&cm->cm_state[page]) == COMPACT_IDLE;
+
+	if ((to = cm->cm_ops.co_forward(fi->fi_addr, cm->cm_arg)) == NULL ||
+	    fault_emulate(fi, to) != 0)
+		return 0;
+	atomic_fetch_add_explicit(&cm->cm_forwarded, 1, memory_order_relaxed);
+
+	return 1;
+}
+
+static int
+compact_open(size_t len)
+{
+	int fd;
+
+#if defined(__linux__)
+	fd = syscall(SYS_memfd_create, "faultcompact", MFD_CLOEXEC);
+#else
+	char name[64];
+
+	snprintf(name, sizeof(name), "/faultcompact.%ld.%p", (long) getpid(),
+	    (void *) &name);
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0)
+		shm_unlink(name);
+#endif
+	if (fd >= 0 && ftruncate(fd, len) != 0) {
+		close(fd);
+		fd = -1;
+	}
+
+	return fd;
+}
+
+/*
+ * A heap of len bytes, read-write to begin with, to be compacted with
+ * ops; arg goes to both hooks.
+ */
+struct faultcompact *
+fault_compact_create(size_t len, const struct faultcompactops *ops,
+    void *arg)
+{
+	struct faultcompact *cm;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	if (len == 0 || ops == NULL || ops->co_copy == NULL ||
+	    ops->co_forward == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((cm = calloc(1, sizeof(*cm))) == NULL)
+		return NULL;
+
+	cm->cm_pagesz = page_size;
+	cm->cm_npages = (len + page_size - 1) / page_size;
+	cm->cm_len = cm->cm_npages * page_size;
+	cm->cm_ops = *ops;
+	cm->cm_arg = arg;
+	cm->cm_base = cm->cm_alias = MAP_FAILED;
+	cm->cm_fd = -1;
+	pthread_mutex_init(&cm->cm_lock, NULL);
+
+	if ((cm->cm_state = calloc(cm->cm_npages,
+	    sizeof(cm->cm_state[0]))) == NULL ||
+	    (cm->cm_fd = compact_open(cm->cm_len)) < 0)
+		goto fail;
+
+	cm->cm_base = mmap(NULL, cm->cm_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, cm->cm_fd, 0);
+	cm->cm_alias = mmap(NULL, cm->cm_len, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, cm->cm_fd, 0);
+	if (cm->cm_base == MAP_FAILED || cm->cm_alias == MAP_FAILED)
+		goto fail;
+
+	if ((cm->cm_pages = fault_pages_create(cm->cm_base, cm->cm_len,
+	    FAULT_PAGES_WRITE)) == NULL)
+		goto fail;
+
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = cm->cm_base,
+		.fr_len = cm->cm_len,
+		.fr_act = { .fa_fun = compact_fault, .fa_arg = cm }
+	    }) != 0) {
+		fault_pages_destroy(cm->cm_pages);
+		goto fail;
+	}
+
+	return cm;
+
+fail:
+	if (cm->cm_base != MAP_FAILED)
+		munmap(cm->cm_base, cm->cm_len);
+	if (cm->cm_alias != MAP_FAILED)
+		munmap(cm->cm_alias, cm->cm_len);
+	if (cm->cm_fd >= 0)
+		close(cm->cm_fd);
+	pthread_mutex_destroy(&cm->cm_lock);
+	free(cm->cm_state);
+	free(cm);
+	return NULL;
+}
+
+void *
+fault_compact_base(const struct faultcompact *cm)
+{
+	return cm->cm_base;
+}
+
+/*
+ * The pages of the heap that [addr, addr + len) touches, or -1.
+ */
+static int
+compact_range(const struct faultcompact *cm, const void *addr, size_t len,
+    size_t *first, size_t *end)
+{
+	const char *a = addr;
+
+	if (a < cm->cm_base || len == 0 ||
+	    (size_t) (a - cm->cm_base) >= cm->cm_len ||
+	    len > cm->cm_len - (a - cm->cm_base)) {
+		errno = EINVAL;
+		return -1;
+	}
+	*first = (a - cm->cm_base) / cm->cm_pagesz;
+	*end = (a - cm->cm_base + len - 1) / cm->cm_pagesz + 1;
+
+	return 0;
+}
+
+/*
+ * Pick the idle pages of [addr, addr + len) for evacuation and protect
+ * them, all in as few calls as they allow.  Returns how many there were.
+ * Nothing may copy them before this returns.  On failure, the pages that
+ * were protected stay selected and still need evacuating.
+ */
+ssize_t
+fault_compact_select(struct faultcompact *cm, void *addr, size_t len)
+{
+	size_t first, end, n = 0;
+
+	if (compact_range(cm, addr, len, &first, &end) != 0)
+		return -1;
+
+	pthread_mutex_lock(&cm->cm_lock);
+	for (size_t page = first; page < end; page++) {
+		unsigned char st = COMPACT_IDLE;
+
+		if (!atomic_compare_exchange_strong(&cm->cm_state[page], &st,
+		    COMPACT_SELECTED))
+			continue;
+		fault_pages_set(cm->cm_pages, cm->cm_base +
+		    page * cm->cm_pagesz, cm->cm_pagesz, FAULT_PAGES_NONE);
+		n++;
+	}
+
+	if (n > 0 && fault_pages_flush(cm->cm_pages) < 0) {
+		/*
+		 * Pages that did get protected stay selected, to be copied
+		 * out like any other; the rest are dropped, which also
+		 * cancels their queued change.
+		 */
+		for (size_t page = first; page < end; page++) {
+			char *addr = cm->cm_base + page * cm->cm_pagesz;
+			unsigned char st = COMPACT_SELECTED;
+
+			if (!(fault_pages_get(cm->cm_pages, addr) &
+			    FAULT_PAGES_PENDING))
+				continue;
+			if (atomic_compare_exchange_strong(&cm->cm_state[page],
+			    &st, COMPACT_IDLE))
+				fault_pages_set(cm->cm_pages, addr,
+				    cm->cm_pagesz, FAULT_PAGES_WRITE);
+		}
+		pthread_mutex_unlock(&cm->cm_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&cm->cm_lock);
+
+	return n;
+}
+
+/*
+ * Evacuate the selected pages of [addr, addr + len), leaving any that a
+ * mutator is copying to it, and return once they have all been copied.
+ * Returns how many this call copied itself.
+ */
+ssize_t
+fault_compact_evacuate(struct faultcompact *cm, void *addr, size_t len)
+{
+	size_t first, end;
+	uint64_t before;
+
+	if (compact_range(cm, addr, len, &first, &end) != 0)
+		return -1;
+
+	before = atomic_load(&cm->cm_copied);
+	for (size_t page = first; page < end; page++) {
+		if (atomic_load(&cm->cm_state[page]) == COMPACT_IDLE)
+			continue;
+		if (compact_evacuate(cm, page, &cm->cm_copied) != 0 &&
+		    errno == EIO)
+			return -1;
+	}
+
+	return atomic_load(&cm->cm_copied) - before;
+}
+
+/*
+ * Make sure the page holding addr has been evacuated, helping out if it
+ * has not; 0 if it has, -1 if it was never selected or the copy failed.
+ * For a mutator's own read barrier; safe in a fault handler.
+ */
+int
+fault_compact_assist(struct faultcompact *cm, const void *addr)
+{
+	size_t first, end;
+
+	if (compact_range(cm, addr, 1, &first, &end) != 0)
+		return -1;
+
+	return compact_evacuate(cm, first, &cm->cm_assists);
+}
+
+/*
+ * Where the object at addr lives now: addr itself if its page is not
+ * being compacted, or wherever the forwarding hook says once the page has
+ * been evacuated.  For healing references.
+ */
+void *
+fault_compact_forward(struct faultcompact *cm, const void *addr)
+{
+	size_t first, end;
+
+	if (compact_range(cm, addr, 1, &first, &end) != 0)
+		return NULL;
+
+	if (atomic_load(&cm->cm_state[first]) == COMPACT_IDLE)
+		return (void *) addr;
+	if (compact_evacuate(cm, first, &cm->cm_assists) != 0)
+		return NULL;
+
+	return cm->cm_ops.co_forward(addr, cm->cm_arg);
+}
+
+/*
+ * Hand the evacuated pages of [addr, addr + len) back, empty and open,
+ * once nothing refers to them any more.  Returns how many there were.
+ */
+ssize_t
+fault_compact_release(struct faultcompact *cm, void *addr, size_t len)
+{
+	size_t first, end, n = 0;
+
+	if (compact_range(cm, addr, len, &first, &end) != 0)
+		return -1;
+
+	pthread_mutex_lock(&cm->cm_lock);
+	for (size_t page = first; page < end; page++) {
+		unsigned char st = COMPACT_EVACUATED;
+
+		/* only what is evacuated now; a copy may finish meanwhile */
+		if (!atomic_compare_exchange_strong(&cm->cm_state[page], &st,
+		    COMPACT_RELEASING))
+			continue;
+#if defined(MADV_REMOVE)
+		madvise(cm->cm_alias + page * cm->cm_pagesz, cm->cm_pagesz,
+		    MADV_REMOVE);
+#endif
+		fault_pages_set(cm->cm_pages, cm->cm_base +
+		    page * cm->cm_pagesz, cm->cm_pagesz, FAULT_PAGES_WRITE);
+		n++;
+	}
+
+	if (n > 0 && fault_pages_flush(cm->cm_pages) < 0) {
+		for (size_t page = first; page < end; page++) {
+			unsigned char st = COMPACT_RELEASING;
+
+			atomic_compare_exchange_strong(&cm->cm_state[page],
+			    &st, COMPACT_EVACUATED);
+		}
+		pthread_mutex_unlock(&cm->cm_lock);
+		return -1;
+	}
+
+	for (size_t page = first; page < end; page++) {
+		unsigned char st = COMPACT_RELEASING;
+
+		atomic_compare_exchange_strong(&cm->cm_state[page], &st,
+		    COMPACT_IDLE);
+	}
+	pthread_mutex_unlock(&cm->cm_lock);
+
+	return n;
+}
+
+int
+fault_compact_stats(const struct faultcompact *cm,
+    struct faultcompactstats *ct)
+{
+	*ct = (struct faultcompactstats) {
+		.ct_pages = cm->cm_npages,
+		.ct_copied = atomic_load(&cm->cm_copied),
+		.ct_assists = atomic_load(&cm->cm_assists),
+		.ct_forwarded = atomic_load(&cm->cm_forwarded)
+	};
+
+	for (size_t page = 0; page < cm->cm_npages; page++) {
+		switch (atomic_load(&cm->cm_state[page])) {
+		case COMPACT_SELECTED:
+		case COMPACT_COPYING:
+			ct->ct_selected++;
+			break;
+		case COMPACT_EVACUATED:
+		case COMPACT_RELEASING:
+			ct->ct_evacuated++;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+void
+fault_compact_destroy(struct faultcompact *cm)
+{
+	fault_unregister(cm->cm_base);
+	fault_pages_destroy(cm->cm_pages);
+	munmap(cm->cm_base, cm->cm_len);
+	munmap(cm->cm_alias, cm->cm_len);
+	close(cm->cm_fd);
+	pthread_mutex_destroy(&cm->cm_lock);
+	free(cm->cm_state);
+	free(cm);
+}
@@ -0,0 +1,428 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Dirty page tracking.  Three backends, the first two tried in order:
+ *
+ *  - userfaultfd write-protect (Linux): first writes are resolved by
+ *    the uffd resolver threads; no signals, no VMA splits.
+ *  - mprotect: the range is made read-only and the first write to each
+ *    page is caught by the fault handler.
+ *  - soft-dirty (Linux): the kernel sets bit 55 of the page's pagemap
+ *    entry on write; collecting reads /proc/self/pagemap.  Clearing is
+ *    process-wide, so every other soft-dirty tracker is harvested into
+ *    its own bitmap before /proc/self/clear_refs is written.  Reading
+ *    and clearing are two steps, and a write to a clean page between
+ *    them is lost, so it is only ever used when asked for.
+ */
+
+#include "fault.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define WORD_BITS	(sizeof(unsigned long) * CHAR_BIT)
+#define NWORDS(n)	(((n) + WORD_BITS - 1) / WORD_BITS)
+
+#define PM_SOFT_DIRTY	(1ULL << 55)
+#define PM_BATCH	512
+
+struct faultdirty {
+	char			*fd_base;
+	size_t			 fd_len,
+				 fd_npages,
+				 fd_pagesz;
+	int			 fd_backend;
+	atomic_ulong		*fd_bits;
+	struct faultdirty	*fd_next;
+};
+
+static pthread_mutex_t
+softlock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct faultdirty *
+softlist = NULL;
+
+static int
+pagemapfd = -1;
+
+static int
+dirty_fault(int flt, const struct faultinfo *fi, void *arg)
+{
+	struct faultdirty *fd = arg;
+	size_t page = ((char *) fi->fi_addr - fd->fd_base) / fd->fd_pagesz;
+	char *addr = fd->fd_base + page * fd->fd_pagesz;
+
+	if (fd->fd_backend == FAULT_DIRTY_UFFD) {
+		/*
+		 * A page that was never there is new; count it as dirty
+		 * even if this first access is only a read.
+		 */
+		if (!(fi->fi_flags & FI_WP) &&
+		    fault_uffd_zero(addr, fd->fd_pagesz) != 0)
+			return 0;
+	}
+
+	atomic_fetch_or(&fd->fd_bits[page / WORD_BITS],
+	    1UL << page % WORD_BITS);
+
+	if (fd->fd_backend == FAULT_DIRTY_UFFD)
+		return !(fi->fi_flags & FI_WP) ||
+		    fault_uffd_protect(addr, fd->fd_pagesz, 0) == 0;
+	else
+		return mprotect(addr, fd->fd_pagesz,
+		    PROT_READ | PROT_WRITE) == 0;
+}
+
+static int
+clear_refs(void)
+{
+	int fd, res;
+
+	if ((fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC)) < 0)
+		return -1;
+	res = write(fd, "4", 1) == 1 ? 0 : -1;
+	close(fd);
+
+	return res;
+}
+
+/*
+ * OR the soft-dirty bits of fd's pages into bits, or atomically into
+ * abits if bits is NULL.
+ */
+static int
+soft_read(const struct faultdirty *fd, unsigned long *bits, atomic_ulong *abits)
+{
+	uint64_t ents[PM_BATCH];
+	uintptr_t vpn = (uintptr_t) fd->fd_base / fd->fd_pagesz;
+
+	for (size_t page = 0; page < fd->fd_npages; page += PM_BATCH) {
+		size_t n = fd->fd_npages - page < PM_BATCH ?
+		    fd->fd_npages - page : PM_BATCH;
+
+		if (pread(pagemapfd, ents, n * sizeof(ents[0]),
+		    (vpn + page) * sizeof(ents[0])) !=
+		    (ssize_t) (n * sizeof(ents[0])))
+			return -1;
+
+		/* PM_BATCH is a multiple of the word size */
+		for (size_t i = 0; i < n; i += WORD_BITS) {
+			unsigned long w = 0;
+
+			for (size_t j = 0; j < WORD_BITS && i + j < n; j++)
+				w |= (unsigned long)
+				    ((ents[i + j] & PM_SOFT_DIRTY) != 0) << j;
+
+			if (bits != NULL)
+				bits[(page + i) / WORD_BITS] |= w;
+			else if (w != 0)
+				atomic_fetch_or(&abits[(page + i) / WORD_BITS],
+				    w);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Does this kernel actually maintain soft-dirty bits?  Write to a page
+ * after clearing and see.
+ */
+static int
+soft_supported(void)
+{
+	static int supported = -1;
+	long page_size = sysconf(_SC_PAGESIZE);
+	volatile char *page;
+	uint64_t ent;
+	off_t off;
+
+	if (supported >= 0)
+		return supported;
+
+	supported = 0;
+	if ((pagemapfd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+
+	page = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (page == MAP_FAILED)
+		return 0;
+	off = (uintptr_t) page / page_size * sizeof(ent);
+
+	page[0] = 1;
+	if (clear_refs() == 0 &&
+	    pread(pagemapfd, &ent, sizeof(ent), off) == sizeof(ent) &&
+	    !(ent & PM_SOFT_DIRTY)) {
+		page[0] = 2;
+		if (pread(pagemapfd, &ent, sizeof(ent), off) == sizeof(ent) &&
+		    (ent & PM_SOFT_DIRTY))
+			supported = 1;
+	}
+
+	munmap((void *) page, page_size);
+	return supported;
+}
+
+/*
+ * Clear soft-dirty bits process-wide, first folding what the other
+ * trackers have seen so far into their bitmaps.  Must be called with
+ * softlock held, and with nothing writing to any of the ranges: a
+ * write between the read and the clear is in neither interval.
+ */
+static int
+soft_reset(const struct faultdirty *self)
+{
+	for (struct faultdirty *fd = softlist; fd != NULL; fd = fd->fd_next)
+		if (fd != self && soft_read(fd, NULL, fd->fd_bits) < 0)
+			return -1;
+
+	return clear_refs();
+}
+
+/*
+ * Re-arm the pages set in bits, one protection change per run.
+ */
+static int
+rearm(struct faultdirty *fd, const unsigned long *bits)
+{
+	ssize_t page = fault_dirty_next(bits, fd->fd_npages, 0);
+
+	while (page >= 0) {
+		size_t end = page;
+		char *addr = fd->fd_base + page * fd->fd_pagesz;
+		int res;
+
+		while (end < fd->fd_npages &&
+		    (bits[end / WORD_BITS] & 1UL << end % WORD_BITS))
+			end++;
+
+		if (fd->fd_backend == FAULT_DIRTY_UFFD)
+			res = fault_uffd_protect(addr,
+			    (end - page) * fd->fd_pagesz, 1);
+		else
+			res = mprotect(addr, (end - page) * fd->fd_pagesz,
+			    PROT_READ);
+		if (res != 0)
+			return -1;
+
+		page = fault_dirty_next(bits, fd->fd_npages, end);
+	}
+
+	return 0;
+}
+
+static int
+dirty_arm(struct faultdirty *fd, int backend)
+{
+	fd->fd_backend = backend;
+
+	switch (backend) {
+	case FAULT_DIRTY_SOFTDIRTY:
+		if (!soft_supported()) {
+			errno = ENOTSUP;
+			return -1;
+		}
+
+		pthread_mutex_lock(&softlock);
+		if (soft_reset(fd) < 0) {
+			pthread_mutex_unlock(&softlock);
+			return -1;
+		}
+		fd->fd_next = softlist;
+		softlist = fd;
+		pthread_mutex_unlock(&softlock);
+		return 0;
+
+	case FAULT_DIRTY_UFFD:
+	case FAULT_DIRTY_MPROTECT:
+		if (fault_register(&(struct faultregion) {
+			.fr_addr = fd->fd_base,
+			.fr_len = fd->fd_len,
+			.fr_act = { .fa_fun = dirty_fault, .fa_arg = fd },
+			.fr_flags = backend == FAULT_DIRTY_UFFD ?
+			    FR_UFFD | FR_UFFD_WP : 0
+		    }) != 0)
+			return -1;
+
+		if ((backend == FAULT_DIRTY_UFFD ?
+		    fault_uffd_protect(fd->fd_base, fd->fd_len, 1) :
+		    mprotect(fd->fd_base, fd->fd_len, PROT_READ)) != 0) {
+			fault_unregister(fd->fd_base);
+			return -1;
+		}
+		return 0;
+
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+struct faultdirty *
+fault_dirty_start(void *addr, size_t len, int backend)
+{
+	/* soft-dirty cannot reset under concurrent writes; not automatic */
+	static const int order[] = {
+		FAULT_DIRTY_UFFD, FAULT_DIRTY_MPROTECT
+	};
+	struct faultdirty *fd;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	if ((uintptr_t) addr % page_size != 0 || len == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((fd = calloc(1, sizeof(*fd))) == NULL)
+		return NULL;
+
+	fd->fd_base = addr;
+	fd->fd_pagesz = page_size;
+	fd->fd_npages = (len + page_size - 1) / page_size;
+	fd->fd_len = fd->fd_npages * page_size;
+	if ((fd->fd_bits = calloc(NWORDS(fd->fd_npages),
+	    sizeof(fd->fd_bits[0]))) == NULL)
+		goto fail;
+
+	if (backend != FAULT_DIRTY_AUTO) {
+		if (dirty_arm(fd, backend) == 0)
+			return fd;
+		goto fail;
+	}
+
+	for (unsigned int i = 0; i < sizeof(order) / sizeof(order[0]); i++)
+		if (dirty_arm(fd, order[i]) == 0)
+			return fd;
+
+fail:
+	free(fd->fd_bits);
+	free(fd);
+	return NULL;
+}
+
+int
+fault_dirty_backend(const struct faultdirty *fd)
+{
+	return fd->fd_backend;
+}
+
+/*
+ * Store the dirty set in bitmap (if not NULL) and return the number of
+ * dirty pages.  With reset, start a new interval: pages written from
+ * now on show up in the next collection.  Read page contents only after
+ * this returns; writes racing with the reset itself may be reported in
+ * either interval, or (having made it into the contents read) in
+ * neither.  The soft-dirty backend is the exception: it can lose them
+ * outright, so writers must be stopped while it resets.
+ */
+ssize_t
+fault_dirty_collect(struct faultdirty *fd, unsigned long *bitmap, int reset)
+{
+	size_t nwords = NWORDS(fd->fd_npages), n = 0;
+	unsigned long *bits = bitmap;
+	ssize_t res = -1;
+
+	if (bits == NULL && (bits = malloc(nwords * sizeof(bits[0]))) == NULL)
+		return -1;
+
+	if (fd->fd_backend == FAULT_DIRTY_SOFTDIRTY)
+		pthread_mutex_lock(&softlock);
+
+	for (size_t w = 0; w < nwords; w++) {
+		bits[w] = reset ? atomic_exchange(&fd->fd_bits[w], 0) :
+		    atomic_load(&fd->fd_bits[w]);
+	}
+
+	if (fd->fd_backend == FAULT_DIRTY_SOFTDIRTY) {
+		if (soft_read(fd, bits, NULL) < 0 || (reset && soft_reset(fd) < 0))
+			goto out;
+	} else if (reset && rearm(fd, bits) < 0) {
+		goto out;
+	}
+
+	for (size_t w = 0; w < nwords; w++)
+		n += __builtin_popcountl(bits[w]);
+	res = n;
+
+out:
+	if (fd->fd_backend == FAULT_DIRTY_SOFTDIRTY)
+		pthread_mutex_unlock(&softlock);
+	if (bitmap == NULL)
+		free(bits);
+
+	return res;
+}
+
+/*
+ * Index of the first set bit at or after from, or -1.  Skips clean
+ * stretches a word at a time.
+ */
+ssize_t
+fault_dirty_next(const unsigned long *bitmap, size_t npages, size_t from)
+{
+	size_t w = from / WORD_BITS;
+	unsigned long word;
+
+	if (from >= npages)
+		return -1;
+
+	word = bitmap[w] & (~0UL << from % WORD_BITS);
+	while (word == 0) {
+		if (++w >= NWORDS(npages))
+			return -1;
+		word = bitmap[w];
+	}
+
+	from = w * WORD_BITS + __builtin_ctzl(word);
+	return from < npages ? (ssize_t) from : -1;
+}
+
+void
+fault_dirty_stop(struct faultdirty *fd)
+{
+	if (fd->fd_backend == FAULT_DIRTY_SOFTDIRTY) {
+		pthread_mutex_lock(&softlock);
+		for (struct faultdirty **p = &softlist; *p != NULL;
+		     p = &(*p)->fd_next) {
+			if (*p == fd) {
+				*p = fd->fd_next;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&softlock);
+	} else {
+		fault_unregister(fd->fd_base);
+		if (fd->fd_backend == FAULT_DIRTY_UFFD)
+			fault_uffd_protect(fd->fd_base, fd->fd_len, 0);
+		else
+			mprotect(fd->fd_base, fd->fd_len,
+			    PROT_READ | PROT_WRITE);
+	}
+
+	free(fd->fd_bits);
+	free(fd);
+}
@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Load/store emulation.  Only plain integer moves are handled: on x86_64
+ * mov, movzx, movsx and movsxd between a register or immediate and
+ * memory; on aarch64 the single-register ldr/str family with unsigned,
+ * unscaled, pre/post-indexed and register offsets.  Everything else is
+ * left alone, FS and GS segment overrides included; the ES, CS, SS and
+ * DS overrides are skipped, since they do nothing in 64-bit mode.
+ */
+
+struct emul {
+	struct faultaccess	 em_fc;
+	int			 em_reg;	/* data register, or -1 */
+	int			 em_high;	/* x86 %ah..%bh */
+	uint64_t		 em_imm;	/* stored when em_reg < 0 */
+	size_t			 em_dst;	/* register bytes a load sets */
+	int			 em_sext;
+	int			 em_wbreg;	/* base writeback, or -1 */
+	uint64_t		 em_wbval;
+};
+
+static int
+emul_get(void *ctx, int n, uint64_t *val)
+{
+	uint64_t *r = ctx_gpr(ctx, n);
+
+	if (r == NULL)
+		return -1;
+	*val = *r;
+
+	return 0;
+}
+
+#if defined(__amd64__) || defined(__x86_64__)
+static int
+emul_decode(const struct faultinfo *fi, struct emul *em)
+{
+	const unsigned char *p = fi->fi_pc;
+	unsigned int i = 0, rex = 0, op, modrm, mod, rm, opnd, immlen = 0;
+	uint64_t ea = 0, v;
+	int64_t disp = 0;
+	int opsize16 = 0, riprel = 0;
+
+	*em = (struct emul) { .em_reg = -1, .em_wbreg = -1 };
+
+	for (;; i++) {
+		if (p[i] == 0x66)
+			opsize16 = 1;
+		else if (p[i] != 0x26 && p[i] != 0x2e && p[i] != 0x36 &&
+		    p[i] != 0x3e)
+			break;
+		if (i == 4)
+			return -1;
+	}
+	if ((p[i] & 0xf0) == 0x40)
+		rex = p[i++];
+	opnd = (rex & 8) ? 8 : opsize16 ? 2 : 4;
+
+	switch (op = p[i++]) {
+	case 0x88:
+	case 0x89:
+		em->em_fc.fc_write = 1;
+		em->em_fc.fc_size = op == 0x88 ? 1 : opnd;
+		break;
+	case 0x8a:
+	case 0x8b:
+		em->em_fc.fc_size = em->em_dst = op == 0x8a ? 1 : opnd;
+		break;
+	case 0x63:
+		em->em_fc.fc_size = 4;
+		em->em_dst = opnd;
+		em->em_sext = 1;
+		break;
+	case 0xc6:
+	case 0xc7:
+		em->em_fc.fc_write = 1;
+		em->em_fc.fc_size = op == 0xc6 ? 1 : opnd;
+		immlen = op == 0xc6 ? 1 : opsize16 ? 2 : 4;
+		break;
+	case 0x0f:
+		op = 0x0f00 | p[i++];
+		if (op != 0x0fb6 && op != 0x0fb7 && op != 0x0fbe && op != 0x0fbf)
+			return -1;
+		em->em_fc.fc_size = (op & 1) ? 2 : 1;
+		em->em_dst = opnd;
+		em->em_sext = op >= 0x0fbe;
+		break;
+	default:
+		return -1;
+	}
+
+	modrm = p[i++];
+	mod = modrm >> 6;
+	rm = modrm & 7;
+	if (mod == 3 || (immlen != 0 && (modrm >> 3 & 7) != 0))
+		return -1;
+	if (immlen == 0) {
+		em->em_reg = (modrm >> 3 & 7) | (rex & 4 ? 8 : 0);
+		/* without rex, byte registers 4-7 are %ah, %ch, %dh, %bh */
+		if ((op == 0x88 || op == 0x8a) && rex == 0 &&
+		    em->em_reg >= 4) {
+			em->em_reg -= 4;
+			em->em_high = 1;
+		}
+	}
+
+	if (rm == 4) {
+		unsigned int sib = p[i++], idx = (sib >> 3 & 7) | (rex & 2 ? 8 : 0),
+		    base = (sib & 7) | (rex & 1 ? 8 : 0);
+
+		if (idx != 4) {
+			if (emul_get(fi->fi_ctx, idx, &v) < 0)
+				return -1;
+			ea += v << (sib >> 6);
+		}
+		if ((sib & 7) == 5 && mod == 0) {
+			mod = 2;
+		} else {
+			if (emul_get(fi->fi_ctx, base, &v) < 0)
+				return -1;
+			ea += v;
+		}
+	} else if (rm == 5 && mod == 0) {
+		riprel = 1;
+		mod = 2;
+	} else {
+		if (emul_get(fi->fi_ctx, rm | (rex & 1 ? 8 : 0), &v) < 0)
+			return -1;
+		ea = v;
+	}
+
+	if (mod == 1) {
+		disp = (int8_t) p[i++];
+	} else if (mod == 2) {
+		disp = (int32_t) (p[i] | p[i + 1] << 8 | p[i + 2] << 16 |
+		    (uint32_t) p[i + 3] << 24);
+		i += 4;
+	}
+
+	for (unsigned int k = 0; k < immlen; k++)
+		em->em_imm |= (uint64_t) p[i + k] << 8 * k;
+	if (immlen == 4)
+		em->em_imm = (uint64_t) (int64_t) (int32_t) em->em_imm;
+	i += immlen;
+
+	em->em_fc.fc_len = i;
+	em->em_fc.fc_addr = (void *) ((riprel ? (uintptr_t) p + i : ea) + disp);
+
+	return 0;
+}
+#elif defined(__aarch64__)
+static int
+emul_decode(const struct faultinfo *fi, struct emul *em)
+{
+	uint32_t insn = *(const uint32_t *) fi->fi_pc;
+	unsigned int size = insn >> 30, opc = insn >> 22 & 3, rt = insn & 31,
+	    rn = insn >> 5 & 31;
+	int64_t simm9 = (int32_t) (insn << 11) >> 23;
+	uint64_t base, off;
+
+	*em = (struct emul) { .em_reg = -1, .em_wbreg = -1 };
+
+	if (emul_get(fi->fi_ctx, rn, &base) < 0)
+		return -1;
+
+	if ((insn & 0x3f000000) == 0x39000000) {
+		/* unsigned offset */
+		em->em_fc.fc_addr = (void *) (base +
+		    ((uint64_t) (insn >> 10 & 0xfff) << size));
+	} else if ((insn & 0x3f200c00) == 0x38000000) {
+		/* unscaled */
+		em->em_fc.fc_addr = (void *) (base + simm9);
+	} else if ((insn & 0x3f200400) == 0x38000400) {
+		/* pre- or post-indexed */
+		em->em_fc.fc_addr = (void *) ((insn & 0x800) ?
+		    base + simm9 : base);
+		em->em_wbreg = rn;
+		em->em_wbval = base + simm9;
+	} else if ((insn & 0x3f200c00) == 0x38200800) {
+		/* register offset */
+		unsigned int rm = insn >> 16 & 31;
+
+		off = 0;
+		if (rm != 31 && emul_get(fi->fi_ctx, rm, &off) < 0)
+			return -1;
+		switch (insn >> 13 & 7) {
+		case 2:
+			off = (uint32_t) off;
+			break;
+		case 3:
+		case 7:
+			break;
+		case 6:
+			off = (uint64_t) (int64_t) (int32_t) off;
+			break;
+		default:
+			return -1;
+		}
+		em->em_fc.fc_addr = (void *) (base +
+		    (off << ((insn & 0x1000) ? size : 0)));
+	} else {
+		return -1;
+	}
+
+	em->em_fc.fc_size = 1 << size;
+	em->em_fc.fc_len = 4;
+	switch (opc) {
+	case 0:
+		em->em_fc.fc_write = 1;
+		break;
+	case 1:
+		em->em_dst = size == 3 ? 8 : 4;
+		break;
+	case 2:
+		/* ldrs[bhw] into x; the size 3 slot is prfm */
+		if (size == 3)
+			return -1;
+		em->em_dst = 8;
+		em->em_sext = 1;
+		break;
+	case 3:
+		if (size >= 2)
+			return -1;
+		em->em_dst = 4;
+		em->em_sext = 1;
+		break;
+	}
+
+	/* register 31 is xzr here, not sp */
+	if (rt != 31)
+		em->em_reg = rt;
+
+	return 0;
+}
+#else
+static int
+emul_decode(const struct faultinfo *fi, struct emul *em)
+{
+	return -1;
+}
+#endif
+
+int
+fault_decode(const struct faultinfo *fi, struct faultaccess *fc)
+{
+	struct emul em;
+
+	if (fi->fi_ctx == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (emul_decode(fi, &em) < 0) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	*fc = em.em_fc;
+	return 0;
+}
+
+int
+fault_emulate(const struct faultinfo *fi, void *addr)
+{
+	struct emul em;
+	uint64_t *r = NULL, v = 0;
+	uint32_t v32;
+	uint16_t v16;
+	size_t size;
+
+	if (fi->fi_ctx == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (emul_decode(fi, &em) < 0 ||
+	    (em.em_reg >= 0 && (r = ctx_gpr(fi->fi_ctx, em.em_reg)) == NULL)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (addr == NULL)
+		addr = em.em_fc.fc_addr;
+	size = em.em_fc.fc_size;
+
+	if (em.em_fc.fc_write) {
+		v = r == NULL ? em.em_imm : em.em_high ? *r >> 8 : *r;
+		v16 = v;
+		v32 = v;
+		switch (size) {
+		case 1:
+			*(uint8_t *) addr = v;
+			break;
+		case 2:
+			memcpy(addr, &v16, 2);
+			break;
+		case 4:
+			memcpy(addr, &v32, 4);
+			break;
+		case 8:
+			memcpy(addr, &v, 8);
+			break;
+		}
+	} else {
+		switch (size) {
+		case 1:
+			v = *(uint8_t *) addr;
+			break;
+		case 2:
+			memcpy(&v16, addr, 2);
+			v = v16;
+			break;
+		case 4:
+			memcpy(&v32, addr, 4);
+			v = v32;
+			break;
+		case 8:
+			memcpy(&v, addr, 8);
+			break;
+		}
+		if (em.em_sext && size < 8)
+			v = (uint64_t) ((int64_t) (v << (64 - 8 * size)) >>
+			    (64 - 8 * size));
+	}
+
+	if (em.em_wbreg >= 0)
+		*(uint64_t *) ctx_gpr(fi->fi_ctx, em.em_wbreg) = em.em_wbval;
+
+	if (!em.em_fc.fc_write && r != NULL) {
+		switch (em.em_dst) {
+		case 1:
+			if (em.em_high)
+				*r = (*r & ~(uint64_t) 0xff00) | (v & 0xff) << 8;
+			else
+				*r = (*r & ~(uint64_t) 0xff) | (v & 0xff);
+			break;
+		case 2:
+			*r = (*r & ~(uint64_t) 0xffff) | (v & 0xffff);
+			break;
+		case 4:
+			*r = (uint32_t) v;
+			break;
+		case 8:
+			*r = v;
+			break;
+		}
+	}
+
+	ctx_fixup(fi->fi_ctx, (uintptr_t) fi->fi_pc + em.em_fc.fc_len, 0);
+
+	return 0;
+}
@@ -61,6 +61,7 @@ typedef x86_exception_state_t native_exception_state_t;
 # define SET_SP(ts,sp)	((ts).uts.ts64.__rsp = (uintptr_t) (sp))
 # define ARG0(ts)	((ts).uts.ts64.__rdi)
 # define ARG1(ts)	((ts).uts.ts64.__rsi)
+# define ARG2(ts)	((ts).uts.ts64.__rdx)
 # define ARG(ts,a)	ARG ## a(ts)
 # define SET_ARG(ts,a,v) (ARG ## a(ts) = (v))
 
@@ -101,6 +102,31 @@ typedef struct {
 static int
 hook_called = 0;
 
+static mach_port_t
+segv_port = MACH_PORT_NULL;
+
+/*
+ * The exceptions behind each kind, in the order of the kinds.
+ */
+static const exception_mask_t
+exc_masks[FAULT_NKINDS] = {
+	EXC_MASK_BAD_ACCESS,
+	EXC_MASK_BAD_INSTRUCTION,
+	EXC_MASK_ARITHMETIC,
+	EXC_MASK_BREAKPOINT
+};
+
+static int
+exc_kind(exception_type_t exception)
+{
+	switch (exception) {
+	case EXC_BAD_INSTRUCTION:	return FAULT_ILLEGAL_INSN;
+	case EXC_ARITHMETIC:		return FAULT_ARITHMETIC;
+	case EXC_BREAKPOINT:		return FAULT_BREAKPOINT;
+	default:			return FAULT_BAD_ACCESS;
+	}
+}
+
 static void
 push(native_thread_state_t *ts, const void *buf, size_t len)
 {
@@ -112,17 +138,55 @@ push(native_thread_state_t *ts, const void *buf, size_t len)
 void
 trampoline_return(void);
 
+/*
+ * Where general purpose register n, numbered as in instruction encodings,
+ * lives in ctx.  The aarch64 frame pointer, link register and sp may be
+ * signed, so those are not handed out.
+ */
+static void *
+ctx_gpr(void *ctx, int n)
+{
+	native_thread_state_t *ts = ctx;
+
+#if defined(__aarch64__)
+	return n < 29 ? &ts->ts_64.__x[n] : NULL;
+#elif defined(__amd64__) || defined(__x86_64__)
+	x86_thread_state64_t *t = &ts->uts.ts64;
+	uint64_t *gprs[16] = {
+		&t->__rax, &t->__rcx, &t->__rdx, &t->__rbx,
+		&t->__rsp, &t->__rbp, &t->__rsi, &t->__rdi,
+		&t->__r8, &t->__r9, &t->__r10, &t->__r11,
+		&t->__r12, &t->__r13, &t->__r14, &t->__r15
+	};
+
+	return gprs[n];
+#endif
+}
+
+/*
+ * Resume at pc, with sp added to the stack pointer.
+ */
+static void
+ctx_fixup(void *ctx, uintptr_t pc, ptrdiff_t sp)
+{
+	native_thread_state_t *ts = ctx;
+
+	if (sp != 0)
+		SET_SP(*ts, SP(*ts) + sp);
+	SET_PC(*ts, (void *) pc);
+}
+
 static __attribute__ ((noreturn)) void
-trampoline(native_thread_state_t *ts, native_exception_state_t *es)
+trampoline(native_thread_state_t *ts, native_exception_state_t *es, int flt)
 {
 	int ok = 0;
-	if (curact.fa_fun != NULL && curact.fa_fun(
-	    FAULT_BAD_ACCESS, &(struct faultinfo) {
+	if (dispatch(flt, &(struct faultinfo) {
 		.fi_pc = (void *) PC(*ts),
 		.fi_sp = (void *) SP(*ts),
-		.fi_addr = (void *) ADDR(*es),
+		.fi_addr = flt == FAULT_BAD_ACCESS ?
+		    (void *) ADDR(*es) : (void *) PC(*ts),
 		.fi_ctx = ts
-	    }, curact.fa_arg)) {
+	    })) {
 		ok = 1;
 	}
 
@@ -179,6 +243,8 @@ handle_segv(mach_port_t exception_port, mach_port_t thread,
 		push(&ts, (void *) &es, sizeof(es));
 		SET_ARG(ts, 1, SP(ts));
 
+		SET_ARG(ts, 2, exc_kind(exception));
+
 		SET_SP(ts, SP(ts) - (SP(ts) & STACK_ALIGN - 1));
 #if defined(__amd64__) || defined(__x86_64__)
 		/* on x86-64, calling a function pushes the return address
@@ -255,11 +321,15 @@ map_error(kern_return_t err)
 	return -1;
 }
 
+/*
+ * The trampoline gets back out through a bad access, so that exception
+ * comes to us whatever else does.
+ */
 static int
-hook_fault(void)
+hook_port(void)
 {
 	kern_return_t kr = KERN_SUCCESS;
-	mach_port_t self = mach_task_self(), segv_port;
+	mach_port_t self = mach_task_self();
 	pthread_t thread;
 	int err;
 
@@ -302,7 +372,34 @@ fail:
 }
 
 static int
-unhook_fault(void)
+hook_fault(int flt)
+{
+	kern_return_t kr;
+
+	if (hook_port() < 0)
+		return -1;
+	if (flt == FAULT_BAD_ACCESS)
+		return 0;
+
+	kr = task_set_exception_ports(mach_task_self(), exc_masks[flt],
+	    segv_port, EXCEPTION_DEFAULT | MACH_EXCEPTION_CODES,
+	    NATIVE_THREAD_STATE);
+
+	return map_error(kr);
+}
+
+static int
+unhook_fault(int flt)
 {
 	return 0;
 }
+
+/*
+ * The trampoline runs on the faulting thread's own stack.
+ */
+static int
+altstack_enable(void)
+{
+	errno = ENOTSUP;
+	return -1;
+}
@@ -16,8 +16,9 @@
 
 #include <signal.h>
 
+#include <sys/mman.h>
+
 #if defined(__OpenBSD__)
-# define SIGNALS	{ SIGSEGV, SIGBUS }
 # if defined(__aarch64__)
 #  define PC(ctx)	((ctx)->sc_elr)
 #  define SP(ctx)	((ctx)->sc_sp)
@@ -32,11 +33,11 @@
 #  define SP(ctx)	((ctx)->sc_sp)
 # endif
 #elif defined(__NetBSD__)
-# define SIGNALS	{ SIGSEGV, SIGBUS }
 # define PC(ctx)	_UC_MACHINE_PC(ctx)
 # define SP(ctx)	_UC_MACHINE_SP(ctx)
+# define SET_PC(ctx,pc)	_UC_MACHINE_SET_PC(ctx, pc)
+# define SET_SP(ctx,sp)	(_UC_MACHINE_SP(ctx) = (sp))
 #elif defined(__FreeBSD__)
-# define SIGNALS	{ SIGSEGV, SIGBUS }
 # if defined(__aarch64__)
 #  define PC(ctx)	((ctx)->uc_mcontext.mc_gpregs.gp_elr)
 #  define SP(ctx)	((ctx)->uc_mcontext.mc_gpregs.gp_sp)
@@ -51,13 +52,11 @@
 #  define SP(ctx)	((ctx)->uc_mcontext.mc_gpregs.gp_sp)
 # endif
 #elif defined(__DragonFly__)
-# define SIGNALS	{ SIGSEGV, SIGBUS }
 # if defined(__amd64__) || defined(__x86_64__)
 #  define PC(ctx)	((ctx)->uc_mcontext.mc_rip)
 #  define SP(ctx)	((ctx)->uc_mcontext.mc_rsp)
 # endif
 #elif defined(__linux__)
-# define SIGNALS	{ SIGSEGV, SIGBUS }
 # define SC(ctx)	((struct sigcontext *) &(ctx)->uc_mcontext)
 # if defined(__aarch64__)
 #  define PC(ctx)	(SC(ctx)->pc)
@@ -73,7 +72,6 @@
 #  define SP(ctx)	(SC(ctx)->sp)
 # endif
 #elif defined(__APPLE__) && defined(__MACH__)
-# define SIGNALS	{ SIGSEGV, SIGBUS }
 # if defined(__aarch64__)
 #  define PC(ctx)	((ctx)->uc_mcontext->__ss.__pc)
 #  define SP(ctx)	((ctx)->uc_mcontext->__ss.__sp)
@@ -83,36 +81,169 @@
 # endif
 #endif
 
+#if !defined(SET_PC)
+# define SET_PC(ctx,pc)	(PC(ctx) = (pc))
+# define SET_SP(ctx,sp)	(SP(ctx) = (sp))
+#endif
+
+/*
+ * Where general purpose register n, numbered as in instruction encodings,
+ * lives in ctx; 31 is sp on aarch64.  NULL where nobody has taught us.
+ */
+#if defined(__linux__) && (defined(__amd64__) || defined(__x86_64__))
+# define GPR(r)		offsetof(struct sigcontext, r)
+
+static void *
+ctx_gpr(void *ctx, int n)
+{
+	static const unsigned short gprs[16] = {
+		GPR(rax), GPR(rcx), GPR(rdx), GPR(rbx),
+		GPR(rsp), GPR(rbp), GPR(rsi), GPR(rdi),
+		GPR(r8), GPR(r9), GPR(r10), GPR(r11),
+		GPR(r12), GPR(r13), GPR(r14), GPR(r15)
+	};
+
+	return (char *) SC((ucontext_t *) ctx) + gprs[n];
+}
+#elif defined(__linux__) && defined(__aarch64__)
+static void *
+ctx_gpr(void *ctx, int n)
+{
+	struct sigcontext *sc = SC((ucontext_t *) ctx);
+
+	return n < 31 ? (void *) &sc->regs[n] : (void *) &sc->sp;
+}
+#elif defined(__FreeBSD__) && (defined(__amd64__) || defined(__x86_64__))
+# define GPR(r)		offsetof(mcontext_t, r)
+
+static void *
+ctx_gpr(void *ctx, int n)
+{
+	static const unsigned short gprs[16] = {
+		GPR(mc_rax), GPR(mc_rcx), GPR(mc_rdx), GPR(mc_rbx),
+		GPR(mc_rsp), GPR(mc_rbp), GPR(mc_rsi), GPR(mc_rdi),
+		GPR(mc_r8), GPR(mc_r9), GPR(mc_r10), GPR(mc_r11),
+		GPR(mc_r12), GPR(mc_r13), GPR(mc_r14), GPR(mc_r15)
+	};
+
+	return (char *) &((ucontext_t *) ctx)->uc_mcontext + gprs[n];
+}
+#elif defined(__FreeBSD__) && defined(__aarch64__)
+static void *
+ctx_gpr(void *ctx, int n)
+{
+	struct gpregs *gp = &((ucontext_t *) ctx)->uc_mcontext.mc_gpregs;
+
+	return n < 30 ? (void *) &gp->gp_x[n] :
+	    n == 30 ? (void *) &gp->gp_lr : (void *) &gp->gp_sp;
+}
+#else
+static void *
+ctx_gpr(void *ctx, int n)
+{
+	return NULL;
+}
+#endif
+
+static const struct {
+	int	 sig,
+		 flt;
+} signals[] = {
+	{ SIGSEGV,	FAULT_BAD_ACCESS },
+	{ SIGBUS,	FAULT_BAD_ACCESS },
+	{ SIGILL,	FAULT_ILLEGAL_INSN },
+	{ SIGFPE,	FAULT_ARITHMETIC },
+	{ SIGTRAP,	FAULT_BREAKPOINT }
+};
+
+#define NSIGNALS	(sizeof(signals) / sizeof(signals[0]))
+
+static struct sigaction
+oldacts[NSIGNALS];
+
+/*
+ * Nobody wanted this fault; hand it to whoever had the signal before us.
+ * If that is the default action, reinstate it and return, so that the
+ * faulting instruction is retried and the process is terminated the way
+ * it would have been without us.  A breakpoint may have left the pc past
+ * itself, so that one is raised again instead; it stays pending until
+ * we return.
+ */
+static void
+delegate_fault(int sig, siginfo_t *info, void *ctx)
+{
+	const struct sigaction *oact = NULL;
+
+	for (unsigned int i = 0; i < NSIGNALS; i++) {
+		if (signals[i].sig == sig)
+			oact = &oldacts[i];
+	}
+
+	if (oact != NULL && (oact->sa_flags & SA_SIGINFO) &&
+	    oact->sa_sigaction != NULL) {
+		oact->sa_sigaction(sig, info, ctx);
+	} else if (oact != NULL && oact->sa_handler != SIG_DFL &&
+	    oact->sa_handler != SIG_IGN) {
+		oact->sa_handler(sig);
+	} else {
+		sigaction(sig, &(struct sigaction) {
+			.sa_handler = SIG_DFL
+		    }, NULL);
+		if (sig == SIGTRAP)
+			raise(sig);
+	}
+}
+
+/*
+ * Resume at pc, with sp added to the stack pointer.
+ */
+static void
+ctx_fixup(void *ctx, uintptr_t pc, ptrdiff_t sp)
+{
+	ucontext_t *uc = ctx;
+
+	if (sp != 0)
+		SET_SP(uc, SP(uc) + sp);
+	SET_PC(uc, pc);
+}
+
 static void
 handle_fault(int sig, siginfo_t *info, void *ctx)
 {
-	if (curact.fa_fun != NULL && curact.fa_fun(
-	    FAULT_BAD_ACCESS, &(struct faultinfo) {
+	int flt = FAULT_BAD_ACCESS;
+
+	for (unsigned int i = 0; i < NSIGNALS; i++) {
+		if (signals[i].sig == sig)
+			flt = signals[i].flt;
+	}
+
+	if (dispatch(flt, &(struct faultinfo) {
 		.fi_pc = (void *) PC((ucontext_t *) ctx),
 		.fi_sp = (void *) SP((ucontext_t *) ctx),
 		.fi_addr = info->si_addr,
-		.fi_ctx = ctx
-	    }, curact.fa_arg)) {
+		.fi_ctx = ctx,
+		.fi_flags = sig == SIGBUS ? FI_BUS : 0
+	    })) {
 		return;
 	}
+
+	delegate_fault(sig, info, ctx);
 }
 
 static int
-hook_fault(void)
+hook_fault(int flt)
 {
-	static const int signals[] = SIGNALS;
-
 	sigset_t mask;
 	sigfillset(&mask);
 
-	for (unsigned int i = 0;
-	     i < sizeof(signals) / sizeof(signals[0]);
-	     i++) {
-		if (sigaction(signals[i], &(struct sigaction) {
+	for (unsigned int i = 0; i < NSIGNALS; i++) {
+		if (signals[i].flt != flt)
+			continue;
+		if (sigaction(signals[i].sig, &(struct sigaction) {
 			.sa_sigaction = handle_fault,
 			.sa_mask = mask,
-			.sa_flags = SA_SIGINFO
-		    }, NULL) != 0)
+			.sa_flags = SA_SIGINFO | SA_ONSTACK
+		    }, &oldacts[i]) != 0)
 			return -1;
 	}
 
@@ -120,17 +251,78 @@ hook_fault(void)
 }
 
 static int
-unhook_fault(void)
+unhook_fault(int flt)
 {
-	static const int signals[] = SIGNALS;
+	for (unsigned int i = 0; i < NSIGNALS; i++)
+		if (signals[i].flt == flt)
+			sigaction(signals[i].sig, &oldacts[i], NULL);
 
-	for (unsigned int i = 0;
-	     i < sizeof(signals) / sizeof(signals[0]);
-	     i++) {
-		sigaction(signals[i], &(struct sigaction) {
-			.sa_handler = SIG_DFL
-		    }, NULL);
+	return 0;
+}
+
+/*
+ * Alternate signal stacks, so that the handler can still run when the
+ * faulting thread has run out of stack.  Ours are mapped with a guard
+ * page below them and torn down when the thread exits.
+ */
+#define ALTSTACK_SIZE	(64 * 1024)
+
+static pthread_key_t
+altstackkey;
+
+static pthread_once_t
+altstackonce = PTHREAD_ONCE_INIT;
+
+static int
+altstackerr = 0;
+
+static void
+altstack_free(void *stack)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	sigaltstack(&(stack_t) { .ss_flags = SS_DISABLE }, NULL);
+	munmap((char *) stack - page_size, ALTSTACK_SIZE + page_size);
+}
+
+static void
+altstack_init(void)
+{
+	altstackerr = pthread_key_create(&altstackkey, altstack_free);
+}
+
+static int
+altstack_enable(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	stack_t ss;
+	char *stack;
+
+	pthread_once(&altstackonce, altstack_init);
+	if (altstackerr != 0) {
+		errno = altstackerr;
+		return -1;
+	}
+
+	/* keep whatever the thread already has */
+	if (sigaltstack(NULL, &ss) != 0)
+		return -1;
+	if (!(ss.ss_flags & SS_DISABLE))
+		return 0;
+
+	stack = mmap(NULL, ALTSTACK_SIZE + page_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (stack == MAP_FAILED)
+		return -1;
+	if (mprotect(stack, page_size, PROT_NONE) != 0 ||
+	    sigaltstack(&(stack_t) {
+		.ss_sp = stack + page_size,
+		.ss_size = ALTSTACK_SIZE
+	    }, NULL) != 0) {
+		munmap(stack, ALTSTACK_SIZE + page_size);
+		return -1;
 	}
+	pthread_setspecific(altstackkey, stack + page_size);
 
 	return 0;
 }
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Memory probes.  These are leaf functions in assembly that never touch
+ * the stack, laid out between probe_start and probe_end.  A fault with
+ * the pc anywhere in there is resumed at probe_fail, which returns -1 to
+ * the probe's caller; no sigsetjmp is needed and the happy path is just
+ * the access itself.  Pages are stepped through 4 KiB at a time, which
+ * is never larger than the real page size.  probefixups is
+ * searched before any registered exception table.
+ */
+
+#if defined(__APPLE__) && defined(__MACH__)
+# define P_(name)	#name
+# define P(name)	P_(_ ## name)
+#else
+# define P(name)	#name
+#endif
+
+#if defined(__ELF__)
+# define TEXT		".pushsection .text\n"
+# define ENDTEXT	".popsection\n"
+# define FUNC(name)	".globl " P(name) "\n" \
+			".type " P(name) ", %function\n" \
+			".p2align 4\n" P(name) ":\n"
+# define LABEL(name)	".globl " P(name) "\n.hidden " P(name) "\n" \
+			".p2align 4\n" P(name) ":\n"
+#else
+# define TEXT		".text\n"
+# define ENDTEXT	""
+# define FUNC(name)	".globl " P(name) "\n.p2align 4\n" P(name) ":\n"
+# define LABEL(name)	".globl " P(name) "\n.private_extern " P(name) "\n" \
+			".p2align 4\n" P(name) ":\n"
+#endif
+
+extern const char probe_start[], probe_end[], probe_fail[];
+
+#if defined(__amd64__) || defined(__x86_64__)
+asm (
+	TEXT
+	LABEL(probe_start)
+
+	FUNC(fault_fetch32)
+	"movl	(%rdi), %eax\n"
+	"movl	%eax, (%rsi)\n"
+	"xorl	%eax, %eax\n"
+	"ret\n"
+
+	FUNC(fault_fetch64)
+	"movq	(%rdi), %rax\n"
+	"movq	%rax, (%rsi)\n"
+	"xorl	%eax, %eax\n"
+	"ret\n"
+
+	FUNC(fault_probe_read)
+	"testq	%rsi, %rsi\n"
+	"jz	2f\n"
+	"leaq	-1(%rdi,%rsi), %rcx\n"
+"1:\n"
+	"movb	(%rdi), %al\n"
+	"orq	$4095, %rdi\n"
+	"incq	%rdi\n"
+	"cmpq	%rcx, %rdi\n"
+	"jbe	1b\n"
+	"movb	(%rcx), %al\n"
+"2:\n"
+	"xorl	%eax, %eax\n"
+	"ret\n"
+
+	FUNC(fault_probe_write)
+	"testq	%rsi, %rsi\n"
+	"jz	2f\n"
+	"leaq	-1(%rdi,%rsi), %rcx\n"
+"1:\n"
+	"lock orb $0, (%rdi)\n"
+	"orq	$4095, %rdi\n"
+	"incq	%rdi\n"
+	"cmpq	%rcx, %rdi\n"
+	"jbe	1b\n"
+	"lock orb $0, (%rcx)\n"
+"2:\n"
+	"xorl	%eax, %eax\n"
+	"ret\n"
+
+	FUNC(fault_copy)
+	"movq	%rdx, %rcx\n"
+	"rep movsb\n"
+	"xorl	%eax, %eax\n"
+	"ret\n"
+
+	LABEL(probe_end)
+	LABEL(probe_fail)
+	"movl	$-1, %eax\n"
+	"ret\n"
+	ENDTEXT
+);
+#elif defined(__i386__)
+/* cdecl; only %eax, %ecx and %edx are ours to clobber */
+asm (
+	TEXT
+	LABEL(probe_start)
+
+	FUNC(fault_fetch32)
+	"movl	4(%esp), %eax\n"
+	"movl	(%eax), %eax\n"
+	"movl	8(%esp), %ecx\n"
+	"movl	%eax, (%ecx)\n"
+	"xorl	%eax, %eax\n"
+	"ret\n"
+
+	FUNC(fault_fetch64)
+	"movl	4(%esp), %eax\n"
+	"movl	8(%esp), %ecx\n"
+	"movl	(%eax), %edx\n"
+	"movl	4(%eax), %eax\n"
+	"movl	%edx, (%ecx)\n"
+	"movl	%eax, 4(%ecx)\n"
+	"xorl	%eax, %eax\n"
+	"ret\n"
+
+	FUNC(fault_probe_read)
+	"movl	4(%esp), %edx\n"
+	"movl	8(%esp), %ecx\n"
+	"testl	%ecx, %ecx\n"
+	"jz	2f\n"
+	"leal	-1(%edx,%ecx), %ecx\n"
+"1:\n"
+	"movb	(%edx), %al\n"
+	"orl	$4095, %edx\n"
+	"incl	%edx\n"
+	"cmpl	%ecx, %edx\n"
+	"jbe	1b\n"
+	"movb	(%ecx), %al\n"
+"2:\n"
+	"xorl	%eax, %eax\n"
+	"ret\n"
+
+	FUNC(fault_probe_write)
+	"movl	4(%esp), %edx\n"
+	"movl	8(%esp), %ecx\n"
+	"testl	%ecx, %ecx\n"
+	"jz	2f\n"
+	"leal	-1(%edx,%ecx), %ecx\n"
+"1:\n"
+	"lock orb $0, (%edx)\n"
+	"orl	$4095, %edx\n"
+	"incl	%edx\n"
+	"cmpl	%ecx, %edx\n"
+	"jbe	1b\n"
+	"lock orb $0, (%ecx)\n"
+"2:\n"
+	"xorl	%eax, %eax\n"
+	"ret\n"
+
+	FUNC(fault_copy)
+	"movl	4(%esp), %edx\n"
+	"movl	8(%esp), %ecx\n"
+	"cmpl	$0, 12(%esp)\n"
+	"jz	2f\n"
+"1:\n"
+	"movb	(%ecx), %al\n"
+	"movb	%al, (%edx)\n"
+	"incl	%ecx\n"
+	"incl	%edx\n"
+	"decl	12(%esp)\n"
+	"jnz	1b\n"
+"2:\n"
+	"xorl	%eax, %eax\n"
+	"ret\n"
+
+	LABEL(probe_end)
+	LABEL(probe_fail)
+	"movl	$-1, %eax\n"
+	"ret\n"
+	ENDTEXT
+);
+#elif defined(__aarch64__)
+asm (
+	TEXT
+	LABEL(probe_start)
+
+	FUNC(fault_fetch32)
+	"ldr	w2, [x0]\n"
+	"str	w2, [x1]\n"
+	"mov	w0, #0\n"
+	"ret\n"
+
+	FUNC(fault_fetch64)
+	"ldr	x2, [x0]\n"
+	"str	x2, [x1]\n"
+	"mov	w0, #0\n"
+	"ret\n"
+
+	FUNC(fault_probe_read)
+	"cbz	x1, 2f\n"
+	"add	x2, x0, x1\n"
+	"sub	x2, x2, #1\n"
+"1:\n"
+	"ldrb	w3, [x0]\n"
+	"orr	x0, x0, #4095\n"
+	"add	x0, x0, #1\n"
+	"cmp	x0, x2\n"
+	"b.ls	1b\n"
+	"ldrb	w3, [x2]\n"
+"2:\n"
+	"mov	w0, #0\n"
+	"ret\n"
+
+	/* write each byte back exclusively, so no update can be lost */
+	FUNC(fault_probe_write)
+	"cbz	x1, 3f\n"
+	"add	x2, x0, x1\n"
+	"sub	x2, x2, #1\n"
+"1:\n"
+	"ldxrb	w3, [x0]\n"
+	"stxrb	w4, w3, [x0]\n"
+	"cbnz	w4, 1b\n"
+	"orr	x0, x0, #4095\n"
+	"add	x0, x0, #1\n"
+	"cmp	x0, x2\n"
+	"b.ls	1b\n"
+"2:\n"
+	"ldxrb	w3, [x2]\n"
+	"stxrb	w4, w3, [x2]\n"
+	"cbnz	w4, 2b\n"
+"3:\n"
+	"mov	w0, #0\n"
+	"ret\n"
+
+	FUNC(fault_copy)
+	"cbz	x2, 2f\n"
+"1:\n"
+	"ldrb	w3, [x1], #1\n"
+	"strb	w3, [x0], #1\n"
+	"subs	x2, x2, #1\n"
+	"b.ne	1b\n"
+"2:\n"
+	"mov	w0, #0\n"
+	"ret\n"
+
+	LABEL(probe_end)
+	LABEL(probe_fail)
+	"mov	w0, #-1\n"
+	"ret\n"
+	ENDTEXT
+);
+#elif defined(__riscv64) || (defined(__riscv) && __riscv_xlen == 64)
+asm (
+	TEXT
+	LABEL(probe_start)
+
+	FUNC(fault_fetch32)
+	"lw	t0, 0(a0)\n"
+	"sw	t0, 0(a1)\n"
+	"li	a0, 0\n"
+	"ret\n"
+
+	FUNC(fault_fetch64)
+	"ld	t0, 0(a0)\n"
+	"sd	t0, 0(a1)\n"
+	"li	a0, 0\n"
+	"ret\n"
+
+	FUNC(fault_probe_read)
+	"beqz	a1, 2f\n"
+	"add	t1, a0, a1\n"
+	"addi	t1, t1, -1\n"
+	"li	t2, -4096\n"
+"1:\n"
+	"lb	t0, 0(a0)\n"
+	"and	a0, a0, t2\n"
+	"sub	a0, a0, t2\n"
+	"bleu	a0, t1, 1b\n"
+	"lb	t0, 0(t1)\n"
+"2:\n"
+	"li	a0, 0\n"
+	"ret\n"
+
+	/* an atomic or of zero into the containing word writes nothing */
+	FUNC(fault_probe_write)
+	"beqz	a1, 2f\n"
+	"add	t1, a0, a1\n"
+	"addi	t1, t1, -1\n"
+	"li	t2, -4096\n"
+"1:\n"
+	"andi	t0, a0, -4\n"
+	"amoor.w zero, zero, (t0)\n"
+	"and	a0, a0, t2\n"
+	"sub	a0, a0, t2\n"
+	"bleu	a0, t1, 1b\n"
+	"andi	t0, t1, -4\n"
+	"amoor.w zero, zero, (t0)\n"
+"2:\n"
+	"li	a0, 0\n"
+	"ret\n"
+
+	FUNC(fault_copy)
+	"beqz	a2, 2f\n"
+"1:\n"
+	"lb	t0, 0(a1)\n"
+	"sb	t0, 0(a0)\n"
+	"addi	a0, a0, 1\n"
+	"addi	a1, a1, 1\n"
+	"addi	a2, a2, -1\n"
+	"bnez	a2, 1b\n"
+"2:\n"
+	"li	a0, 0\n"
+	"ret\n"
+
+	LABEL(probe_end)
+	LABEL(probe_fail)
+	"li	a0, -1\n"
+	"ret\n"
+	ENDTEXT
+);
+#else
+# error "Unsupported architecture"
+#endif
+
+static const struct faultfixup
+probefixups[] = {
+	{ (void *) probe_start, (void *) probe_end, (void *) probe_fail, 0 }
+};
@@ -0,0 +1,518 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Fault tracing.  Each thread appends events to its own ring (threads
+ * share rings only when there are more of them than rings), and a
+ * background thread drains the rings into a memory-mapped trace file.
+ *
+ * An event is published as soon as the fault comes in, with its result
+ * still pending; when the handlers return, the result is filled in with
+ * a compare-and-swap on the slot's sequence word, which fails harmlessly
+ * if the slot has been recycled in the meantime.
+ *
+ * Everything but the result is recorded when the event is pushed, so a
+ * handler that escapes with siglongjmp only ever leaves the result
+ * missing.  Each thread keeps a short stack of its events in flight;
+ * the next fault on the thread whose handler frame is not below one of
+ * them means that one escaped, and it is marked so there and then.  The
+ * drainer does not wait for the rest: it moves a pending event aside
+ * into the ring's held table (marking the slot so the handler knows to
+ * look there) and carries on with the ring.  A held event is written
+ * out once its result comes in, or as escaped once it is
+ * TRACE_ESCAPE_NS old.  Only when its place in the held table is taken
+ * does the drainer stop at a pending event.
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+
+#include <sys/mman.h>
+
+#if defined(__linux__)
+# include <sys/syscall.h>
+#endif
+
+#define TRACE_RINGS		64
+#define TRACE_RINGSIZE		4096
+#define TRACE_CHUNK		(1 << 20)
+#define TRACE_INTERVAL_NS	10000000
+#define TRACE_ESCAPE_NS		1000000000
+
+#define TRACE_HELD		64	/* per ring, a power of two */
+#define TRACE_DEPTH		8	/* nested faults tracked per thread */
+
+#define TRACE_PENDING		0xff
+#define TRACE_MOVED		0xfe	/* in the held table */
+
+struct traceslot {
+	/* (position + 1) << 8 | result */
+	atomic_uint_least64_t	 tsl_seq;
+	struct faultevent	 tsl_ev;
+};
+
+struct tracering {
+	_Alignas(64) atomic_size_t tr_head;
+	_Alignas(64) atomic_size_t tr_tail;
+	struct traceslot	*tr_slots;
+	/* pending events the drainer has moved past, by position */
+	struct traceslot	 tr_held[TRACE_HELD];
+};
+
+static atomic_int
+traceon = 0;
+
+static struct tracering
+tracerings[TRACE_RINGS];
+
+static size_t
+tracesize = 0;
+
+static atomic_uint
+tracenext = 0;
+
+static atomic_uint_least64_t
+tracedropped = 0;
+
+static _Thread_local int
+tracering __attribute__ ((tls_model ("initial-exec"))) = -1;
+
+static _Thread_local uint32_t
+tracetid __attribute__ ((tls_model ("initial-exec"))) = 0;
+
+/* this thread's events still in the handler, innermost last */
+static _Thread_local struct {
+	struct traceslot	*ts_slot;
+	uint64_t		 ts_seq;
+	uintptr_t		 ts_frame;
+} tracestack[TRACE_DEPTH] __attribute__ ((tls_model ("initial-exec")));
+
+static _Thread_local int
+tracedepth __attribute__ ((tls_model ("initial-exec"))) = 0;
+
+static pthread_t
+tracethread;
+
+static pthread_mutex_t
+tracelock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_cond_t
+tracecond = PTHREAD_COND_INITIALIZER;
+
+static int
+tracestop = 0;
+
+static int
+tracefd = -1;
+
+static char *
+tracemap = NULL;
+
+static off_t
+tracemapoff = 0,
+traceoff = 0;
+
+static uint32_t
+trace_tid(void)
+{
+	if (tracetid == 0) {
+#if defined(__linux__)
+		tracetid = syscall(SYS_gettid);
+#else
+		tracetid = (uint32_t) (uintptr_t) pthread_self();
+#endif
+	}
+
+	return tracetid;
+}
+
+/*
+ * Fill in the result of the event at seq, wherever the drainer has put
+ * it.
+ */
+static void
+trace_result(struct traceslot *tsl, uint64_t seq, int res)
+{
+	struct tracering *tr = &tracerings[tracering];
+	uint64_t expect = seq | TRACE_PENDING;
+
+	if (atomic_compare_exchange_strong(&tsl->tsl_seq, &expect, seq | res))
+		return;
+
+	/*
+	 * Moved aside (the slot may even have been reused since); the held
+	 * entry was filled in before the slot was marked.
+	 */
+	if (expect == (seq | TRACE_MOVED) || (expect >> 8) != (seq >> 8)) {
+		expect = seq | TRACE_PENDING;
+		atomic_compare_exchange_strong(
+		    &tr->tr_held[((seq >> 8) - 1) % TRACE_HELD].tsl_seq,
+		    &expect, seq | res);
+	}
+}
+
+static struct traceslot *
+trace_begin(int flt, const struct faultinfo *fi, uint64_t *seq)
+{
+	struct tracering *tr;
+	struct traceslot *tsl;
+	uintptr_t frame = (uintptr_t) __builtin_frame_address(0);
+	size_t head;
+
+	if (tracering < 0)
+		tracering = atomic_fetch_add(&tracenext, 1) % TRACE_RINGS;
+	tr = &tracerings[tracering];
+
+	/* not nested in these, so their handlers escaped */
+	while (tracedepth > 0 && tracestack[tracedepth - 1].ts_frame <= frame) {
+		tracedepth--;
+		trace_result(tracestack[tracedepth].ts_slot,
+		    tracestack[tracedepth].ts_seq, FAULT_TRACE_ESCAPED);
+	}
+
+	head = atomic_load_explicit(&tr->tr_head, memory_order_relaxed);
+	do {
+		if (head - atomic_load_explicit(&tr->tr_tail,
+		    memory_order_acquire) >= tracesize) {
+			atomic_fetch_add_explicit(&tracedropped, 1,
+			    memory_order_relaxed);
+			return NULL;
+		}
+	} while (!atomic_compare_exchange_weak(&tr->tr_head, &head,
+	    head + 1));
+
+	tsl = &tr->tr_slots[head % tracesize];
+	tsl->tsl_ev = (struct faultevent) {
+		.fe_time = stats_now(),
+		.fe_pc = (uintptr_t) fi->fi_pc,
+		.fe_sp = (uintptr_t) fi->fi_sp,
+		.fe_addr = (uintptr_t) fi->fi_addr,
+		.fe_tid = trace_tid(),
+		.fe_kind = flt,
+		.fe_flags = fi->fi_flags
+	};
+
+	*seq = (uint64_t) (head + 1) << 8;
+	atomic_store_explicit(&tsl->tsl_seq, *seq | TRACE_PENDING,
+	    memory_order_release);
+
+	if (tracedepth < TRACE_DEPTH) {
+		tracestack[tracedepth].ts_slot = tsl;
+		tracestack[tracedepth].ts_seq = *seq;
+		tracestack[tracedepth].ts_frame = frame;
+		tracedepth++;
+	}
+
+	return tsl;
+}
+
+static void
+trace_end(struct traceslot *tsl, uint64_t seq, int res)
+{
+	if (tracedepth > 0 && tracestack[tracedepth - 1].ts_slot == tsl &&
+	    tracestack[tracedepth - 1].ts_seq == seq)
+		tracedepth--;
+
+	trace_result(tsl, seq, res ? FAULT_TRACE_RETRY : FAULT_TRACE_DECLINED);
+}
+
+/*
+ * Append len bytes, moving the window along when they do not fit; it
+ * starts at the page holding traceoff, so they always do afterwards.
+ */
+static int
+trace_write(const struct faultevent *ev, size_t len)
+{
+	if (tracemap == NULL ||
+	    traceoff - tracemapoff > (off_t) (TRACE_CHUNK - len)) {
+		off_t page_size = sysconf(_SC_PAGESIZE);
+
+		if (tracemap != NULL)
+			munmap(tracemap, TRACE_CHUNK);
+
+		tracemapoff = traceoff / page_size * page_size;
+		if (ftruncate(tracefd, tracemapoff + TRACE_CHUNK) != 0)
+			return -1;
+		tracemap = mmap(NULL, TRACE_CHUNK, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, tracefd, tracemapoff);
+		if (tracemap == MAP_FAILED) {
+			tracemap = NULL;
+			return -1;
+		}
+	}
+
+	memcpy(tracemap + (traceoff - tracemapoff), ev, len);
+	traceoff += len;
+
+	return 0;
+}
+
+/*
+ * Write out the held events whose result is in, and those that are
+ * stale, as escaped.
+ */
+static int
+trace_drain_held(struct tracering *tr, uint64_t now, int final)
+{
+	for (int h = 0; h < TRACE_HELD; h++) {
+		struct traceslot *tsl = &tr->tr_held[h];
+		uint64_t seq = atomic_load_explicit(&tsl->tsl_seq,
+		    memory_order_acquire);
+		struct faultevent ev;
+
+		if (seq == 0)
+			continue;
+
+		ev = tsl->tsl_ev;
+		if ((seq & 0xff) == TRACE_PENDING) {
+			if (!final && now - ev.fe_time < TRACE_ESCAPE_NS)
+				continue;
+			/* the result may come in right now */
+			if (atomic_compare_exchange_strong(&tsl->tsl_seq, &seq,
+			    (seq & ~(uint64_t) 0xff) | FAULT_TRACE_ESCAPED))
+				seq = (seq & ~(uint64_t) 0xff) |
+				    FAULT_TRACE_ESCAPED;
+		}
+		ev.fe_result = seq & 0xff;
+
+		if (trace_write(&ev, sizeof(ev)) < 0)
+			return -1;
+		atomic_store_explicit(&tsl->tsl_seq, 0, memory_order_release);
+	}
+
+	return 0;
+}
+
+/*
+ * Move a pending event into the held table: 1 if it was moved, 0 if
+ * the slot has its result by now, -1 if the held entry is still taken.
+ */
+static int
+trace_hold(struct tracering *tr, struct traceslot *tsl, uint64_t seq)
+{
+	struct traceslot *held = &tr->tr_held[((seq >> 8) - 1) % TRACE_HELD];
+
+	if (atomic_load_explicit(&held->tsl_seq, memory_order_acquire) != 0)
+		return -1;
+
+	held->tsl_ev = tsl->tsl_ev;
+	atomic_store_explicit(&held->tsl_seq, seq, memory_order_release);
+	if (atomic_compare_exchange_strong(&tsl->tsl_seq, &seq,
+	    (seq & ~(uint64_t) 0xff) | TRACE_MOVED))
+		return 1;
+
+	atomic_store_explicit(&held->tsl_seq, 0, memory_order_relaxed);
+	return 0;
+}
+
+/*
+ * Move whatever is ready from every ring to the file.  Only ever called
+ * by the drainer thread (or by fault_trace_stop once that has exited).
+ */
+static void
+trace_drain(int final)
+{
+	uint64_t now = stats_now();
+
+	for (int r = 0; r < TRACE_RINGS; r++) {
+		struct tracering *tr = &tracerings[r];
+
+		for (;;) {
+			size_t tail = atomic_load_explicit(&tr->tr_tail,
+			    memory_order_relaxed);
+			struct traceslot *tsl = &tr->tr_slots[tail % tracesize];
+			uint64_t seq = atomic_load_explicit(&tsl->tsl_seq,
+			    memory_order_acquire);
+			struct faultevent ev;
+
+			if ((seq >> 8) != tail + 1)
+				break;
+
+			if ((seq & 0xff) == TRACE_PENDING) {
+				int held = trace_hold(tr, tsl, seq);
+
+				if (held < 0)
+					break;
+				if (held > 0) {
+					atomic_store_explicit(&tr->tr_tail,
+					    tail + 1, memory_order_release);
+					continue;
+				}
+				seq = atomic_load_explicit(&tsl->tsl_seq,
+				    memory_order_acquire);
+			}
+
+			ev = tsl->tsl_ev;
+			ev.fe_result = seq & 0xff;
+			if (trace_write(&ev, sizeof(ev)) < 0)
+				return;
+			atomic_store_explicit(&tr->tr_tail, tail + 1,
+			    memory_order_release);
+		}
+
+		if (trace_drain_held(tr, now, final) < 0)
+			return;
+	}
+}
+
+static void *
+trace_main(void *arg)
+{
+	(void) arg;
+
+	pthread_mutex_lock(&tracelock);
+	while (!tracestop) {
+		struct timespec ts;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += TRACE_INTERVAL_NS;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&tracecond, &tracelock, &ts);
+
+		trace_drain(0);
+	}
+	pthread_mutex_unlock(&tracelock);
+
+	return NULL;
+}
+
+/*
+ * Start tracing to path.  ringsize (events per ring) only counts the
+ * first time; the rings are kept for later traces.
+ */
+int
+fault_trace_start(const char *path, size_t ringsize)
+{
+	struct faulttracehdr hdr = {
+		.th_magic = FAULT_TRACE_MAGIC,
+		.th_version = FAULT_TRACE_VERSION,
+		.th_evsize = sizeof(struct faultevent),
+		.th_pagesize = sysconf(_SC_PAGESIZE)
+	};
+	sigset_t mask, omask;
+	int err;
+
+	if (atomic_load(&traceon) || tracefd >= 0) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/*
+	 * The rings are never freed: a fault handler that saw tracing on
+	 * just before it was turned off may still be writing to them.
+	 */
+	if (tracesize == 0) {
+		tracesize = ringsize != 0 ? ringsize : TRACE_RINGSIZE;
+		for (int r = 0; r < TRACE_RINGS; r++) {
+			tracerings[r].tr_slots = calloc(tracesize,
+			    sizeof(tracerings[r].tr_slots[0]));
+			if (tracerings[r].tr_slots == NULL) {
+				while (r-- > 0)
+					free(tracerings[r].tr_slots);
+				tracesize = 0;
+				return -1;
+			}
+		}
+	}
+
+	for (int r = 0; r < TRACE_RINGS; r++) {
+		for (size_t i = 0; i < tracesize; i++)
+			atomic_store(&tracerings[r].tr_slots[i].tsl_seq, 0);
+		for (int h = 0; h < TRACE_HELD; h++)
+			atomic_store(&tracerings[r].tr_held[h].tsl_seq, 0);
+		atomic_store(&tracerings[r].tr_head, 0);
+		atomic_store(&tracerings[r].tr_tail, 0);
+	}
+
+	if ((tracefd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+	    0644)) < 0)
+		goto fail;
+
+	traceoff = 0;
+	tracestop = 0;
+	atomic_store(&tracedropped, 0);
+	if (trace_write((const void *) &hdr, sizeof(hdr)) < 0)
+		goto fail;
+
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &omask);
+	err = pthread_create(&tracethread, NULL, trace_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	if (err != 0) {
+		errno = err;
+		goto fail;
+	}
+
+	atomic_store(&traceon, 1);
+	return 0;
+
+fail:
+	err = errno;
+	if (tracemap != NULL)
+		munmap(tracemap, TRACE_CHUNK);
+	tracemap = NULL;
+	if (tracefd >= 0)
+		close(tracefd);
+	tracefd = -1;
+	errno = err;
+	return -1;
+}
+
+/*
+ * Stop tracing, drain everything (pending events count as escaped), and
+ * finish the file.  Faults still in the handler on other threads when
+ * this is called may or may not make it into the file.
+ */
+int
+fault_trace_stop(void)
+{
+	struct faulttracehdr *hdr;
+	int res = 0;
+
+	if (!atomic_exchange(&traceon, 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&tracelock);
+	tracestop = 1;
+	pthread_cond_signal(&tracecond);
+	pthread_mutex_unlock(&tracelock);
+	pthread_join(tracethread, NULL);
+
+	trace_drain(1);
+
+	if (tracemap != NULL)
+		munmap(tracemap, TRACE_CHUNK);
+	tracemap = NULL;
+
+	hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE, MAP_SHARED,
+	    tracefd, 0);
+	if (hdr != MAP_FAILED) {
+		hdr->th_dropped = atomic_load(&tracedropped);
+		munmap(hdr, sizeof(*hdr));
+	}
+
+	if (ftruncate(tracefd, traceoff) != 0)
+		res = -1;
+	close(tracefd);
+	tracefd = -1;
+
+	return res;
+}
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * userfaultfd(2) backend.  Regions registered with FR_UFFD never see a
+ * signal: missing-page (and, with FR_UFFD_WP, write-protect) faults are
+ * queued by the kernel on a single userfaultfd that a pool of resolver
+ * threads drains in batches, calling the region's handler for each one.
+ * The faulting thread sleeps in the kernel until the page is populated.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <linux/userfaultfd.h>
+
+#ifndef UFFD_USER_MODE_ONLY
+# define UFFD_USER_MODE_ONLY	1
+#endif
+
+#define UFFD_BATCH	16
+
+static int
+uffd = -1;
+
+static unsigned int
+uffd_nthreads = 0;
+
+static pthread_once_t
+uffd_once = PTHREAD_ONCE_INIT;
+
+static int
+uffd_error = 0;
+
+static int
+uffd_resolve(const struct uffd_msg *msg)
+{
+	struct faulttab *ft;
+	const struct region *rg;
+	struct faultaction act = { 0 };
+	int (*resolve)(void *, size_t, void *) = NULL;
+	void *start;
+	size_t len;
+	unsigned int epoch;
+	void *addr = (void *) (uintptr_t) msg->arg.pagefault.address;
+	uint64_t flags = msg->arg.pagefault.flags;
+
+	ft = tab_enter(&epoch);
+	if ((rg = tab_lookup(ft, addr)) != NULL &&
+	    (rg->rg_flags & FR_UFFD)) {
+		act = rg->rg_act;
+		if ((resolve = rg->rg_resolve) != NULL &&
+		    !(flags & UFFD_PAGEFAULT_FLAG_WP))
+			region_predict(rg, addr, &start, &len);
+		else
+			resolve = NULL;
+	}
+	tab_leave(epoch);
+
+	if (resolve != NULL && invoke_resolve(resolve, start, len, act.fa_arg))
+		return 0;
+
+	if (act.fa_fun != NULL && invoke(&act, FAULT_BAD_ACCESS,
+	    &(struct faultinfo) {
+		.fi_addr = addr,
+		.fi_flags = FI_UFFD |
+		    (flags & UFFD_PAGEFAULT_FLAG_WRITE ? FI_WRITE : 0) |
+		    (flags & UFFD_PAGEFAULT_FLAG_WP ? FI_WP : 0)
+	    }))
+		return 0;
+
+	/* nobody wanted it; do what the kernel would have done */
+	addr = (void *) ((uintptr_t) addr & -pagesz);
+	if (flags & UFFD_PAGEFAULT_FLAG_WP)
+		return fault_uffd_protect(addr, pagesz, 0);
+	else
+		return fault_uffd_zero(addr, pagesz);
+}
+
+static void *
+uffd_thread(void *arg)
+{
+	struct uffd_msg msgs[UFFD_BATCH];
+
+	(void) arg;
+
+	for (;;) {
+		struct pollfd pfd = { .fd = uffd, .events = POLLIN };
+		ssize_t n;
+
+		if (poll(&pfd, 1, -1) < 0)
+			continue;
+
+		/* the fd is shared; another resolver may have beaten us */
+		n = read(uffd, msgs, sizeof(msgs));
+		if (n <= 0)
+			continue;
+
+		for (size_t i = 0; i < (size_t) n / sizeof(msgs[0]); i++)
+			if (msgs[i].event == UFFD_EVENT_PAGEFAULT)
+				uffd_resolve(&msgs[i]);
+	}
+
+	return NULL;
+}
+
+static void
+uffd_start(void)
+{
+	struct uffdio_api api = {
+		.api = UFFD_API,
+		.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP
+	};
+	sigset_t mask, omask;
+	unsigned int n = uffd_nthreads;
+
+	uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (uffd < 0 && errno == EPERM)
+		uffd = syscall(SYS_userfaultfd,
+		    O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY);
+	if (uffd < 0)
+		goto fail;
+
+	if (ioctl(uffd, UFFDIO_API, &api) < 0) {
+		/* older kernels: make do without write-protect */
+		api = (struct uffdio_api) { .api = UFFD_API };
+		if (ioctl(uffd, UFFDIO_API, &api) < 0)
+			goto fail;
+	}
+
+	if (n == 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		n = ncpu < 1 ? 1 : ncpu > 4 ? 4 : ncpu;
+	}
+
+	/* resolvers must never take a signal meant for somebody else */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &omask);
+
+	for (unsigned int i = 0; i < n; i++) {
+		pthread_t thread;
+		int err;
+
+		if ((err = pthread_create(&thread, NULL, uffd_thread,
+		    NULL)) != 0) {
+			pthread_sigmask(SIG_SETMASK, &omask, NULL);
+			if (i > 0)
+				break;
+			errno = err;
+			goto fail;
+		}
+
+		pthread_detach(thread);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	return;
+
+fail:
+	uffd_error = errno;
+	if (uffd >= 0)
+		close(uffd);
+	uffd = -1;
+}
+
+static int
+uffd_register(uintptr_t start, uintptr_t end, int flags)
+{
+	struct uffdio_register reg = {
+		.range = { .start = start, .len = end - start },
+		.mode = UFFDIO_REGISTER_MODE_MISSING |
+		    (flags & FR_UFFD_WP ? UFFDIO_REGISTER_MODE_WP : 0)
+	};
+
+	pthread_once(&uffd_once, uffd_start);
+	if (uffd < 0) {
+		errno = uffd_error;
+		return -1;
+	}
+
+	return ioctl(uffd, UFFDIO_REGISTER, &reg) < 0 ? -1 : 0;
+}
+
+static int
+uffd_unregister(uintptr_t start, uintptr_t end)
+{
+	struct uffdio_range range = { .start = start, .len = end - start };
+
+	return ioctl(uffd, UFFDIO_UNREGISTER, &range) < 0 ? -1 : 0;
+}
+
+static int
+uffd_wake(uintptr_t start, size_t len)
+{
+	struct uffdio_range range = { .start = start, .len = len };
+
+	return ioctl(uffd, UFFDIO_WAKE, &range) < 0 ? -1 : 0;
+}
+
+int
+fault_uffd_threads(unsigned int n)
+{
+	uffd_nthreads = n;
+	return 0;
+}
+
+/*
+ * Populate [dst, dst + len).  Pages that are already there (another
+ * resolver got to them first, or a fault-around window overlapping an
+ * earlier one) are skipped rather than ending the batch.
+ */
+int
+fault_uffd_copy(void *dst, const void *src, size_t len)
+{
+	uintptr_t d = (uintptr_t) dst, s = (uintptr_t) src, end = d + len;
+
+	while (d < end) {
+		struct uffdio_copy copy = {
+			.dst = d,
+			.src = s,
+			.len = end - d
+		};
+
+		if (ioctl(uffd, UFFDIO_COPY, &copy) == 0)
+			return 0;
+		if (errno != EEXIST)
+			return -1;
+
+		/* the page that was there already may have sleepers */
+		d += copy.copy > 0 ? copy.copy : 0;
+		s += copy.copy > 0 ? copy.copy : 0;
+		if (uffd_wake(d, pagesz) < 0)
+			return -1;
+		d += pagesz;
+		s += pagesz;
+	}
+
+	return 0;
+}
+
+int
+fault_uffd_zero(void *dst, size_t len)
+{
+	uintptr_t d = (uintptr_t) dst, end = d + len;
+
+	while (d < end) {
+		struct uffdio_zeropage zero = {
+			.range = { .start = d, .len = end - d }
+		};
+
+		if (ioctl(uffd, UFFDIO_ZEROPAGE, &zero) == 0)
+			return 0;
+		if (errno != EEXIST)
+			return -1;
+
+		d += zero.zeropage > 0 ? zero.zeropage : 0;
+		if (uffd_wake(d, pagesz) < 0)
+			return -1;
+		d += pagesz;
+	}
+
+	return 0;
+}
+
+int
+fault_uffd_protect(void *addr, size_t len, int wp)
+{
+	struct uffdio_writeprotect prot = {
+		.range = { .start = (uintptr_t) addr, .len = len },
+		.mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0
+	};
+
+	return ioctl(uffd, UFFDIO_WRITEPROTECT, &prot) < 0 ? -1 : 0;
+}
@@ -16,10 +16,111 @@
 
 #include "fault.h"
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
 
-static struct faultaction
-curact = { 0 };
+#include <sys/mman.h>
+
+#define FR_WINDOW	32
+
+/*
+ * Fault history of a region doing fault-around, all in granules.  Updated
+ * racily from whichever thread faults; the worst a lost update can do
+ * is make one prediction a little worse.
+ */
+struct regionstate {
+	atomic_long		 rs_last,
+				 rs_next,
+				 rs_stride;
+	atomic_size_t		 rs_window;
+};
+
+struct region {
+	uintptr_t		 rg_start,
+				 rg_end;
+	struct faultaction	 rg_act;
+	int			 rg_flags;
+	int			(*rg_resolve)(void *, size_t, void *);
+	size_t			 rg_window,
+				 rg_granule;
+	struct regionstate	*rg_state;
+};
+
+/*
+ * A registered exception table, covering pcs [xt_start, xt_end).
+ */
+struct fixuptab {
+	uintptr_t		 xt_start,
+				 xt_end;
+	const struct faultfixup	*xt_ents;
+	size_t			 xt_nents;
+};
+
+/*
+ * Everything the fault handler needs to look at lives in an immutable
+ * table; changing any of it means building a new table and swapping it
+ * in.  The handler never takes a lock: it announces itself in one of two
+ * reader counters, picks up the current table, copies out what it needs
+ * and leaves again before calling out to any user code (which might well
+ * siglongjmp away).  The array of exception tables is shared by
+ * successive copies of the table until it changes itself.
+ */
+struct faulttab {
+	struct faultaction	 ft_acts[FAULT_NKINDS];
+	const struct fixuptab	*ft_fixups;	/* sorted by xt_start */
+	size_t			 ft_nfixups;
+	size_t			 ft_nregions;
+	struct region		 ft_regions[];
+};
+
+static struct faulttab
+emptytab = { 0 };
+
+static struct faulttab *_Atomic
+curtab = &emptytab;
+
+static atomic_uint
+tabepoch = 0;
+
+static atomic_uint
+tabreaders[2] = { 0 };
+
+static pthread_mutex_t
+tablock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+hooked = 0;	/* one bit per kind */
+
+static size_t
+pagesz = 0;
+
+/*
+ * A bit per kind, set once a thread handler for it has been installed
+ * (or, for FAULT_BAD_ACCESS, the probes have been set up); from then on
+ * the hook stays in place, since we cannot cheaply tell whether any
+ * thread still has a handler or is about to probe.
+ */
+static atomic_int
+pinned = 0;
+
+/*
+ * The calling thread's handlers.  Only ever touched by its own thread and
+ * by the fault handler running on it, so plain stores ordered with
+ * signal fences are all we need.  Initial-exec keeps the fault handler
+ * from ending up in __tls_get_addr.
+ */
+static _Thread_local struct faultaction
+thracts[FAULT_NKINDS] __attribute__ ((tls_model ("initial-exec"))) = { 0 };
+
+static int
+dispatch(int flt, const struct faultinfo *fi);
 
 #if defined(__OpenBSD__) || \
     defined(__NetBSD__) || \
@@ -33,29 +134,970 @@ curact = { 0 };
 # error "What kind of platform is this?"
 #endif
 
+#include "fault-probe.c"
+#include "fault-emul.c"
+
+static struct faulttab *
+tab_enter(unsigned int *epoch)
+{
+	*epoch = atomic_load(&tabepoch) & 1;
+	atomic_fetch_add(&tabreaders[*epoch], 1);
+
+	return atomic_load(&curtab);
+}
+
+static void
+tab_leave(unsigned int epoch)
+{
+	atomic_fetch_sub(&tabreaders[epoch], 1);
+}
+
+static const struct region *
+tab_lookup(const struct faulttab *ft, const void *addr)
+{
+	uintptr_t a = (uintptr_t) addr;
+	size_t lo = 0, hi = ft->ft_nregions;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (a < ft->ft_regions[mid].rg_start)
+			hi = mid;
+		else if (a >= ft->ft_regions[mid].rg_end)
+			lo = mid + 1;
+		else
+			return &ft->ft_regions[mid];
+	}
+
+	return NULL;
+}
+
+/*
+ * Pick the pages to resolve for a fault at addr.  A fault exactly where
+ * the previous window ran out, or one stride on from the previous fault,
+ * means the access pattern is holding up: double the window.  Anything
+ * else halves it and takes the distance to the previous fault as the new
+ * stride.  Must be called from within tab_enter/tab_leave.
+ */
+static void
+region_predict(const struct region *rg, const void *addr,
+    void **start, size_t *len)
+{
+	struct regionstate *rs = rg->rg_state;
+	long page = ((uintptr_t) addr - rg->rg_start) / rg->rg_granule,
+	    npages = (rg->rg_end - rg->rg_start) / rg->rg_granule,
+	    last = atomic_load_explicit(&rs->rs_last, memory_order_relaxed),
+	    next = atomic_load_explicit(&rs->rs_next, memory_order_relaxed),
+	    stride = atomic_load_explicit(&rs->rs_stride, memory_order_relaxed),
+	    lo, hi;
+	size_t window = atomic_load_explicit(&rs->rs_window,
+	    memory_order_relaxed);
+
+	if (page == next || (window == 1 && page - last == stride)) {
+		window = window * 2 > rg->rg_window ?
+		    rg->rg_window : window * 2;
+	} else {
+		window = window > 1 ? window / 2 : 1;
+		stride = page - last;
+		if (stride == 0 || stride > FR_WINDOW || stride < -FR_WINDOW)
+			stride = 1;
+	}
+
+	if (stride > 0) {
+		lo = page;
+		hi = page + (long) window * stride;
+		next = hi;
+	} else {
+		lo = page + 1 + (long) window * stride;
+		hi = page + 1;
+		next = lo - 1;
+	}
+	if (lo < 0)
+		lo = 0;
+	if (hi > npages)
+		hi = npages;
+
+	atomic_store_explicit(&rs->rs_last, page, memory_order_relaxed);
+	atomic_store_explicit(&rs->rs_next, next, memory_order_relaxed);
+	atomic_store_explicit(&rs->rs_stride, stride, memory_order_relaxed);
+	atomic_store_explicit(&rs->rs_window, window, memory_order_relaxed);
+
+	*start = (void *) (rg->rg_start + lo * rg->rg_granule);
+	*len = (hi - lo) * rg->rg_granule;
+}
+
+static const struct faultfixup *
+fixup_search(const struct faultfixup *ents, size_t n, uintptr_t pc)
+{
+	size_t lo = 0, hi = n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (pc < (uintptr_t) ents[mid].ff_start)
+			hi = mid;
+		else if (pc >= (uintptr_t) ents[mid].ff_end)
+			lo = mid + 1;
+		else
+			return &ents[mid];
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the exception table entry for a fault at pc: the probes first,
+ * then whichever registered table covers it.  Must be called from within
+ * tab_enter/tab_leave.
+ */
+static const struct faultfixup *
+fixup_lookup(const struct faulttab *ft, const void *pc)
+{
+	const struct faultfixup *ff;
+	uintptr_t p = (uintptr_t) pc;
+	size_t lo = 0, hi = ft->ft_nfixups;
+
+	if ((ff = fixup_search(probefixups,
+	    sizeof(probefixups) / sizeof(probefixups[0]), p)) != NULL)
+		return ff;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct fixuptab *xt = &ft->ft_fixups[mid];
+
+		if (p < xt->xt_start)
+			hi = mid;
+		else if (p >= xt->xt_end)
+			lo = mid + 1;
+		else
+			return fixup_search(xt->xt_ents, xt->xt_nents, p);
+	}
+
+	return NULL;
+}
+
+static struct faulttab *
+tab_copy(const struct faulttab *ft, size_t nregions)
+{
+	struct faulttab *nt;
+
+	nt = malloc(sizeof(*nt) + nregions * sizeof(nt->ft_regions[0]));
+	if (nt == NULL)
+		return NULL;
+
+	memcpy(nt->ft_acts, ft->ft_acts, sizeof(nt->ft_acts));
+	nt->ft_fixups = ft->ft_fixups;
+	nt->ft_nfixups = ft->ft_nfixups;
+	nt->ft_nregions = 0;
+
+	return nt;
+}
+
+/*
+ * Install a new table and wait until no fault handler can still be
+ * looking at the old one.  Flipping the epoch before each wait means
+ * handlers arriving in the meantime count towards the other reader
+ * counter, so a steady stream of faults cannot starve us.  Must be
+ * called with tablock held.
+ */
+static void
+tab_publish(struct faulttab *nt)
+{
+	struct faulttab *ot;
+
+	ot = atomic_exchange(&curtab, nt);
+
+	for (int i = 0; i < 2; i++) {
+		unsigned int epoch = atomic_fetch_add(&tabepoch, 1) & 1;
+
+		while (atomic_load(&tabreaders[epoch]) != 0)
+			sched_yield();
+	}
+
+	if (ot != &emptytab)
+		free(ot);
+}
+
+/*
+ * Make sure the platform hook for each kind is installed iff there is
+ * anything for it to do.  Regions only ever see bad accesses; exception
+ * tables cover everything but breakpoints, which are left to debuggers
+ * unless somebody asks for them.  Must be called with tablock held.
+ */
+static int
+tab_hook(const struct faulttab *nt)
+{
+	int pins = atomic_load(&pinned);
+
+	for (int flt = 0; flt < FAULT_NKINDS; flt++) {
+		int want = nt->ft_acts[flt].fa_fun != NULL ||
+		    (pins & 1 << flt) ||
+		    (flt != FAULT_BREAKPOINT && nt->ft_nfixups > 0) ||
+		    (flt == FAULT_BAD_ACCESS && nt->ft_nregions > 0);
+
+		if (want && !(hooked & 1 << flt)) {
+			if (hook_fault(flt) < 0)
+				return -1;
+			hooked |= 1 << flt;
+		} else if (!want && (hooked & 1 << flt)) {
+			if (unhook_fault(flt) < 0)
+				return -1;
+			hooked &= ~(1 << flt);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Fault statistics.  Counters live in a fixed matrix of cache-line
+ * aligned per-thread slots by handler, so the fault handler never
+ * allocates and threads never share a line unless there are more of
+ * them than slots.  Handlers are identified by function pointer and
+ * claim a column with a single compare-and-swap; the last column
+ * collects whatever does not fit.  Escapes are not counted as such:
+ * they are the faults that never came back.
+ */
+#define STATS_SLOTS	64
+#define STATS_HANDLERS	32
+
+struct handlerstats {
+	atomic_uint_least64_t	 hs_faults,
+				 hs_retries,
+				 hs_declined,
+				 hs_ns,
+				 hs_hist[FAULT_STATS_BUCKETS];
+};
+
+struct statslot {
+	_Alignas(64) struct handlerstats ss_handlers[STATS_HANDLERS];
+};
+
+static atomic_int
+statson = 0;
+
+static void *_Atomic
+statskeys[STATS_HANDLERS] = { 0 };
+
+static struct statslot
+statslots[STATS_SLOTS];
+
+static atomic_uint
+statsnext = 0;
+
+static _Thread_local int
+statsslot __attribute__ ((tls_model ("initial-exec"))) = -1;
+
+static uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+stats_key(const void *key, int insert)
+{
+	unsigned int h = ((uintptr_t) key >> 4) % (STATS_HANDLERS - 1);
+
+	for (unsigned int i = 0; i < STATS_HANDLERS - 1; i++) {
+		unsigned int j = (h + i) % (STATS_HANDLERS - 1);
+		void *k = atomic_load_explicit(&statskeys[j],
+		    memory_order_acquire);
+
+		if (k == key)
+			return j;
+		if (k == NULL) {
+			if (!insert)
+				return -1;
+			if (atomic_compare_exchange_strong(&statskeys[j], &k,
+			    (void *) key) || k == key)
+				return j;
+		}
+	}
+
+	return insert ? STATS_HANDLERS - 1 : -1;
+}
+
+static struct handlerstats *
+stats_begin(const void *key, uint64_t *start)
+{
+	struct handlerstats *hs;
+
+	if (statsslot < 0)
+		statsslot = atomic_fetch_add(&statsnext, 1) % STATS_SLOTS;
+
+	hs = &statslots[statsslot].ss_handlers[stats_key(key, 1)];
+	atomic_fetch_add_explicit(&hs->hs_faults, 1, memory_order_relaxed);
+	*start = stats_now();
+
+	return hs;
+}
+
+static void
+stats_end(struct handlerstats *hs, uint64_t start, int res)
+{
+	uint64_t ns = stats_now() - start;
+	int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+
+	if (bucket >= FAULT_STATS_BUCKETS)
+		bucket = FAULT_STATS_BUCKETS - 1;
+
+	atomic_fetch_add_explicit(res ? &hs->hs_retries : &hs->hs_declined, 1,
+	    memory_order_relaxed);
+	atomic_fetch_add_explicit(&hs->hs_ns, ns, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hs->hs_hist[bucket], 1,
+	    memory_order_relaxed);
+}
+
+static int
+invoke(const struct faultaction *act, int flt, const struct faultinfo *fi)
+{
+	struct handlerstats *hs;
+	uint64_t start;
+	int res;
+
+	if (__builtin_expect(!atomic_load_explicit(&statson,
+	    memory_order_relaxed), 1))
+		return act->fa_fun(flt, fi, act->fa_arg);
+
+	hs = stats_begin((void *) act->fa_fun, &start);
+	res = act->fa_fun(flt, fi, act->fa_arg);
+	stats_end(hs, start, res);
+
+	return res;
+}
+
+static int
+invoke_resolve(int (*resolve)(void *, size_t, void *), void *addr,
+    size_t len, void *arg)
+{
+	struct handlerstats *hs;
+	uint64_t start;
+	int res;
+
+	if (__builtin_expect(!atomic_load_explicit(&statson,
+	    memory_order_relaxed), 1))
+		return resolve(addr, len, arg);
+
+	hs = stats_begin((void *) resolve, &start);
+	res = resolve(addr, len, arg);
+	stats_end(hs, start, res);
+
+	return res;
+}
+
+#include "fault-trace.c"
+
+#if defined(__linux__)
+# include "fault-uffd.c"
+#else
+static int
+uffd_register(uintptr_t start, uintptr_t end, int flags)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+static int
+uffd_unregister(uintptr_t start, uintptr_t end)
+{
+	return 0;
+}
+
+int
+fault_uffd_threads(unsigned int n)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int
+fault_uffd_copy(void *dst, const void *src, size_t len)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int
+fault_uffd_zero(void *dst, size_t len)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int
+fault_uffd_protect(void *addr, size_t len, int wp)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
+
+static int
+dispatch_handlers(int flt, const struct faultinfo *fi)
+{
+	struct faulttab *ft;
+	const struct region *rg;
+	const struct faultfixup *ff;
+	struct faultaction ract = { 0 }, tact = { 0 }, act;
+	struct faultfixup fix = { 0 };
+	int (*resolve)(void *, size_t, void *) = NULL;
+	void *start;
+	size_t len;
+	unsigned int epoch;
+
+	if ((tact.fa_fun = thracts[flt].fa_fun) != NULL) {
+		atomic_signal_fence(memory_order_acquire);
+		tact.fa_arg = thracts[flt].fa_arg;
+	}
+
+	ft = tab_enter(&epoch);
+	if (flt == FAULT_BAD_ACCESS &&
+	    (rg = tab_lookup(ft, fi->fi_addr)) != NULL &&
+	    !(rg->rg_flags & FR_UFFD)) {
+		ract = rg->rg_act;
+		if ((resolve = rg->rg_resolve) != NULL)
+			region_predict(rg, fi->fi_addr, &start, &len);
+	}
+	if (flt != FAULT_BREAKPOINT && fi->fi_ctx != NULL &&
+	    (ff = fixup_lookup(ft, fi->fi_pc)) != NULL)
+		fix = *ff;
+	act = ft->ft_acts[flt];
+	tab_leave(epoch);
+
+	if (resolve != NULL && invoke_resolve(resolve, start, len, ract.fa_arg))
+		return 1;
+
+	if (ract.fa_fun != NULL && invoke(&ract, flt, fi))
+		return 1;
+
+	/* a fixup only applies once the region has had its chance */
+	if (fix.ff_fixup != NULL) {
+		ctx_fixup(fi->fi_ctx, (uintptr_t) fix.ff_fixup, fix.ff_sp);
+		return 1;
+	}
+
+	if (tact.fa_fun != NULL && invoke(&tact, flt, fi))
+		return 1;
+
+	if (act.fa_fun != NULL && invoke(&act, flt, fi))
+		return 1;
+
+	return 0;
+}
+
+static int
+dispatch(int flt, const struct faultinfo *fi)
+{
+	struct traceslot *tsl;
+	uint64_t seq;
+	int res;
+
+	if (__builtin_expect(!atomic_load_explicit(&traceon,
+	    memory_order_relaxed), 1))
+		return dispatch_handlers(flt, fi);
+
+	tsl = trace_begin(flt, fi, &seq);
+	res = dispatch_handlers(flt, fi);
+	if (tsl != NULL)
+		trace_end(tsl, seq, res);
+
+	return res;
+}
+
 int
 fault(int flt, const struct faultaction *act, struct faultaction *oact)
 {
-	if (flt != FAULT_BAD_ACCESS) {
+	struct faulttab *ft, *nt;
+
+	if (flt < 0 || flt >= FAULT_NKINDS) {
 		errno = EINVAL;
 		return -1;
 	}
 
+	pthread_mutex_lock(&tablock);
+	ft = atomic_load(&curtab);
+
 	if (oact != NULL)
-		*oact = curact;
+		*oact = ft->ft_acts[flt];
 
 	if (act != NULL) {
-		int res;
+		if ((nt = tab_copy(ft, ft->ft_nregions)) == NULL)
+			goto fail;
+
+		nt->ft_acts[flt] = *act;
+		nt->ft_nregions = ft->ft_nregions;
+		memcpy(nt->ft_regions, ft->ft_regions,
+		    ft->ft_nregions * sizeof(ft->ft_regions[0]));
+
+		if (tab_hook(nt) < 0) {
+			free(nt);
+			goto fail;
+		}
+
+		tab_publish(nt);
+	}
+
+	pthread_mutex_unlock(&tablock);
+	return 0;
+
+fail:
+	pthread_mutex_unlock(&tablock);
+	return -1;
+}
+
+/*
+ * Install the hook for flt for good.
+ */
+static int
+pin_hook(int flt)
+{
+	int res = 0;
+
+	if (atomic_load_explicit(&pinned, memory_order_relaxed) & 1 << flt)
+		return 0;
+
+	pthread_mutex_lock(&tablock);
+	atomic_fetch_or(&pinned, 1 << flt);
+	if ((res = tab_hook(atomic_load(&curtab))) < 0)
+		atomic_fetch_and(&pinned, ~(1 << flt));
+	pthread_mutex_unlock(&tablock);
+
+	return res;
+}
+
+int
+fault_thread(int flt, const struct faultaction *act, struct faultaction *oact)
+{
+	if (flt < 0 || flt >= FAULT_NKINDS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (oact != NULL)
+		*oact = thracts[flt];
+
+	if (act == NULL)
+		return 0;
+
+	if (act->fa_fun != NULL && pin_hook(flt) < 0)
+		return -1;
+
+	/* never let the fault handler see a function with the wrong arg */
+	thracts[flt].fa_fun = NULL;
+	atomic_signal_fence(memory_order_release);
+	thracts[flt].fa_arg = act->fa_arg;
+	atomic_signal_fence(memory_order_release);
+	thracts[flt].fa_fun = act->fa_fun;
+
+	return 0;
+}
+
+int
+fault_register(const struct faultregion *fr)
+{
+	struct faulttab *ft, *nt;
+	uintptr_t start = (uintptr_t) fr->fr_addr,
+	    end = start + fr->fr_len;
+	struct regionstate *rs = NULL;
+	size_t i, granule;
+
+	if (pagesz == 0)
+		pagesz = sysconf(_SC_PAGESIZE);
+	granule = fr->fr_granule != 0 ? fr->fr_granule : pagesz;
+
+	if (fr->fr_len == 0 || end < start ||
+	    (fr->fr_act.fa_fun == NULL && fr->fr_resolve == NULL) ||
+	    granule % pagesz != 0 || (granule & (granule - 1)) != 0 ||
+	    ((fr->fr_resolve != NULL || fr->fr_granule != 0) &&
+	    (start | end) % granule != 0) ||
+	    (fr->fr_flags & ~(FR_UFFD | FR_UFFD_WP)) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&tablock);
+	ft = atomic_load(&curtab);
+
+	/* find the insertion point, rejecting overlap with a neighbour */
+	for (i = 0; i < ft->ft_nregions; i++)
+		if (ft->ft_regions[i].rg_start >= start)
+			break;
+	if ((i > 0 && ft->ft_regions[i - 1].rg_end > start) ||
+	    (i < ft->ft_nregions && ft->ft_regions[i].rg_start < end)) {
+		errno = EEXIST;
+		goto fail;
+	}
+
+	if (fr->fr_resolve != NULL) {
+		if ((rs = malloc(sizeof(*rs))) == NULL)
+			goto fail;
+		atomic_init(&rs->rs_last, -1);
+		atomic_init(&rs->rs_next, -1);
+		atomic_init(&rs->rs_stride, 1);
+		atomic_init(&rs->rs_window, 1);
+	}
+
+	if ((nt = tab_copy(ft, ft->ft_nregions + 1)) == NULL)
+		goto fail;
+
+	if ((fr->fr_flags & FR_UFFD) &&
+	    uffd_register(start, end, fr->fr_flags) < 0) {
+		free(nt);
+		goto fail;
+	}
+
+	memcpy(nt->ft_regions, ft->ft_regions,
+	    i * sizeof(ft->ft_regions[0]));
+	nt->ft_regions[i] = (struct region) {
+		.rg_start = start,
+		.rg_end = end,
+		.rg_act = fr->fr_act,
+		.rg_flags = fr->fr_flags,
+		.rg_resolve = fr->fr_resolve,
+		.rg_window = fr->fr_window != 0 ? fr->fr_window : FR_WINDOW,
+		.rg_granule = granule,
+		.rg_state = rs
+	};
+	memcpy(nt->ft_regions + i + 1, ft->ft_regions + i,
+	    (ft->ft_nregions - i) * sizeof(ft->ft_regions[0]));
+	nt->ft_nregions = ft->ft_nregions + 1;
+
+	if (tab_hook(nt) < 0) {
+		if (fr->fr_flags & FR_UFFD)
+			uffd_unregister(start, end);
+		free(nt);
+		goto fail;
+	}
+
+	tab_publish(nt);
+
+	pthread_mutex_unlock(&tablock);
+
+#if defined(MADV_HUGEPAGE)
+	/* only a hint; the region works the same without */
+	if (granule > pagesz)
+		madvise((void *) start, end - start, MADV_HUGEPAGE);
+#endif
+
+	return 0;
+
+fail:
+	pthread_mutex_unlock(&tablock);
+	free(rs);
+	return -1;
+}
+
+int
+fault_unregister(const void *addr)
+{
+	struct faulttab *ft, *nt;
+	struct regionstate *rs;
+	size_t i;
+
+	pthread_mutex_lock(&tablock);
+	ft = atomic_load(&curtab);
+
+	for (i = 0; i < ft->ft_nregions; i++)
+		if (ft->ft_regions[i].rg_start == (uintptr_t) addr)
+			break;
+	if (i == ft->ft_nregions) {
+		errno = ENOENT;
+		goto fail;
+	}
+
+	if ((nt = tab_copy(ft, ft->ft_nregions - 1)) == NULL)
+		goto fail;
+
+	memcpy(nt->ft_regions, ft->ft_regions,
+	    i * sizeof(ft->ft_regions[0]));
+	memcpy(nt->ft_regions + i, ft->ft_regions + i + 1,
+	    (ft->ft_nregions - i - 1) * sizeof(ft->ft_regions[0]));
+	nt->ft_nregions = ft->ft_nregions - 1;
+
+	if (tab_hook(nt) < 0) {
+		free(nt);
+		goto fail;
+	}
+
+	/* wakes anyone still waiting; they will simply fault again */
+	if (ft->ft_regions[i].rg_flags & FR_UFFD)
+		uffd_unregister(ft->ft_regions[i].rg_start,
+		    ft->ft_regions[i].rg_end);
+
+	rs = ft->ft_regions[i].rg_state;
+	tab_publish(nt);
+	free(rs);
+
+	pthread_mutex_unlock(&tablock);
+	return 0;
+
+fail:
+	pthread_mutex_unlock(&tablock);
+	return -1;
+}
+
+/*
+ * Reserve len bytes of PROT_NONE address space aligned to granule, a
+ * power-of-two multiple of the page size, for a region of that
+ * granularity.  The length is rounded up to a whole number of granules;
+ * munmap it as usual.
+ */
+void *
+fault_reserve(size_t len, size_t granule)
+{
+	char *addr, *aligned;
+	size_t slop;
+
+	if (pagesz == 0)
+		pagesz = sysconf(_SC_PAGESIZE);
+	if (granule == 0)
+		granule = pagesz;
+
+	if (len == 0 || granule % pagesz != 0 ||
+	    (granule & (granule - 1)) != 0 || len > SIZE_MAX - 2 * granule) {
+		errno = EINVAL;
+		return NULL;
+	}
+	len = (len + granule - 1) & ~(granule - 1);
+	slop = granule - pagesz;
+
+	/* over-reserve, then trim either side down to the aligned part */
+	addr = mmap(NULL, len + slop, PROT_NONE,
+	    MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+	aligned = (char *) (((uintptr_t) addr + granule - 1) & ~(granule - 1));
+	if (aligned > addr)
+		munmap(addr, aligned - addr);
+	if (addr + len + slop > aligned + len)
+		munmap(aligned + len, addr + len + slop - (aligned + len));
 
-		if (act->fa_fun != NULL && curact.fa_fun == NULL)
-			res = hook_fault();
-		else if (act->fa_fun == NULL && curact.fa_fun != NULL)
-			res = unhook_fault();
-		if (res < 0)
-			return res;
+	return aligned;
+}
+
+/*
+ * Replace the array of exception tables with fixups, n entries long.
+ * Must be called with tablock held.
+ */
+static int
+fixup_replace(struct fixuptab *fixups, size_t n)
+{
+	struct faulttab *ft = atomic_load(&curtab), *nt;
+	const struct fixuptab *ofixups = ft->ft_fixups;
+
+	if ((nt = tab_copy(ft, ft->ft_nregions)) == NULL)
+		return -1;
+
+	memcpy(nt->ft_regions, ft->ft_regions,
+	    ft->ft_nregions * sizeof(ft->ft_regions[0]));
+	nt->ft_nregions = ft->ft_nregions;
+	nt->ft_fixups = fixups;
+	nt->ft_nfixups = n;
+
+	if (tab_hook(nt) < 0) {
+		free(nt);
+		return -1;
+	}
+
+	tab_publish(nt);
+	free((void *) ofixups);
+
+	return 0;
+}
+
+int
+fault_fixup_register(const struct faultfixup *tab, size_t n)
+{
+	struct faulttab *ft;
+	struct fixuptab *fixups;
+	uintptr_t start, end;
+	size_t i;
+
+	if (tab == NULL || n == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (tab[i].ff_fixup == NULL ||
+		    (uintptr_t) tab[i].ff_end <= (uintptr_t) tab[i].ff_start ||
+		    (i > 0 && (uintptr_t) tab[i].ff_start <
+		    (uintptr_t) tab[i - 1].ff_end)) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	start = (uintptr_t) tab[0].ff_start;
+	end = (uintptr_t) tab[n - 1].ff_end;
+
+	pthread_mutex_lock(&tablock);
+	ft = atomic_load(&curtab);
+
+	for (i = 0; i < ft->ft_nfixups; i++)
+		if (ft->ft_fixups[i].xt_start >= start)
+			break;
+	if ((i > 0 && ft->ft_fixups[i - 1].xt_end > start) ||
+	    (i < ft->ft_nfixups && ft->ft_fixups[i].xt_start < end)) {
+		errno = EEXIST;
+		goto fail;
+	}
+
+	if ((fixups = malloc((ft->ft_nfixups + 1) * sizeof(fixups[0]))) == NULL)
+		goto fail;
+
+	memcpy(fixups, ft->ft_fixups, i * sizeof(fixups[0]));
+	fixups[i] = (struct fixuptab) {
+		.xt_start = start,
+		.xt_end = end,
+		.xt_ents = tab,
+		.xt_nents = n
+	};
+	memcpy(fixups + i + 1, ft->ft_fixups + i,
+	    (ft->ft_nfixups - i) * sizeof(fixups[0]));
+
+	if (fixup_replace(fixups, ft->ft_nfixups + 1) < 0) {
+		free(fixups);
+		goto fail;
+	}
+
+	pthread_mutex_unlock(&tablock);
+	return 0;
+
+fail:
+	pthread_mutex_unlock(&tablock);
+	return -1;
+}
+
+/*
+ * Once this returns, no fault handler is looking at tab any more.
+ */
+int
+fault_fixup_unregister(const struct faultfixup *tab)
+{
+	struct faulttab *ft;
+	struct fixuptab *fixups = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&tablock);
+	ft = atomic_load(&curtab);
+
+	for (i = 0; i < ft->ft_nfixups; i++)
+		if (ft->ft_fixups[i].xt_ents == tab)
+			break;
+	if (i == ft->ft_nfixups) {
+		errno = ENOENT;
+		goto fail;
+	}
+
+	if (ft->ft_nfixups > 1) {
+		if ((fixups = malloc((ft->ft_nfixups - 1) *
+		    sizeof(fixups[0]))) == NULL)
+			goto fail;
+		memcpy(fixups, ft->ft_fixups, i * sizeof(fixups[0]));
+		memcpy(fixups + i, ft->ft_fixups + i + 1,
+		    (ft->ft_nfixups - i - 1) * sizeof(fixups[0]));
+	}
+
+	if (fixup_replace(fixups, ft->ft_nfixups - 1) < 0) {
+		free(fixups);
+		goto fail;
+	}
+
+	pthread_mutex_unlock(&tablock);
+	return 0;
+
+fail:
+	pthread_mutex_unlock(&tablock);
+	return -1;
+}
+
+int
+fault_probe_init(void)
+{
+	return pin_hook(FAULT_BAD_ACCESS);
+}
 
-		curact = *act;
+/*
+ * Have the thread resume at pc when the handler returns non-zero.
+ */
+int
+fault_resume(const struct faultinfo *fi, void *pc)
+{
+	if (fi->fi_ctx == NULL) {
+		errno = EINVAL;
+		return -1;
 	}
 
+	ctx_fixup(fi->fi_ctx, (uintptr_t) pc, 0);
+
+	return 0;
+}
+
+/*
+ * Give the calling thread an alternate signal stack, unless it has one
+ * already.
+ */
+int
+fault_altstack(void)
+{
+	return altstack_enable();
+}
+
+int
+fault_stats_enable(int on)
+{
+	return atomic_exchange(&statson, on != 0);
+}
+
+/*
+ * Add up the counters for fun (or all handlers if NULL), for the calling
+ * thread's slot only with FAULT_STATS_THREAD.  Counters are read one at
+ * a time while faults may be coming in, so totals can be a fault or two
+ * apart.
+ */
+int
+fault_stats(int (*fun)(int, const struct faultinfo *, void *), int flags,
+    struct faultstats *fs)
+{
+	int key = -1;
+	uint64_t returned;
+
+	if ((flags & ~FAULT_STATS_THREAD) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(fs, 0, sizeof(*fs));
+	if (fun != NULL && (key = stats_key((void *) fun, 0)) < 0)
+		return 0;
+	if ((flags & FAULT_STATS_THREAD) && statsslot < 0)
+		return 0;
+
+	for (int s = 0; s < STATS_SLOTS; s++) {
+		if ((flags & FAULT_STATS_THREAD) && s != statsslot)
+			continue;
+
+		for (int h = 0; h < STATS_HANDLERS; h++) {
+			const struct handlerstats *hs =
+			    &statslots[s].ss_handlers[h];
+
+			if (key >= 0 && h != key)
+				continue;
+
+			fs->fs_faults += atomic_load(&hs->hs_faults);
+			fs->fs_retries += atomic_load(&hs->hs_retries);
+			fs->fs_declined += atomic_load(&hs->hs_declined);
+			fs->fs_ns += atomic_load(&hs->hs_ns);
+			for (int b = 0; b < FAULT_STATS_BUCKETS; b++)
+				fs->fs_hist[b] += atomic_load(&hs->hs_hist[b]);
+		}
+	}
+
+	returned = fs->fs_retries + fs->fs_declined;
+	fs->fs_escapes = fs->fs_faults > returned ? fs->fs_faults - returned : 0;
+
 	return 0;
 }
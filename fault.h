@@ -17,22 +17,542 @@
 #ifndef _FAULT_H_
 #define _FAULT_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Kinds of fault.  For the traps, fi_addr is the address the system
+ * reports (usually the trapping instruction's) and returning non-zero
+ * resumes at whatever pc fi_ctx holds by then: for an illegal instruction
+ * or an arithmetic trap, the same instruction again unless an exception
+ * table or the handler (with fault_resume) moves it on; after a
+ * breakpoint, wherever the architecture left the pc (past int3 on x86,
+ * on brk on aarch64).
+ */
 enum {
-	FAULT_BAD_ACCESS = 0
+	FAULT_BAD_ACCESS = 0,
+	FAULT_ILLEGAL_INSN,	/* SIGILL: ud2, udf, ... */
+	FAULT_ARITHMETIC,	/* SIGFPE: integer divide by zero, ... */
+	FAULT_BREAKPOINT	/* SIGTRAP: int3, brk, ... */
 };
 
+#define FAULT_NKINDS	4
+
 struct faultinfo {
 	void		*fi_pc,
 			*fi_sp,
 			*fi_addr,
 			*fi_ctx;
+	int		 fi_flags;
 };
 
+#define FI_UFFD		0x01	/* delivered by userfaultfd; no pc/sp/ctx */
+#define FI_WRITE	0x02	/* faulting access was a write */
+#define FI_WP		0x04	/* write to a userfaultfd-protected page */
+#define FI_BUS		0x08	/* SIGBUS: no backing store, e.g. past EOF */
+
 struct faultaction {
 	int	(*fa_fun)(int flt, const struct faultinfo *, void *);
 	void	*fa_arg;
 };
 
+/*
+ * An address range with its own fault handler.  Faults on addresses in
+ * [fr_addr, fr_addr + fr_len) are passed to fr_act first; if it returns
+ * zero, the process-wide handler gets a go.
+ */
+struct faultregion {
+	void			*fr_addr;
+	size_t			 fr_len;
+	struct faultaction	 fr_act;
+	int			 fr_flags;
+
+	/*
+	 * Optional fault-around: instead of (or before) calling fr_act,
+	 * call fr_resolve once for a window of pages around the fault, in
+	 * the direction and stride of recent faults.  The window doubles
+	 * on each fault that lands where the last window ended and halves
+	 * on others, between one page and fr_window pages (default 32).
+	 * Return non-zero once [addr, addr + len) is accessible.
+	 */
+	int			(*fr_resolve)(void *addr, size_t len,
+				    void *arg);
+	size_t			 fr_window;
+
+	/*
+	 * Optional resolution granularity: a power-of-two multiple of the
+	 * page size (say 64 KiB or 2 MiB) that fr_addr and fr_len must be
+	 * aligned to.  Fault-around windows are then whole granules and
+	 * fr_window counts granules; anything larger than a page is also
+	 * advised to use transparent huge pages.  fault_reserve hands out
+	 * suitably aligned address space.
+	 */
+	size_t			 fr_granule;
+};
+
+/*
+ * Linux only: resolve faults in the region on a pool of resolver threads
+ * via userfaultfd instead of a signal.  The handler runs on a resolver
+ * thread with FI_UFFD set and must populate the page using the
+ * fault_uffd_* functions before returning non-zero; if it returns zero
+ * the page is zero-filled (or write-enabled) as the kernel would have.
+ */
+#define FR_UFFD		0x01	/* missing-page faults via userfaultfd */
+#define FR_UFFD_WP	0x02	/* write-protect faults too */
+
 int	 fault(int flt, const struct faultaction *act, struct faultaction *oact);
+int	 fault_thread(int flt, const struct faultaction *act,
+	    struct faultaction *oact);
+int	 fault_register(const struct faultregion *fr);
+int	 fault_unregister(const void *addr);
+void	*fault_reserve(size_t len, size_t granule);
+int	 fault_resume(const struct faultinfo *fi, void *pc);
+
+/*
+ * Run the handler on an alternate signal stack in the calling thread, so
+ * it still works when the thread's own stack is exhausted.  The stack is
+ * freed when the thread exits.  Not supported on Mach.
+ */
+int	 fault_altstack(void);
+
+/*
+ * Handler statistics, off by default.  fs_hist[i] counts handler runs
+ * taking [2^i, 2^(i+1)) nanoseconds; escapes are faults whose handler
+ * never returned (siglongjmp), and have no time recorded.
+ */
+#define FAULT_STATS_BUCKETS	32
+#define FAULT_STATS_THREAD	0x01	/* calling thread only */
+
+struct faultstats {
+	uint64_t	 fs_faults,
+			 fs_retries,
+			 fs_declined,
+			 fs_escapes,
+			 fs_ns,
+			 fs_hist[FAULT_STATS_BUCKETS];
+};
+
+int	 fault_stats_enable(int on);
+int	 fault_stats(int (*fun)(int, const struct faultinfo *, void *),
+	    int flags, struct faultstats *fs);
+
+/*
+ * Fault tracing: every fault delivered to the handler is written to a
+ * binary trace file, a struct faulttracehdr followed by th_evsize-sized
+ * struct faultevents in per-thread order.
+ */
+#define FAULT_TRACE_MAGIC	0x46545243	/* "CRTF" little-endian */
+#define FAULT_TRACE_VERSION	1
+
+#define FAULT_TRACE_DECLINED	0	/* no handler took it */
+#define FAULT_TRACE_RETRY	1	/* a handler returned non-zero */
+#define FAULT_TRACE_ESCAPED	2	/* the handler never returned */
+
+struct faulttracehdr {
+	uint32_t	 th_magic,
+			 th_version,
+			 th_evsize,
+			 th_pagesize;
+	uint64_t	 th_dropped;	/* events lost to full rings */
+};
+
+struct faultevent {
+	uint64_t	 fe_time,	/* CLOCK_MONOTONIC, in ns */
+			 fe_pc,
+			 fe_sp,
+			 fe_addr;
+	uint32_t	 fe_tid;
+	int16_t		 fe_kind;
+	uint8_t		 fe_flags,
+			 fe_result;
+};
+
+int	 fault_trace_start(const char *path, size_t ringsize);
+int	 fault_trace_stop(void);
+
+/*
+ * Exception tables.  A fault at a pc in [ff_start, ff_end) that no
+ * region handler resolves resumes at ff_fixup, with ff_sp added to the
+ * stack pointer.  This goes for illegal instructions and arithmetic
+ * traps too, but not for breakpoints.  The entries of a table must be
+ * sorted and disjoint, and the table must stay put until it has been
+ * unregistered.
+ */
+struct faultfixup {
+	void		*ff_start,
+			*ff_end,
+			*ff_fixup;
+	ptrdiff_t	 ff_sp;
+};
+
+int	 fault_fixup_register(const struct faultfixup *tab, size_t n);
+int	 fault_fixup_unregister(const struct faultfixup *tab);
+
+/*
+ * Decoding and emulation of the load or store that faulted, for the
+ * common integer forms on x86_64 and aarch64.  fault_decode works out
+ * what the instruction was after.  fault_emulate carries it out against
+ * addr instead (or the original address if addr is NULL), updates the
+ * registers and moves the pc past the instruction, so that a handler
+ * returning 1 lets the program continue with the page still protected.
+ * Both fail with ENOTSUP for anything they do not recognise, and need
+ * fi_ctx.
+ */
+struct faultaccess {
+	void		*fc_addr;	/* effective address */
+	size_t		 fc_size;	/* bytes accessed */
+	size_t		 fc_len;	/* instruction length */
+	int		 fc_write;
+};
+
+int	 fault_decode(const struct faultinfo *fi, struct faultaccess *fc);
+int	 fault_emulate(const struct faultinfo *fi, void *addr);
+
+/*
+ * Memory probes: return 0, or -1 if the access faulted and no region
+ * handler resolved it.  Only memory that is actually accessed may fault;
+ * fault_probe_read and fault_probe_write touch one byte per page (the
+ * latter without changing it).  fault_probe_init must have been called
+ * once before any of them is used.
+ */
+int	 fault_probe_init(void);
+int	 fault_fetch32(const void *addr, uint32_t *val);
+int	 fault_fetch64(const void *addr, uint64_t *val);
+int	 fault_probe_read(const void *addr, size_t len);
+int	 fault_probe_write(void *addr, size_t len);
+int	 fault_copy(void *dst, const void *src, size_t len);
+
+int	 fault_uffd_threads(unsigned int n);
+int	 fault_uffd_copy(void *dst, const void *src, size_t len);
+int	 fault_uffd_zero(void *dst, size_t len);
+int	 fault_uffd_protect(void *addr, size_t len, int wp);
+
+/*
+ * Reserve/commit arenas: address space is reserved up front and committed
+ * chunk by chunk from the fault handler as it is first touched.
+ */
+struct faultarena;
+
+#define FAULT_ARENA_ZERO	0x01	/* decommitted chunks read as zero */
+
+struct faultarena *
+	 fault_arena_create(size_t size, size_t chunk, int flags);
+void	 fault_arena_destroy(struct faultarena *fa);
+void	*fault_arena_base(const struct faultarena *fa);
+void	*fault_arena_alloc(struct faultarena *fa, size_t len, size_t align);
+int	 fault_arena_decommit(struct faultarena *fa, void *addr, size_t len);
+ssize_t	 fault_arena_trim(struct faultarena *fa);
+size_t	 fault_arena_committed(const struct faultarena *fa);
+
+/*
+ * Dirty page tracking over [addr, addr + len), with userfaultfd
+ * write-protect or else mprotect unless a backend is asked for.
+ * Soft-dirty is never picked on its own: a reset while other threads
+ * write can lose their writes.  Bitmaps hold one bit per page, in words
+ * of unsigned long.
+ */
+struct faultdirty;
+
+#define FAULT_DIRTY_AUTO	0
+#define FAULT_DIRTY_MPROTECT	1
+#define FAULT_DIRTY_SOFTDIRTY	2
+#define FAULT_DIRTY_UFFD	3
+
+struct faultdirty *
+	 fault_dirty_start(void *addr, size_t len, int backend);
+int	 fault_dirty_backend(const struct faultdirty *fd);
+ssize_t	 fault_dirty_collect(struct faultdirty *fd, unsigned long *bitmap,
+	    int reset);
+ssize_t	 fault_dirty_next(const unsigned long *bitmap, size_t npages,
+	    size_t from);
+void	 fault_dirty_stop(struct faultdirty *fd);
+
+/*
+ * Copy-on-write snapshots of a read-write range, taken without fork.
+ * Writers keep going; the first write to each page copies it aside.
+ * One reader reads the snapshot and releases what it has finished with.
+ */
+struct faultsnap;
+
+struct faultsnap *
+	 fault_snap_create(void *addr, size_t len);
+int	 fault_snap_read(struct faultsnap *sn, size_t off, void *buf,
+	    size_t len);
+int	 fault_snap_release(struct faultsnap *sn, size_t off, size_t len);
+size_t	 fault_snap_copied(const struct faultsnap *sn);
+void	 fault_snap_destroy(struct faultsnap *sn);
+
+/*
+ * Compressed memory: a range whose cold pages are compressed by
+ * fault_comp_scan and decompressed again on the next fault.
+ */
+struct faultcomp;
+
+struct faultcompstats {
+	size_t		 cs_pages,	/* in the range */
+			 cs_stored,	/* compressed right now */
+			 cs_filled,	/* of which same-filled */
+			 cs_bytes;	/* compressed size of the rest */
+	uint64_t	 cs_faults,	/* decompressions */
+			 cs_ns;		/* time spent decompressing */
+};
+
+struct faultcomp *
+	 fault_comp_create(size_t len);
+void	*fault_comp_base(const struct faultcomp *fc);
+ssize_t	 fault_comp_scan(struct faultcomp *fc);
+int	 fault_comp_stats(const struct faultcomp *fc,
+	    struct faultcompstats *cs);
+void	 fault_comp_destroy(struct faultcomp *fc);
+
+/*
+ * Sampling guarded allocator: about one in every rate allocations gets a
+ * page of its own between guard pages, so that overflows, underflows and
+ * uses after free fault and are reported with where the memory was
+ * allocated and freed.
+ */
+struct faultguard;
+
+#define FAULT_GUARD_RATE	5000
+#define FAULT_GUARD_FRAMES	16
+
+#define FAULT_GUARD_UNKNOWN		0
+#define FAULT_GUARD_OVERFLOW		1
+#define FAULT_GUARD_UNDERFLOW		2
+#define FAULT_GUARD_USE_AFTER_FREE	3
+#define FAULT_GUARD_DOUBLE_FREE		4
+#define FAULT_GUARD_INVALID_FREE	5
+
+struct faultguardtrace {
+	int		 gt_nframes;
+	void		*gt_frames[FAULT_GUARD_FRAMES];
+};
+
+struct faultguardreport {
+	int		 gr_kind;
+	void		*gr_addr;	/* faulting or freed address */
+	void		*gr_ptr;	/* the allocation, if known */
+	size_t		 gr_size;
+	struct faultguardtrace
+			 gr_alloc,
+			 gr_free;
+};
+
+struct faultguard *
+	 fault_guard_create(size_t nslots, unsigned int rate,
+	    void (*report)(const struct faultguardreport *, void *),
+	    void *arg);
+void	*fault_guard_malloc(struct faultguard *gu, size_t size);
+int	 fault_guard_free(struct faultguard *gu, void *ptr);
+void	 fault_guard_destroy(struct faultguard *gu);
+
+/*
+ * Stacks that grow on demand: fault_stack_create reserves max bytes
+ * above a guard page but commits only the top page, and faults just
+ * below the committed part from a thread running on the stack commit
+ * more.  Threads that run on these stacks need fault_altstack.
+ */
+struct faultstack;
+
+struct faultstack *
+	 fault_stack_create(size_t max);
+void	*fault_stack_base(const struct faultstack *st);
+size_t	 fault_stack_size(const struct faultstack *st);
+size_t	 fault_stack_committed(const struct faultstack *st);
+int	 fault_stack_trim(struct faultstack *st);
+void	 fault_stack_destroy(struct faultstack *st);
+
+/*
+ * NUMA placement: pages of the range are allocated on the node of the
+ * thread that first touches them, and with FAULT_NUMA_MIGRATE, each
+ * fault_numa_scan moves sampled pages toward the node that keeps
+ * accessing them.  Nothing faults on single-node machines.
+ */
+struct faultnuma;
+
+#define FAULT_NUMA_MIGRATE	0x01
+
+struct faultnumastats {
+	int		 ns_nodes;
+	uint64_t	 ns_placed,	/* first touches */
+			 ns_sampled,	/* sampled accesses */
+			 ns_migrated;	/* pages moved */
+};
+
+struct faultnuma *
+	 fault_numa_create(size_t len, int flags);
+void	*fault_numa_base(const struct faultnuma *nm);
+ssize_t	 fault_numa_scan(struct faultnuma *nm, size_t nsample);
+int	 fault_numa_stats(const struct faultnuma *nm,
+	    struct faultnumastats *ns);
+void	 fault_numa_destroy(struct faultnuma *nm);
+
+/*
+ * Working set estimation over a read-write range by protecting a random
+ * sample of its pages every interval and counting those accessed.
+ */
+struct faultwss;
+
+#define FAULT_WSS_HEAT	9
+
+struct faultwssstats {
+	size_t		 wt_pages,	/* in the range */
+			 wt_sampled,	/* in the last interval */
+			 wt_touched;	/* of which accessed */
+	uint64_t	 wt_bytes,	/* working set estimate */
+			 wt_intervals,
+			 wt_faults;
+	size_t		 wt_heat[FAULT_WSS_HEAT];
+};
+
+struct faultwss *
+	 fault_wss_start(void *addr, size_t len, size_t nsample,
+	    unsigned int interval);
+int	 fault_wss_sample(struct faultwss *ws);
+int	 fault_wss_stats(struct faultwss *ws, struct faultwssstats *wst);
+void	 fault_wss_stop(struct faultwss *ws);
+
+/*
+ * Mapped file reader: zero-copy reads of a file with read-like errors.
+ * Pages that cannot be read, because the file was truncated or the read
+ * failed, end the call short (or fail it with EIO) instead of raising
+ * SIGBUS.
+ */
+struct faultfile;
+
+#define FAULT_FILE_RANDOM	0x01	/* no readahead */
+
+struct faultfile *
+	 fault_file_open(int fd, int flags, size_t window);
+ssize_t	 fault_file_read(struct faultfile *ff, void *buf, size_t len,
+	    off_t off);
+ssize_t	 fault_file_send(struct faultfile *ff, int fd, size_t len,
+	    off_t off);
+ssize_t	 fault_file_check(struct faultfile *ff, off_t off, size_t len);
+const void *
+	 fault_file_data(const struct faultfile *ff);
+size_t	 fault_file_size(const struct faultfile *ff);
+void	 fault_file_close(struct faultfile *ff);
+
+/*
+ * Safepoints: attached threads poll with FAULT_SAFEPOINT_POLL, a single
+ * load from a page of the library's.  Arming makes the page PROT_NONE
+ * and waits until every attached thread has parked at a poll (in the
+ * fault handler, its registers in fi_ctx) or is blocked; disarming lets
+ * them all go.
+ */
+struct faultsafepoint;
+
+#define FAULT_SAFEPOINT_POLL(page)	((void) *(const volatile char *) (page))
+
+struct faultsafepointstats {
+	uint64_t	 ps_safepoints,
+			 ps_parks,	/* threads parked at a poll */
+			 ps_ns,		/* total arm-to-stopped time */
+			 ps_maxns,
+			 ps_lastns,
+			 ps_hist[FAULT_STATS_BUCKETS];
+};
+
+struct faultsafepoint *
+	 fault_safepoint_create(void);
+const void *
+	 fault_safepoint_page(const struct faultsafepoint *sf);
+int	 fault_safepoint_attach(struct faultsafepoint *sf, void *thread);
+int	 fault_safepoint_detach(struct faultsafepoint *sf);
+int	 fault_safepoint_block(struct faultsafepoint *sf);
+int	 fault_safepoint_unblock(struct faultsafepoint *sf);
+int	 fault_safepoint_arm(struct faultsafepoint *sf);
+int	 fault_safepoint_disarm(struct faultsafepoint *sf);
+int	 fault_safepoint_threads(struct faultsafepoint *sf,
+	    int (*fun)(void *thread, const struct faultinfo *fi, void *arg),
+	    void *arg);
+int	 fault_safepoint_stats(const struct faultsafepoint *sf,
+	    struct faultsafepointstats *ps);
+void	 fault_safepoint_destroy(struct faultsafepoint *sf);
+
+/*
+ * Page-state tables: two bits of state per page of a range, naming the
+ * protection the page should have.  Changes are queued and applied by
+ * fault_pages_flush as few mprotect calls as the runs of pages allow.
+ * fault_pages_get is constant time and safe in a fault handler.
+ */
+struct faultpages;
+
+#define FAULT_PAGES_NONE	0
+#define FAULT_PAGES_READ	1
+#define FAULT_PAGES_WRITE	2	/* read and write */
+#define FAULT_PAGES_EXEC	3	/* read and execute */
+#define FAULT_PAGES_PENDING	0x04	/* not applied yet */
+
+struct faultpagesstats {
+	size_t		 pg_pages;	/* in the range */
+	uint64_t	 pg_queued,	/* page changes asked for */
+			 pg_flushes,
+			 pg_calls,	/* mprotect calls made */
+			 pg_changed;	/* pages they changed */
+};
+
+struct faultpages *
+	 fault_pages_create(void *addr, size_t len, int state);
+int	 fault_pages_set(struct faultpages *pt, void *addr, size_t len,
+	    int state);
+int	 fault_pages_get(const struct faultpages *pt, const void *addr);
+ssize_t	 fault_pages_flush(struct faultpages *pt);
+int	 fault_pages_stats(const struct faultpages *pt,
+	    struct faultpagesstats *pg);
+void	 fault_pages_destroy(struct faultpages *pt);
+
+/*
+ * Concurrent compaction: a heap whose pages can be evacuated while the
+ * mutators keep running.  Selected pages are protected; a mutator that
+ * touches one copies it out itself (or waits for whoever is), and its
+ * accesses to evacuated pages are emulated against the new copy.
+ * co_copy gets a readable alias of the page and the page's own address,
+ * moves its live objects and records where they went, returning 0; it
+ * may run in a fault handler on any thread.  co_forward gives the new
+ * address of a byte of an evacuated page, or NULL.
+ */
+struct faultcompact;
+
+struct faultcompactops {
+	int		(*co_copy)(const void *alias, void *page, size_t len,
+			    void *arg);
+	void		*(*co_forward)(const void *addr, void *arg);
+};
+
+struct faultcompactstats {
+	size_t		 ct_pages,	/* in the heap */
+			 ct_selected,	/* waiting to be copied */
+			 ct_evacuated;	/* copied, not yet released */
+	uint64_t	 ct_copied,	/* pages copied by the collector */
+			 ct_assists,	/* pages copied by mutators */
+			 ct_forwarded;	/* accesses emulated */
+};
+
+struct faultcompact *
+	 fault_compact_create(size_t len, const struct faultcompactops *ops,
+	    void *arg);
+void	*fault_compact_base(const struct faultcompact *cm);
+ssize_t	 fault_compact_select(struct faultcompact *cm, void *addr,
+	    size_t len);
+ssize_t	 fault_compact_evacuate(struct faultcompact *cm, void *addr,
+	    size_t len);
+int	 fault_compact_assist(struct faultcompact *cm, const void *addr);
+void	*fault_compact_forward(struct faultcompact *cm, const void *addr);
+ssize_t	 fault_compact_release(struct faultcompact *cm, void *addr,
+	    size_t len);
+int	 fault_compact_stats(const struct faultcompact *cm,
+	    struct faultcompactstats *ct);
+void	 fault_compact_destroy(struct faultcompact *cm);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* _FAULT_H_ */
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * C++ bindings, header only (C++17).  A handler is any callable taking
+ * (int flt, const struct faultinfo &) and returning something that
+ * converts to bool, with the same meaning as for fa_fun.  Its type is a
+ * template parameter, so the one function the library calls through
+ * fa_fun calls it directly and the compiler can inline it there.
+ *
+ * The scoped_* guards install a handler for their lifetime and throw
+ * std::system_error if they cannot.  They are neither copyable nor
+ * movable, since the library holds on to their address.
+ */
+
+#ifndef _FAULT_HPP_
+#define _FAULT_HPP_
+
+#include "fault.h"
+
+#include <cerrno>
+#include <csetjmp>
+#include <optional>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include <signal.h>
+#if !(defined(__APPLE__) && defined(__MACH__))
+# include <ucontext.h>
+#endif
+
+namespace libfault {
+
+[[noreturn]] inline void
+throw_errno(const char *what)
+{
+	throw std::system_error(errno, std::generic_category(), what);
+}
+
+/*
+ * A callable bound to a struct faultaction.
+ */
+template <typename F>
+class handler {
+public:
+	explicit handler(F fun) : h_fun(std::move(fun)) {}
+	handler(const handler &) = delete;
+	handler &operator=(const handler &) = delete;
+
+	/* valid for as long as this handler lives */
+	struct faultaction
+	action() noexcept
+	{
+		return { &handler::call, this };
+	}
+
+private:
+	static int
+	call(int flt, const struct faultinfo *fi, void *arg)
+	{
+		return static_cast<handler *>(arg)->h_fun(flt, *fi) ? 1 : 0;
+	}
+
+	F	 h_fun;
+};
+
+/*
+ * The calling thread's handler for faults of kind flt, with the previous
+ * one put back on the way out.
+ */
+template <typename F>
+class scoped_thread_handler {
+public:
+	explicit scoped_thread_handler(F fun, int flt = FAULT_BAD_ACCESS) :
+	    sh_handler(std::move(fun)), sh_flt(flt)
+	{
+		struct faultaction act = sh_handler.action();
+
+		if (fault_thread(sh_flt, &act, &sh_prev) != 0)
+			throw_errno("fault_thread");
+	}
+
+	~scoped_thread_handler()
+	{
+		fault_thread(sh_flt, &sh_prev, nullptr);
+	}
+
+	scoped_thread_handler(const scoped_thread_handler &) = delete;
+	scoped_thread_handler &operator=(const scoped_thread_handler &) =
+	    delete;
+
+private:
+	handler<F>		 sh_handler;
+	int			 sh_flt;
+	struct faultaction	 sh_prev;
+};
+
+/*
+ * The process-wide handler, likewise.
+ */
+template <typename F>
+class scoped_handler {
+public:
+	explicit scoped_handler(F fun, int flt = FAULT_BAD_ACCESS) :
+	    sh_handler(std::move(fun)), sh_flt(flt)
+	{
+		struct faultaction act = sh_handler.action();
+
+		if (fault(sh_flt, &act, &sh_prev) != 0)
+			throw_errno("fault");
+	}
+
+	~scoped_handler()
+	{
+		fault(sh_flt, &sh_prev, nullptr);
+	}
+
+	scoped_handler(const scoped_handler &) = delete;
+	scoped_handler &operator=(const scoped_handler &) = delete;
+
+private:
+	handler<F>		 sh_handler;
+	int			 sh_flt;
+	struct faultaction	 sh_prev;
+};
+
+/*
+ * A region handler for [addr, addr + len).
+ */
+template <typename F>
+class scoped_region {
+public:
+	scoped_region(void *addr, size_t len, F fun, int flags = 0,
+	    size_t granule = 0) : sr_handler(std::move(fun)), sr_addr(addr)
+	{
+		struct faultregion fr = {};
+
+		fr.fr_addr = addr;
+		fr.fr_len = len;
+		fr.fr_act = sr_handler.action();
+		fr.fr_flags = flags;
+		fr.fr_granule = granule;
+		if (fault_register(&fr) != 0)
+			throw_errno("fault_register");
+	}
+
+	~scoped_region()
+	{
+		fault_unregister(sr_addr);
+	}
+
+	scoped_region(const scoped_region &) = delete;
+	scoped_region &operator=(const scoped_region &) = delete;
+
+private:
+	handler<F>		 sr_handler;
+	void			*sr_addr;
+};
+
+/*
+ * Run fun() and return true, or return false as soon as it makes an
+ * access that faults and that no region handler resolves.  Whatever fun
+ * was in the middle of is abandoned without unwinding, so it should not
+ * have objects with non-trivial destructors alive at the time.
+ */
+template <typename F>
+bool
+guarded(F &&fun)
+{
+	sigjmp_buf env;
+	auto escape = [&env](int, const struct faultinfo &fi) -> bool {
+#if !(defined(__APPLE__) && defined(__MACH__))
+		/* saving the mask in sigsetjmp would cost a syscall per call */
+		if (fi.fi_ctx != nullptr)
+			pthread_sigmask(SIG_SETMASK,
+			    &static_cast<ucontext_t *>(fi.fi_ctx)->uc_sigmask,
+			    nullptr);
+#endif
+		siglongjmp(env, 1);
+	};
+	scoped_thread_handler<decltype(escape)> guard(escape);
+
+	if (sigsetjmp(env, 0) != 0)
+		return false;
+	std::forward<F>(fun)();
+
+	return true;
+}
+
+/*
+ * Probes: *addr, or nothing if reading it faults; and whether storing
+ * val at addr went through.  No handler is involved.
+ */
+inline void
+probe_init()
+{
+	static const int res = fault_probe_init();
+
+	if (res != 0)
+		throw_errno("fault_probe_init");
+}
+
+template <typename T>
+std::optional<T>
+load(const T *addr)
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+	T val;
+
+	probe_init();
+	if (fault_copy(&val, addr, sizeof(T)) != 0)
+		return std::nullopt;
+
+	return val;
+}
+
+template <typename T>
+bool
+store(T *addr, const T &val)
+{
+	static_assert(std::is_trivially_copyable_v<T>);
+
+	probe_init();
+	return fault_copy(addr, &val, sizeof(T)) == 0;
+}
+
+} /* namespace libfault */
+
+#endif /* _FAULT_HPP_ */
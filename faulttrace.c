@@ -0,0 +1,187 @@
+#include "fault.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Summarise a trace written by fault_trace_start: hot faulting PCs, hot
+ * pages, busy threads and the distribution of time between faults.
+ */
+
+#define nitems(arr)	(sizeof(arr) / sizeof((arr)[0]))
+
+struct count {
+	uint64_t	 key,
+			 n;
+};
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int
+cmp_count(const void *a, const void *b)
+{
+	const struct count *x = a, *y = b;
+
+	return x->n > y->n ? -1 : x->n < y->n ? 1 : cmp_u64(&x->key, &y->key);
+}
+
+/*
+ * Sort keys and print the top most frequent ones.
+ */
+static void
+top(const char *title, const char *fmt, uint64_t *keys, size_t n, size_t ntop)
+{
+	struct count *counts;
+	size_t ncounts = 0;
+
+	if (n == 0)
+		return;
+
+	qsort(keys, n, sizeof(keys[0]), cmp_u64);
+	if ((counts = calloc(n, sizeof(counts[0]))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		if (i == 0 || keys[i] != keys[i - 1])
+			counts[ncounts++].key = keys[i];
+		counts[ncounts - 1].n++;
+	}
+	qsort(counts, ncounts, sizeof(counts[0]), cmp_count);
+
+	printf("\n%s (%zu distinct):\n", title, ncounts);
+	for (size_t i = 0; i < ncounts && i < ntop; i++) {
+		printf("  %10llu  %5.1f%%  ", (unsigned long long) counts[i].n,
+		    100.0 * counts[i].n / n);
+		printf(fmt, (unsigned long long) counts[i].key);
+		printf("\n");
+	}
+
+	free(counts);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct faulttracehdr *hdr;
+	const char *base;
+	struct stat st;
+	size_t n, ntop = 10, results[3] = { 0 };
+	uint64_t *keys, first = UINT64_MAX, last = 0;
+	int fd, ch;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			ntop = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+
+	if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) != 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if ((size_t) st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "%s: %s: truncated trace\n", argv[0], argv[optind]);
+		return 1;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	hdr = (const void *) base;
+	if (hdr->th_magic != FAULT_TRACE_MAGIC ||
+	    hdr->th_version != FAULT_TRACE_VERSION ||
+	    hdr->th_evsize < sizeof(struct faultevent)) {
+		fprintf(stderr, "%s: %s: not a fault trace\n", argv[0], argv[optind]);
+		return 1;
+	}
+
+	n = (st.st_size - sizeof(*hdr)) / hdr->th_evsize;
+	if ((keys = calloc(n + 1, sizeof(keys[0]))) == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+#define EVENT(i)	((const struct faultevent *) \
+	(base + sizeof(*hdr) + (i) * hdr->th_evsize))
+
+	for (size_t i = 0; i < n; i++) {
+		const struct faultevent *ev = EVENT(i);
+
+		if (ev->fe_result < nitems(results))
+			results[ev->fe_result]++;
+		if (ev->fe_time < first)
+			first = ev->fe_time;
+		if (ev->fe_time > last)
+			last = ev->fe_time;
+	}
+
+	printf("%zu faults, %llu dropped", n,
+	    (unsigned long long) hdr->th_dropped);
+	if (n > 1)
+		printf(", over %.3f s (%.0f faults/s)",
+		    (last - first) / 1e9, n * 1e9 / (last - first + 1));
+	printf("\n%zu retried, %zu declined, %zu escaped\n",
+	    results[FAULT_TRACE_RETRY], results[FAULT_TRACE_DECLINED],
+	    results[FAULT_TRACE_ESCAPED]);
+
+	for (size_t i = 0; i < n; i++)
+		keys[i] = EVENT(i)->fe_pc;
+	top("Hot PCs", "pc %#llx", keys, n, ntop);
+
+	for (size_t i = 0; i < n; i++)
+		keys[i] = EVENT(i)->fe_addr / hdr->th_pagesize * hdr->th_pagesize;
+	top("Hot pages", "page %#llx", keys, n, ntop);
+
+	for (size_t i = 0; i < n; i++)
+		keys[i] = EVENT(i)->fe_tid;
+	top("Threads", "tid %llu", keys, n, ntop);
+
+	/* events come out in per-thread order; sort to get global order */
+	if (n > 1) {
+		for (size_t i = 0; i < n; i++)
+			keys[i] = EVENT(i)->fe_time;
+		qsort(keys, n, sizeof(keys[0]), cmp_u64);
+		for (size_t i = 0; i < n - 1; i++)
+			keys[i] = keys[i + 1] - keys[i];
+		qsort(keys, n - 1, sizeof(keys[0]), cmp_u64);
+
+		printf("\nInter-fault interval (ns):\n"
+		    "  min %llu, p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+		    (unsigned long long) keys[0],
+		    (unsigned long long) keys[(n - 1) / 2],
+		    (unsigned long long) keys[(n - 1) * 9 / 10],
+		    (unsigned long long) keys[(n - 1) * 99 / 100],
+		    (unsigned long long) keys[n - 2]);
+	}
+
+	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-n top] trace\n", argv[0]);
+	return 1;
+}
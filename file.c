@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Mapped file reader.  The file is mapped once and every access goes
+ * through a probe, so a page that cannot be read (the file was truncated
+ * under us, or the read failed) makes the probe fail instead of killing
+ * the process.  The region handler only notes where the fault was, and
+ * declines it so that the probe's fixup applies.  The copy runs forward,
+ * so everything before the faulting page has arrived and the call can
+ * return a short count, the way read does.
+ */
+
+#include "fault.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FILE_WINDOW	(1024 * 1024)
+
+struct faultfile {
+	int			 ff_fd,
+				 ff_flags;
+	char			*ff_base;
+	size_t			 ff_size,
+				 ff_len,
+				 ff_window,
+				 ff_pagesz;
+	atomic_size_t		 ff_ahead;	/* readahead issued up to here */
+};
+
+static _Thread_local char *
+filefault __attribute__ ((tls_model ("initial-exec"))) = NULL;
+
+static int
+file_fault(int flt, const struct faultinfo *fi, void *arg)
+{
+	filefault = fi->fi_addr;
+
+	return 0;
+}
+
+/*
+ * Map the whole of fd as it is now, for reading.  With a window, reads
+ * that run past the readahead issued so far have the kernel start on
+ * the next window; FAULT_FILE_RANDOM turns readahead off.
+ */
+struct faultfile *
+fault_file_open(int fd, int flags, size_t window)
+{
+	struct faultfile *ff;
+	struct stat st;
+
+	if ((flags & ~FAULT_FILE_RANDOM) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (fault_probe_init() != 0 || fstat(fd, &st) != 0)
+		return NULL;
+
+	if ((ff = calloc(1, sizeof(*ff))) == NULL)
+		return NULL;
+
+	ff->ff_fd = fd;
+	ff->ff_flags = flags;
+	ff->ff_pagesz = sysconf(_SC_PAGESIZE);
+	ff->ff_size = st.st_size;
+	ff->ff_len = (ff->ff_size + ff->ff_pagesz - 1) & ~(ff->ff_pagesz - 1);
+	ff->ff_window = flags & FAULT_FILE_RANDOM ? 0 :
+	    window != 0 ? window : FILE_WINDOW;
+
+	if (ff->ff_len == 0)
+		return ff;
+
+	ff->ff_base = mmap(NULL, ff->ff_len, PROT_READ, MAP_SHARED, fd, 0);
+	if (ff->ff_base == MAP_FAILED)
+		goto fail;
+
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = ff->ff_base,
+		.fr_len = ff->ff_len,
+		.fr_act = { .fa_fun = file_fault, .fa_arg = ff }
+	    }) != 0) {
+		munmap(ff->ff_base, ff->ff_len);
+		goto fail;
+	}
+
+	if (flags & FAULT_FILE_RANDOM)
+		madvise(ff->ff_base, ff->ff_len, MADV_RANDOM);
+
+	return ff;
+
+fail:
+	free(ff);
+	return NULL;
+}
+
+/*
+ * Clip [off, off + *len) to the mapping; 0 if there is nothing there.
+ */
+static int
+file_clip(const struct faultfile *ff, off_t off, size_t *len)
+{
+	if (off < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((uintmax_t) off >= ff->ff_size) {
+		*len = 0;
+		return 0;
+	}
+	if (*len > ff->ff_size - off)
+		*len = ff->ff_size - off;
+
+	return 0;
+}
+
+static void
+file_readahead(struct faultfile *ff, size_t end)
+{
+	size_t ahead = atomic_load_explicit(&ff->ff_ahead,
+	    memory_order_relaxed), start, len;
+
+	/* start on the next window when halfway through the last */
+	if (ff->ff_window == 0 || end + ff->ff_window / 2 < ahead)
+		return;
+
+	start = (end > ahead ? end : ahead) & ~(ff->ff_pagesz - 1);
+	if (start >= ff->ff_len)
+		return;
+	len = ff->ff_len - start < ff->ff_window ?
+	    ff->ff_len - start : ff->ff_window;
+
+	atomic_store_explicit(&ff->ff_ahead, start + len,
+	    memory_order_relaxed);
+	madvise(ff->ff_base + start, len, MADV_WILLNEED);
+}
+
+/*
+ * An access to [off, off + len) faulted at filefault: work out how much
+ * of it there was.  Anything past the end of the file now was truncated
+ * away and reads as end of file; anything else is an I/O error.
+ */
+static ssize_t
+file_short(const struct faultfile *ff, off_t off, size_t len)
+{
+	char *addr = filefault;
+	uintmax_t end;
+	struct stat st;
+
+	if (addr < ff->ff_base + off || addr >= ff->ff_base + off + len) {
+		/* not the file: the caller's buffer */
+		errno = EFAULT;
+		return -1;
+	}
+
+	end = (uintptr_t) addr & ~(ff->ff_pagesz - 1);
+	end -= (uintptr_t) ff->ff_base;
+	if (fstat(ff->ff_fd, &st) == 0 && (uintmax_t) st.st_size <= end)
+		end = st.st_size;
+	else if (end <= (uintmax_t) off) {
+		errno = EIO;
+		return -1;
+	}
+
+	return end > (uintmax_t) off ? end - off : 0;
+}
+
+/*
+ * Like pread: copy up to len bytes at off into buf.  A short count means
+ * the file ends (or, if the next call fails with EIO, cannot be read)
+ * there.
+ */
+ssize_t
+fault_file_read(struct faultfile *ff, void *buf, size_t len, off_t off)
+{
+	if (file_clip(ff, off, &len) != 0)
+		return -1;
+	if (len == 0)
+		return 0;
+
+	file_readahead(ff, off + len);
+
+	filefault = NULL;
+	if (fault_copy(buf, ff->ff_base + off, len) == 0)
+		return len;
+
+	/* fault_copy runs forward: what comes before the page is in buf */
+	return file_short(ff, off, len);
+}
+
+/*
+ * Write up to len bytes at off to fd straight from the mapping, with no
+ * copy in between; otherwise like write.  The kernel stops at the page
+ * that faults, so after a truncation the count may take in the zeros up
+ * to the end of the page holding the new end of file.
+ */
+ssize_t
+fault_file_send(struct faultfile *ff, int fd, size_t len, off_t off)
+{
+	ssize_t n;
+
+	if (file_clip(ff, off, &len) != 0)
+		return -1;
+	if (len == 0)
+		return 0;
+
+	file_readahead(ff, off + len);
+
+	/* the kernel reads the mapping itself and reports EFAULT */
+	if ((n = write(fd, ff->ff_base + off, len)) >= 0 || errno != EFAULT)
+		return n;
+
+	/* find the bad page with a probe and send what comes before */
+	filefault = NULL;
+	if (fault_probe_read(ff->ff_base + off, len) == 0) {
+		errno = EIO;
+		return -1;
+	}
+	if ((n = file_short(ff, off, len)) > 0)
+		n = write(fd, ff->ff_base + off, n);
+
+	return n;
+}
+
+/*
+ * How many bytes at off can be read right now, up to len, touching each
+ * page; -1 with EIO if not even the first page can.  Afterwards they can
+ * be used in place through fault_file_data, as long as the file is not
+ * truncated in the meantime.
+ */
+ssize_t
+fault_file_check(struct faultfile *ff, off_t off, size_t len)
+{
+	if (file_clip(ff, off, &len) != 0)
+		return -1;
+	if (len == 0)
+		return 0;
+
+	file_readahead(ff, off + len);
+
+	filefault = NULL;
+	if (fault_probe_read(ff->ff_base + off, len) == 0)
+		return len;
+
+	return file_short(ff, off, len);
+}
+
+const void *
+fault_file_data(const struct faultfile *ff)
+{
+	return ff->ff_base;
+}
+
+/*
+ * The size of the file when it was opened.
+ */
+size_t
+fault_file_size(const struct faultfile *ff)
+{
+	return ff->ff_size;
+}
+
+/*
+ * Unmap; the descriptor stays open.
+ */
+void
+fault_file_close(struct faultfile *ff)
+{
+	if (ff->ff_len != 0) {
+		fault_unregister(ff->ff_base);
+		munmap(ff->ff_base, ff->ff_len);
+	}
+	free(ff);
+}
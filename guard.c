@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Sampling guarded allocator.  One in every so many allocations (picked
+ * at random, per thread) is placed on a page of its own in a reserved
+ * pool, alternating between the start and the end of the page, with
+ * PROT_NONE guard pages between the slots.  Freed slots are made
+ * PROT_NONE too and go to the back of the queue, so they are reused as
+ * late as possible.  A fault anywhere in the pool is a memory error; the
+ * handler works out which one, reports it together with the allocation
+ * and free stack traces, and declines the fault.
+ *
+ *	| guard | slot 0 | guard | slot 1 | guard | ... | slot n-1 | guard |
+ */
+
+#include "fault.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <unwind.h>
+
+#include <sys/mman.h>
+
+#define GUARD_ALIGN	16
+
+#define SLOT_UNUSED	0
+#define SLOT_ALLOCATED	1
+#define SLOT_FREED	2
+
+struct guardslot {
+	char			*gs_ptr;
+	size_t			 gs_size;
+	int			 gs_state;
+	struct faultguardtrace	 gs_alloc,
+				 gs_free;
+};
+
+struct faultguard {
+	char			*gu_base;
+	size_t			 gu_len,
+				 gu_nslots,
+				 gu_pagesz;
+	unsigned int		 gu_rate;
+	struct guardslot	*gu_slots;
+	void			(*gu_report)(const struct faultguardreport *,
+				    void *);
+	void			*gu_arg;
+	pthread_mutex_t		 gu_lock;
+	size_t			*gu_queue,	/* free slots, oldest first */
+				 gu_head,
+				 gu_count;
+	unsigned int		 gu_flip;
+};
+
+/* allocations left until the next sample; -1 until the first one */
+static _Thread_local long
+guardcount __attribute__ ((tls_model ("initial-exec"))) = -1;
+
+static _Thread_local uint64_t
+guardrand __attribute__ ((tls_model ("initial-exec"))) = 0;
+
+struct unwindarg {
+	struct faultguardtrace	*ua_trace;
+	int			 ua_skip;
+};
+
+static _Unwind_Reason_Code
+guard_frame(struct _Unwind_Context *ctx, void *arg)
+{
+	struct unwindarg *ua = arg;
+	struct faultguardtrace *gt = ua->ua_trace;
+
+	if (ua->ua_skip > 0) {
+		ua->ua_skip--;
+		return _URC_NO_REASON;
+	}
+	if (gt->gt_nframes == FAULT_GUARD_FRAMES)
+		return _URC_END_OF_STACK;
+	gt->gt_frames[gt->gt_nframes++] = (void *) _Unwind_GetIP(ctx);
+
+	return _URC_NO_REASON;
+}
+
+static void
+guard_trace(struct faultguardtrace *gt)
+{
+	/* leave out ourselves and the fault_guard_* entry point */
+	struct unwindarg ua = { gt, 2 };
+
+	gt->gt_nframes = 0;
+	_Unwind_Backtrace(guard_frame, &ua);
+}
+
+/*
+ * Everything from here to guard_fault may run in the fault handler.
+ */
+static void
+put(const char *s)
+{
+	ssize_t n;
+
+	for (size_t len = strlen(s); len > 0; s += n, len -= n)
+		if ((n = write(STDERR_FILENO, s, len)) <= 0)
+			return;
+}
+
+static void
+putnum(uintptr_t v, int hex)
+{
+	char buf[32], *p = buf + sizeof(buf);
+
+	*--p = '\0';
+	do {
+		*--p = "0123456789abcdef"[v % (hex ? 16 : 10)];
+		v /= hex ? 16 : 10;
+	} while (v != 0);
+	if (hex) {
+		*--p = 'x';
+		*--p = '0';
+	}
+	put(p);
+}
+
+static void
+puttrace(const char *title, const struct faultguardtrace *gt)
+{
+	if (gt->gt_nframes == 0)
+		return;
+
+	put(title);
+	for (int i = 0; i < gt->gt_nframes; i++) {
+		put("  #");
+		putnum(i, 0);
+		put(" ");
+		putnum((uintptr_t) gt->gt_frames[i], 1);
+		put("\n");
+	}
+}
+
+static void
+guard_print(const struct faultguardreport *gr, void *arg)
+{
+	static const char *const kinds[] = {
+		[FAULT_GUARD_UNKNOWN] = "unknown error",
+		[FAULT_GUARD_OVERFLOW] = "heap buffer overflow",
+		[FAULT_GUARD_UNDERFLOW] = "heap buffer underflow",
+		[FAULT_GUARD_USE_AFTER_FREE] = "use after free",
+		[FAULT_GUARD_DOUBLE_FREE] = "double free",
+		[FAULT_GUARD_INVALID_FREE] = "invalid free"
+	};
+
+	put("fault_guard: ");
+	put(kinds[gr->gr_kind]);
+	put(" at ");
+	putnum((uintptr_t) gr->gr_addr, 1);
+	if (gr->gr_ptr != NULL) {
+		put(", ");
+		putnum(gr->gr_size, 0);
+		put("-byte allocation at ");
+		putnum((uintptr_t) gr->gr_ptr, 1);
+	}
+	put("\n");
+	puttrace("allocated at:\n", &gr->gr_alloc);
+	puttrace("freed at:\n", &gr->gr_free);
+}
+
+static void
+guard_report(struct faultguard *gu, int kind, const void *addr,
+    const struct guardslot *gs)
+{
+	struct faultguardreport gr = {
+		.gr_kind = kind,
+		.gr_addr = (void *) addr
+	};
+
+	if (gs != NULL && gs->gs_state != SLOT_UNUSED) {
+		gr.gr_ptr = gs->gs_ptr;
+		gr.gr_size = gs->gs_size;
+		gr.gr_alloc = gs->gs_alloc;
+		if (gs->gs_state == SLOT_FREED)
+			gr.gr_free = gs->gs_free;
+	}
+
+	gu->gu_report(&gr, gu->gu_arg);
+}
+
+static int
+guard_fault(int flt, const struct faultinfo *fi, void *arg)
+{
+	struct faultguard *gu = arg;
+	const char *addr = fi->fi_addr;
+	size_t page = (addr - gu->gu_base) / gu->gu_pagesz;
+	const struct guardslot *gs = NULL, *left, *right;
+
+	if (page % 2 == 1) {
+		gs = &gu->gu_slots[page / 2];
+		guard_report(gu, gs->gs_state == SLOT_FREED ?
+		    FAULT_GUARD_USE_AFTER_FREE : FAULT_GUARD_UNKNOWN, addr, gs);
+		return 0;
+	}
+
+	/* a guard page: blame whichever neighbour comes closest */
+	left = page > 0 ? &gu->gu_slots[page / 2 - 1] : NULL;
+	right = page / 2 < gu->gu_nslots ? &gu->gu_slots[page / 2] : NULL;
+	if (left != NULL && left->gs_state == SLOT_UNUSED)
+		left = NULL;
+	if (right != NULL && right->gs_state == SLOT_UNUSED)
+		right = NULL;
+
+	if (left != NULL && (right == NULL ||
+	    (uintptr_t) addr - (uintptr_t) (left->gs_ptr + left->gs_size) <
+	    (uintptr_t) right->gs_ptr - (uintptr_t) addr))
+		gs = left;
+	else
+		gs = right;
+
+	guard_report(gu, gs == NULL ? FAULT_GUARD_UNKNOWN :
+	    gs->gs_state == SLOT_FREED ? FAULT_GUARD_USE_AFTER_FREE :
+	    gs == left ? FAULT_GUARD_OVERFLOW : FAULT_GUARD_UNDERFLOW, addr, gs);
+
+	return 0;
+}
+
+/*
+ * Set up a pool of nslots guarded slots, sampling one in about rate
+ * allocations (FAULT_GUARD_RATE if zero).  report is called from the
+ * fault handler, and before aborting on a bad free; by default errors go
+ * to standard error.
+ */
+struct faultguard *
+fault_guard_create(size_t nslots, unsigned int rate,
+    void (*report)(const struct faultguardreport *, void *), void *arg)
+{
+	struct faultguard *gu;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	if (nslots == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((gu = calloc(1, sizeof(*gu))) == NULL)
+		return NULL;
+
+	gu->gu_nslots = nslots;
+	gu->gu_pagesz = page_size;
+	gu->gu_len = (2 * nslots + 1) * page_size;
+	gu->gu_rate = rate != 0 ? rate : FAULT_GUARD_RATE;
+	gu->gu_report = report != NULL ? report : guard_print;
+	gu->gu_arg = arg;
+	gu->gu_base = MAP_FAILED;
+	pthread_mutex_init(&gu->gu_lock, NULL);
+
+	if ((gu->gu_slots = calloc(nslots, sizeof(gu->gu_slots[0]))) == NULL ||
+	    (gu->gu_queue = calloc(nslots, sizeof(gu->gu_queue[0]))) == NULL)
+		goto fail;
+	for (size_t i = 0; i < nslots; i++)
+		gu->gu_queue[i] = i;
+	gu->gu_count = nslots;
+
+	gu->gu_base = mmap(NULL, gu->gu_len, PROT_NONE,
+	    MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	if (gu->gu_base == MAP_FAILED)
+		goto fail;
+
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = gu->gu_base,
+		.fr_len = gu->gu_len,
+		.fr_act = { .fa_fun = guard_fault, .fa_arg = gu }
+	    }) != 0)
+		goto fail;
+
+	return gu;
+
+fail:
+	if (gu->gu_base != MAP_FAILED)
+		munmap(gu->gu_base, gu->gu_len);
+	free(gu->gu_queue);
+	free(gu->gu_slots);
+	free(gu);
+	return NULL;
+}
+
+/*
+ * Next gap between samples, uniform in [1, 2 * rate).
+ */
+static long
+guard_next(unsigned int rate)
+{
+	if (guardrand == 0)
+		guardrand = (uintptr_t) &guardrand ^ 0x9e3779b97f4a7c15ULL;
+	guardrand ^= guardrand << 13;
+	guardrand ^= guardrand >> 7;
+	guardrand ^= guardrand << 17;
+
+	return 1 + guardrand % (2 * (uint64_t) rate - 1);
+}
+
+static void *
+guard_alloc(struct faultguard *gu, size_t size)
+{
+	struct guardslot *gs;
+	size_t slot;
+	char *page;
+
+	pthread_mutex_lock(&gu->gu_lock);
+	if (gu->gu_count == 0) {
+		pthread_mutex_unlock(&gu->gu_lock);
+		return NULL;
+	}
+	slot = gu->gu_queue[gu->gu_head];
+	gu->gu_head = (gu->gu_head + 1) % gu->gu_nslots;
+	gu->gu_count--;
+
+	gs = &gu->gu_slots[slot];
+	page = gu->gu_base + (2 * slot + 1) * gu->gu_pagesz;
+	if (mprotect(page, gu->gu_pagesz, PROT_READ | PROT_WRITE) != 0) {
+		gu->gu_head = (gu->gu_head + gu->gu_nslots - 1) %
+		    gu->gu_nslots;
+		gu->gu_count++;
+		pthread_mutex_unlock(&gu->gu_lock);
+		return NULL;
+	}
+
+	gs->gs_size = size;
+	if (gu->gu_flip++ % 2 == 0)
+		gs->gs_ptr = page;
+	else
+		gs->gs_ptr = page + ((gu->gu_pagesz - size) & -GUARD_ALIGN);
+	gs->gs_state = SLOT_ALLOCATED;
+	pthread_mutex_unlock(&gu->gu_lock);
+
+	guard_trace(&gs->gs_alloc);
+	gs->gs_free.gt_nframes = 0;
+
+	return gs->gs_ptr;
+}
+
+/*
+ * Returns a guarded allocation if this one is sampled, NULL otherwise (or
+ * if the pool is full); the caller then allocates as usual.
+ */
+void *
+fault_guard_malloc(struct faultguard *gu, size_t size)
+{
+	if (__builtin_expect(--guardcount > 0, 1))
+		return NULL;
+	/* a thread's first allocation starts its countdown like any other */
+	if (guardcount < 0 && (guardcount = guard_next(gu->gu_rate) - 1) > 0)
+		return NULL;
+
+	guardcount = guard_next(gu->gu_rate);
+	if (size > gu->gu_pagesz)
+		return NULL;
+
+	return guard_alloc(gu, size != 0 ? size : 1);
+}
+
+/*
+ * Free ptr if it came from the pool and return 0; return -1 if it did
+ * not.  Bad frees of pool memory are reported and abort.
+ */
+int
+fault_guard_free(struct faultguard *gu, void *ptr)
+{
+	size_t page = ((char *) ptr - gu->gu_base) / gu->gu_pagesz;
+	struct guardslot *gs;
+
+	if ((uintptr_t) ptr - (uintptr_t) gu->gu_base >= gu->gu_len)
+		return -1;
+
+	gs = page % 2 == 1 ? &gu->gu_slots[page / 2] : NULL;
+
+	/* under the lock, so only one of two racing frees gets through */
+	pthread_mutex_lock(&gu->gu_lock);
+	if (gs == NULL || gs->gs_state != SLOT_ALLOCATED ||
+	    (char *) ptr != gs->gs_ptr) {
+		int kind = gs != NULL && gs->gs_state == SLOT_FREED &&
+		    (char *) ptr == gs->gs_ptr ? FAULT_GUARD_DOUBLE_FREE :
+		    FAULT_GUARD_INVALID_FREE;
+
+		pthread_mutex_unlock(&gu->gu_lock);
+		guard_report(gu, kind, ptr, gs);
+		abort();
+	}
+
+	guard_trace(&gs->gs_free);
+	mprotect(gs->gs_ptr - ((uintptr_t) gs->gs_ptr & (gu->gu_pagesz - 1)),
+	    gu->gu_pagesz, PROT_NONE);
+	gs->gs_state = SLOT_FREED;
+	gu->gu_queue[(gu->gu_head + gu->gu_count) % gu->gu_nslots] =
+	    gs - gu->gu_slots;
+	gu->gu_count++;
+	pthread_mutex_unlock(&gu->gu_lock);
+
+	return 0;
+}
+
+/*
+ * Nothing may still be using the pool.
+ */
+void
+fault_guard_destroy(struct faultguard *gu)
+{
+	fault_unregister(gu->gu_base);
+	munmap(gu->gu_base, gu->gu_len);
+	pthread_mutex_destroy(&gu->gu_lock);
+	free(gu->gu_queue);
+	free(gu->gu_slots);
+	free(gu);
+}
@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * NUMA placement.  The range starts out PROT_NONE with a local memory
+ * policy, so the first access to a page faults and the page is allocated
+ * on the node of the thread that retries it.  With FAULT_NUMA_MIGRATE,
+ * each scan protects a random sample of resident pages; the handler
+ * notes which node the next access to each comes from, and a page that
+ * is accessed from the same other node in two samples running is moved
+ * there by the scan after.
+ *
+ *	UNTOUCHED -> BUSY -> RESIDENT -> SAMPLED -> BUSY -> RESIDENT ...
+ *
+ * On a machine with a single node (or without NUMA support) the range is
+ * plain anonymous memory and nothing ever faults.
+ */
+
+#include "fault.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#if defined(__linux__)
+# include <sys/syscall.h>
+
+# define MPOL_LOCAL	4
+# define MPOL_MF_MOVE	(1 << 1)
+#endif
+
+#define NUMA_UNTOUCHED	0
+#define NUMA_BUSY	1
+#define NUMA_RESIDENT	2
+#define NUMA_SAMPLED	3
+
+/* samples in a row from the same node before a page moves */
+#define NUMA_STREAK	2
+
+#define NUMA_NONODE	0xff
+
+struct numapage {
+	atomic_uint		 np_state;
+	uint8_t			 np_voter,	/* this sample */
+				 np_prev,	/* the ones before */
+				 np_streak;
+};
+
+struct faultnuma {
+	char			*nm_base;
+	size_t			 nm_len,
+				 nm_npages,
+				 nm_pagesz;
+	int			 nm_flags,
+				 nm_nodes;
+	struct numapage		*nm_pages;
+	pthread_mutex_t		 nm_lock;
+	uint64_t		 nm_rand;
+	atomic_uint_least64_t	 nm_placed,
+				 nm_sampled,
+				 nm_migrated;
+};
+
+/*
+ * One more than the highest online node, or 1 when the kernel cannot
+ * tell.  Nodes that are possible but not online hold no memory.
+ */
+static int
+numa_nodes(void)
+{
+#if defined(__linux__)
+	FILE *fp;
+	int c, n = 0, max = 0;
+
+	if ((fp = fopen("/sys/devices/system/node/online", "r")) == NULL)
+		return 1;
+	while ((c = getc(fp)) != EOF) {
+		if (c >= '0' && c <= '9') {
+			n = n * 10 + c - '0';
+			if (n > max)
+				max = n;
+		} else {
+			n = 0;
+		}
+	}
+	fclose(fp);
+
+	return max + 1;
+#else
+	return 1;
+#endif
+}
+
+static int
+numa_node(void)
+{
+#if defined(__linux__)
+	unsigned int cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < NUMA_NONODE)
+		return node;
+#endif
+	return NUMA_NONODE;
+}
+
+static int
+numa_fault(int flt, const struct faultinfo *fi, void *arg)
+{
+	struct faultnuma *nm = arg;
+	size_t page = ((char *) fi->fi_addr - nm->nm_base) / nm->nm_pagesz;
+	struct numapage *np = &nm->nm_pages[page];
+	unsigned int st = atomic_load(&np->np_state);
+
+	while (st == NUMA_UNTOUCHED || st == NUMA_SAMPLED) {
+		if (!atomic_compare_exchange_weak(&np->np_state, &st,
+		    NUMA_BUSY))
+			continue;
+		if (st == NUMA_SAMPLED) {
+			np->np_voter = numa_node();
+			atomic_fetch_add(&nm->nm_sampled, 1);
+		} else {
+			atomic_fetch_add(&nm->nm_placed, 1);
+		}
+		if (mprotect(nm->nm_base + page * nm->nm_pagesz,
+		    nm->nm_pagesz, PROT_READ | PROT_WRITE) != 0) {
+			atomic_store(&np->np_state, st);
+			return 0;
+		}
+		atomic_store(&np->np_state, NUMA_RESIDENT);
+		return 1;
+	}
+
+	/* somebody else is letting it in */
+	while (atomic_load(&np->np_state) == NUMA_BUSY)
+		sched_yield();
+
+	return 1;
+}
+
+/*
+ * A range of len bytes whose pages are placed on the node of the thread
+ * that touches them first; flags may ask for FAULT_NUMA_MIGRATE.
+ */
+struct faultnuma *
+fault_numa_create(size_t len, int flags)
+{
+	struct faultnuma *nm;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	if (len == 0 || (flags & ~FAULT_NUMA_MIGRATE) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((nm = calloc(1, sizeof(*nm))) == NULL)
+		return NULL;
+
+	nm->nm_pagesz = page_size;
+	nm->nm_npages = (len + page_size - 1) / page_size;
+	nm->nm_len = nm->nm_npages * page_size;
+	nm->nm_flags = flags;
+	nm->nm_nodes = numa_nodes();
+	nm->nm_rand = (uintptr_t) nm ^ 0x9e3779b97f4a7c15ULL;
+	pthread_mutex_init(&nm->nm_lock, NULL);
+
+	if (nm->nm_nodes <= 1) {
+		nm->nm_base = mmap(NULL, nm->nm_len, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (nm->nm_base == MAP_FAILED)
+			goto fail;
+		return nm;
+	}
+
+	if ((nm->nm_pages = calloc(nm->nm_npages,
+	    sizeof(nm->nm_pages[0]))) == NULL)
+		goto fail;
+	for (size_t i = 0; i < nm->nm_npages; i++)
+		nm->nm_pages[i].np_voter = nm->nm_pages[i].np_prev =
+		    NUMA_NONODE;
+
+	nm->nm_base = mmap(NULL, nm->nm_len, PROT_NONE,
+	    MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	if (nm->nm_base == MAP_FAILED)
+		goto fail;
+
+#if defined(__linux__)
+	/* whatever the process policy says; old kernels have local anyway */
+	syscall(SYS_mbind, nm->nm_base, nm->nm_len, MPOL_LOCAL, NULL, 0, 0);
+#endif
+
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = nm->nm_base,
+		.fr_len = nm->nm_len,
+		.fr_act = { .fa_fun = numa_fault, .fa_arg = nm }
+	    }) != 0) {
+		munmap(nm->nm_base, nm->nm_len);
+		goto fail;
+	}
+
+	return nm;
+
+fail:
+	pthread_mutex_destroy(&nm->nm_lock);
+	free(nm->nm_pages);
+	free(nm);
+	return NULL;
+}
+
+void *
+fault_numa_base(const struct faultnuma *nm)
+{
+	return nm->nm_base;
+}
+
+/*
+ * Move the pages voted away from where they are, in one go.
+ */
+static ssize_t
+numa_migrate(struct faultnuma *nm)
+{
+#if defined(__linux__)
+	size_t n = 0, moved = 0;
+	void **addrs;
+	int *nodes, *status;
+
+	addrs = calloc(nm->nm_npages, sizeof(addrs[0]));
+	nodes = calloc(nm->nm_npages, sizeof(nodes[0]));
+	status = calloc(nm->nm_npages, sizeof(status[0]));
+	if (addrs == NULL || nodes == NULL || status == NULL) {
+		free(addrs);
+		free(nodes);
+		free(status);
+		return -1;
+	}
+
+	for (size_t page = 0; page < nm->nm_npages; page++) {
+		struct numapage *np = &nm->nm_pages[page];
+
+		if (atomic_load(&np->np_state) != NUMA_RESIDENT ||
+		    np->np_voter == NUMA_NONODE)
+			continue;
+		if (np->np_voter == np->np_prev)
+			np->np_streak++;
+		else
+			np->np_streak = 1;
+		np->np_prev = np->np_voter;
+		np->np_voter = NUMA_NONODE;
+
+		if (np->np_streak >= NUMA_STREAK) {
+			addrs[n] = nm->nm_base + page * nm->nm_pagesz;
+			nodes[n++] = np->np_prev;
+		}
+	}
+
+	/* where are they now; leave the ones already in place alone */
+	if (n > 0 && syscall(SYS_move_pages, 0, n, addrs, NULL, status,
+	    0) == 0) {
+		size_t m = 0;
+
+		for (size_t i = 0; i < n; i++) {
+			if (status[i] >= 0 && status[i] != nodes[i]) {
+				addrs[m] = addrs[i];
+				nodes[m++] = nodes[i];
+			}
+		}
+		if (m > 0 && syscall(SYS_move_pages, 0, m, addrs, nodes,
+		    status, MPOL_MF_MOVE) >= 0) {
+			for (size_t i = 0; i < m; i++)
+				if (status[i] == nodes[i])
+					moved++;
+		}
+	}
+
+	free(addrs);
+	free(nodes);
+	free(status);
+	atomic_fetch_add(&nm->nm_migrated, moved);
+
+	return moved;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * One round of FAULT_NUMA_MIGRATE: move the pages the last samples
+ * agreed on, then protect a fresh sample of up to nsample resident
+ * pages.  Returns the number of pages moved.
+ */
+ssize_t
+fault_numa_scan(struct faultnuma *nm, size_t nsample)
+{
+	ssize_t moved;
+
+	if (!(nm->nm_flags & FAULT_NUMA_MIGRATE)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (nm->nm_nodes <= 1)
+		return 0;
+
+	pthread_mutex_lock(&nm->nm_lock);
+
+	if ((moved = numa_migrate(nm)) < 0) {
+		pthread_mutex_unlock(&nm->nm_lock);
+		return -1;
+	}
+
+	for (size_t i = 0; i < nsample; i++) {
+		struct numapage *np;
+		unsigned int st = NUMA_RESIDENT;
+		size_t page;
+
+		nm->nm_rand ^= nm->nm_rand << 13;
+		nm->nm_rand ^= nm->nm_rand >> 7;
+		nm->nm_rand ^= nm->nm_rand << 17;
+		page = nm->nm_rand % nm->nm_npages;
+		np = &nm->nm_pages[page];
+
+		if (!atomic_compare_exchange_strong(&np->np_state, &st,
+		    NUMA_SAMPLED))
+			continue;
+		if (mprotect(nm->nm_base + page * nm->nm_pagesz,
+		    nm->nm_pagesz, PROT_NONE) != 0)
+			atomic_store(&np->np_state, NUMA_RESIDENT);
+	}
+
+	pthread_mutex_unlock(&nm->nm_lock);
+
+	return moved;
+}
+
+int
+fault_numa_stats(const struct faultnuma *nm, struct faultnumastats *ns)
+{
+	*ns = (struct faultnumastats) {
+		.ns_nodes = nm->nm_nodes,
+		.ns_placed = atomic_load(&nm->nm_placed),
+		.ns_sampled = atomic_load(&nm->nm_sampled),
+		.ns_migrated = atomic_load(&nm->nm_migrated)
+	};
+
+	return 0;
+}
+
+void
+fault_numa_destroy(struct faultnuma *nm)
+{
+	if (nm->nm_nodes > 1)
+		fault_unregister(nm->nm_base);
+	munmap(nm->nm_base, nm->nm_len);
+	pthread_mutex_destroy(&nm->nm_lock);
+	free(nm->nm_pages);
+	free(nm);
+}
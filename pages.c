@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Page-state tables.  Every page has two bits of state, the protection
+ * it should have, packed 32 pages to a word; changing it only sets the
+ * bits and marks the page dirty.  A flush takes the dirty pages a word at
+ * a time, drops those that are back where they were, and makes one
+ * mprotect call per run of pages going to the same state.  A run carries
+ * on over a short gap of pages that already have that state, since the
+ * kernel does not care whether a page changes.
+ *
+ * Wanted states and dirty bits are atomic, so setting them is safe from
+ * any thread and reading them is safe from a signal handler.  The states
+ * the pages actually have are only touched by flushes, under the lock.
+ * Setting a state before marking the page dirty, and taking the dirty
+ * bits before reading the states, means a flush never misses a change:
+ * at worst it leaves the page dirty for the next one.
+ */
+
+#include "fault.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define PAGES_PER_WORD	32
+#define PAGES_MASK	3
+
+/* longest stretch of unchanged pages a run goes on over */
+#define PAGES_GAP	16
+
+struct faultpages {
+	char			*pt_base;
+	size_t			 pt_len,
+				 pt_npages,
+				 pt_pagesz;
+	_Atomic uint64_t	*pt_want;
+	uint64_t		*pt_have;
+	atomic_uint_least64_t	*pt_dirty;	/* one bit per page */
+	pthread_mutex_t		 pt_lock;
+	atomic_uint_least64_t	 pt_queued,
+				 pt_flushes,
+				 pt_calls,
+				 pt_changed;
+};
+
+static const int
+pageprots[4] = {
+	PROT_NONE,
+	PROT_READ,
+	PROT_READ | PROT_WRITE,
+	PROT_READ | PROT_EXEC
+};
+
+static int
+pages_state(uint64_t word, size_t page)
+{
+	return word >> (page % PAGES_PER_WORD * 2) & PAGES_MASK;
+}
+
+static int
+pages_want(const struct faultpages *pt, size_t page)
+{
+	return pages_state(atomic_load(&pt->pt_want[page / PAGES_PER_WORD]),
+	    page);
+}
+
+static int
+pages_have(const struct faultpages *pt, size_t page)
+{
+	return pages_state(pt->pt_have[page / PAGES_PER_WORD], page);
+}
+
+static void
+pages_sethave(struct faultpages *pt, size_t page, int state)
+{
+	uint64_t *w = &pt->pt_have[page / PAGES_PER_WORD];
+	int shift = page % PAGES_PER_WORD * 2;
+
+	*w = (*w & ~((uint64_t) PAGES_MASK << shift)) |
+	    (uint64_t) state << shift;
+}
+
+/*
+ * A table for [addr, addr + len), whose pages all have the protection
+ * that goes with state right now.
+ */
+struct faultpages *
+fault_pages_create(void *addr, size_t len, int state)
+{
+	struct faultpages *pt;
+	size_t page_size = sysconf(_SC_PAGESIZE), nwords;
+	uint64_t fill = 0;
+
+	if ((uintptr_t) addr % page_size != 0 || len == 0 ||
+	    state < 0 || state > PAGES_MASK) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((pt = calloc(1, sizeof(*pt))) == NULL)
+		return NULL;
+
+	pt->pt_base = addr;
+	pt->pt_pagesz = page_size;
+	pt->pt_npages = (len + page_size - 1) / page_size;
+	pt->pt_len = pt->pt_npages * page_size;
+	pthread_mutex_init(&pt->pt_lock, NULL);
+
+	nwords = (pt->pt_npages + PAGES_PER_WORD - 1) / PAGES_PER_WORD;
+	if ((pt->pt_want = calloc(nwords, sizeof(pt->pt_want[0]))) == NULL ||
+	    (pt->pt_have = calloc(nwords, sizeof(pt->pt_have[0]))) == NULL ||
+	    (pt->pt_dirty = calloc((pt->pt_npages + 63) / 64,
+	    sizeof(pt->pt_dirty[0]))) == NULL) {
+		fault_pages_destroy(pt);
+		return NULL;
+	}
+
+	for (int i = 0; i < PAGES_PER_WORD; i++)
+		fill |= (uint64_t) state << (i * 2);
+	for (size_t i = 0; i < nwords; i++) {
+		atomic_init(&pt->pt_want[i], fill);
+		pt->pt_have[i] = fill;
+	}
+
+	return pt;
+}
+
+/*
+ * Queue a change of [addr, addr + len) to state; nothing happens to the
+ * pages until the next flush.
+ */
+int
+fault_pages_set(struct faultpages *pt, void *addr, size_t len, int state)
+{
+	size_t first, last;
+
+	if ((char *) addr < pt->pt_base || len == 0 ||
+	    (size_t) ((char *) addr - pt->pt_base) >= pt->pt_len ||
+	    len > pt->pt_len - ((char *) addr - pt->pt_base) ||
+	    state < 0 || state > PAGES_MASK) {
+		errno = EINVAL;
+		return -1;
+	}
+	first = ((char *) addr - pt->pt_base) / pt->pt_pagesz;
+	last = ((char *) addr - pt->pt_base + len - 1) / pt->pt_pagesz;
+
+	for (size_t page = first; page <= last; ) {
+		size_t w = page / PAGES_PER_WORD,
+		    end = (w + 1) * PAGES_PER_WORD < last + 1 ?
+		    (w + 1) * PAGES_PER_WORD : last + 1;
+		uint64_t mask = 0, bits = 0, old, new;
+
+		for (; page < end; page++) {
+			int shift = page % PAGES_PER_WORD * 2;
+
+			mask |= (uint64_t) PAGES_MASK << shift;
+			bits |= (uint64_t) state << shift;
+		}
+
+		old = atomic_load(&pt->pt_want[w]);
+		do
+			new = (old & ~mask) | bits;
+		while (!atomic_compare_exchange_weak(&pt->pt_want[w], &old,
+		    new));
+	}
+
+	for (size_t page = first; page <= last; ) {
+		size_t w = page / 64, n = 64 - page % 64;
+		uint64_t mask;
+
+		if (n > last + 1 - page)
+			n = last + 1 - page;
+		mask = (n == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << n) - 1) <<
+		    page % 64;
+		atomic_fetch_or(&pt->pt_dirty[w], mask);
+		page += n;
+	}
+
+	atomic_fetch_add_explicit(&pt->pt_queued, last + 1 - first,
+	    memory_order_relaxed);
+
+	return 0;
+}
+
+/*
+ * The state last set for the page holding addr, with FAULT_PAGES_PENDING
+ * if a flush has yet to apply it; -1 if addr is not in the table.  Safe
+ * in a fault handler.
+ */
+int
+fault_pages_get(const struct faultpages *pt, const void *addr)
+{
+	size_t page;
+
+	if ((const char *) addr < pt->pt_base ||
+	    (size_t) ((const char *) addr - pt->pt_base) >= pt->pt_len)
+		return -1;
+	page = ((const char *) addr - pt->pt_base) / pt->pt_pagesz;
+
+	return pages_want(pt, page) |
+	    (atomic_load(&pt->pt_dirty[page / 64]) >> page % 64 & 1 ?
+	    FAULT_PAGES_PENDING : 0);
+}
+
+/*
+ * Change [start, end) to state with one call.  Called with pt_lock held.
+ */
+static int
+pages_apply(struct faultpages *pt, size_t start, size_t end, int state)
+{
+	if (mprotect(pt->pt_base + start * pt->pt_pagesz,
+	    (end - start) * pt->pt_pagesz, pageprots[state]) != 0) {
+		/* leave them for the next flush */
+		for (size_t page = start; page < end; page++)
+			if (pages_have(pt, page) != state)
+				atomic_fetch_or(&pt->pt_dirty[page / 64],
+				    (uint64_t) 1 << page % 64);
+		return -1;
+	}
+
+	for (size_t page = start; page < end; page++) {
+		if (pages_have(pt, page) != state) {
+			pages_sethave(pt, page, state);
+			atomic_fetch_add_explicit(&pt->pt_changed, 1,
+			    memory_order_relaxed);
+		}
+	}
+	atomic_fetch_add_explicit(&pt->pt_calls, 1, memory_order_relaxed);
+
+	return 0;
+}
+
+/*
+ * Apply everything queued.  Returns the number of pages whose protection
+ * changed, or -1 if any mprotect call failed (the pages it covered stay
+ * queued).
+ */
+ssize_t
+fault_pages_flush(struct faultpages *pt)
+{
+	size_t start = 0, end = 0, changed = 0;
+	int state = -1, err = 0;
+
+	pthread_mutex_lock(&pt->pt_lock);
+
+	for (size_t w = 0; w < (pt->pt_npages + 63) / 64; w++) {
+		uint64_t dirty;
+
+		if (atomic_load_explicit(&pt->pt_dirty[w],
+		    memory_order_relaxed) == 0)
+			continue;
+		dirty = atomic_exchange(&pt->pt_dirty[w], 0);
+
+		while (dirty != 0) {
+			size_t page = w * 64 + __builtin_ctzll(dirty), gap;
+			int want = pages_want(pt, page);
+
+			dirty &= dirty - 1;
+			if (want == pages_have(pt, page))
+				continue;
+			changed++;
+
+			/* bridge the gap if nothing in it needs to change */
+			if (want == state && page - end <= PAGES_GAP) {
+				for (gap = end; gap < page; gap++)
+					if (pages_have(pt, gap) != want ||
+					    pages_want(pt, gap) != want)
+						break;
+				if (gap == page) {
+					end = page + 1;
+					continue;
+				}
+			}
+
+			if (state >= 0 && pages_apply(pt, start, end,
+			    state) != 0)
+				err = errno;
+			start = page;
+			end = page + 1;
+			state = want;
+		}
+	}
+	if (state >= 0 && pages_apply(pt, start, end, state) != 0)
+		err = errno;
+
+	atomic_fetch_add_explicit(&pt->pt_flushes, 1, memory_order_relaxed);
+	pthread_mutex_unlock(&pt->pt_lock);
+
+	if (err != 0) {
+		errno = err;
+		return -1;
+	}
+
+	return changed;
+}
+
+int
+fault_pages_stats(const struct faultpages *pt, struct faultpagesstats *pg)
+{
+	*pg = (struct faultpagesstats) {
+		.pg_pages = pt->pt_npages,
+		.pg_queued = atomic_load(&pt->pt_queued),
+		.pg_flushes = atomic_load(&pt->pt_flushes),
+		.pg_calls = atomic_load(&pt->pt_calls),
+		.pg_changed = atomic_load(&pt->pt_changed)
+	};
+
+	return 0;
+}
+
+/*
+ * Anything still queued is dropped; the pages keep the protection they
+ * have.
+ */
+void
+fault_pages_destroy(struct faultpages *pt)
+{
+	pthread_mutex_destroy(&pt->pt_lock);
+	free(pt->pt_dirty);
+	free(pt->pt_have);
+	free(pt->pt_want);
+	free(pt);
+}
@@ -0,0 +1,500 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Safepoints.  Attached threads poll by loading from a page of ours;
+ * arming the safepoint makes the page PROT_NONE, so the next poll in
+ * every running thread faults and the handler parks the thread right
+ * there, with its faultinfo on hand for whoever armed it.  Threads about
+ * to block for a while say so and count as stopped until they come back.
+ *
+ * sf_state counts safepoints, twice: it is odd while one is armed.  A
+ * thread parks until the state moves on from the value that made it
+ * park.  sf_running counts the attached threads that are neither parked
+ * nor blocked, and the arming thread waits for it to reach zero.  A
+ * thread coming back first counts itself in and only then looks at the
+ * state, backing out again if a safepoint is armed: whoever arms it sets
+ * the state before it looks at the count, so one of the two always sees
+ * the other.
+ *
+ *	RUNNING -> PARKED -> RUNNING		(poll while armed)
+ *	RUNNING -> BLOCKED -> RUNNING		(block, unblock)
+ */
+
+#include "fault.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#if defined(__linux__)
+# include <linux/futex.h>
+# include <sys/syscall.h>
+#endif
+
+#define SAFEPOINT_RUNNING	0
+#define SAFEPOINT_PARKED	1
+#define SAFEPOINT_BLOCKED	2
+
+struct safepointthread {
+	struct faultsafepoint	*tr_sf;
+	void			*tr_thread;
+	atomic_int		 tr_state;
+	const struct faultinfo *_Atomic
+				 tr_fi;		/* while parked */
+};
+
+struct faultsafepoint {
+	char			*sf_page;
+	size_t			 sf_pagesz;
+	atomic_uint		 sf_state,
+				 sf_running;
+	pthread_mutex_t		 sf_lock;	/* held while armed */
+	struct safepointthread	**sf_threads;
+	size_t			 sf_nthreads,
+				 sf_maxthreads;
+	struct safepointthread	*sf_self;	/* the arming thread, if ours */
+	uint64_t		 sf_armed;
+	atomic_uint_least64_t	 sf_stopped,
+				 sf_count,
+				 sf_parks,
+				 sf_ns,
+				 sf_maxns,
+				 sf_lastns,
+				 sf_hist[FAULT_STATS_BUCKETS];
+};
+
+static _Thread_local struct safepointthread *
+safepointself __attribute__ ((tls_model ("initial-exec"))) = NULL;
+
+static uint64_t
+safepoint_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Wait for *w to change from v.  Both are safe in a signal handler.
+ */
+static void
+safepoint_wait(atomic_uint *w, unsigned int v)
+{
+	while (atomic_load(w) == v) {
+#if defined(__linux__)
+		syscall(SYS_futex, w, FUTEX_WAIT_PRIVATE, v, NULL, NULL, 0);
+#else
+		sched_yield();
+#endif
+	}
+}
+
+static void
+safepoint_wake(atomic_uint *w)
+{
+#if defined(__linux__)
+	syscall(SYS_futex, w, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/*
+ * One running thread fewer; the last one out tells the arming thread.
+ */
+static void
+safepoint_leave(struct faultsafepoint *sf)
+{
+	if (atomic_fetch_sub(&sf->sf_running, 1) == 1) {
+		atomic_store(&sf->sf_stopped, safepoint_now());
+		safepoint_wake(&sf->sf_running);
+	}
+}
+
+/*
+ * One running thread more, once no safepoint is armed.
+ */
+static void
+safepoint_join(struct faultsafepoint *sf)
+{
+	unsigned int state;
+
+	for (;;) {
+		atomic_fetch_add(&sf->sf_running, 1);
+		if (((state = atomic_load(&sf->sf_state)) & 1) == 0)
+			return;
+		safepoint_leave(sf);
+		safepoint_wait(&sf->sf_state, state);
+	}
+}
+
+static int
+safepoint_fault(int flt, const struct faultinfo *fi, void *arg)
+{
+	struct faultsafepoint *sf = arg;
+	struct safepointthread *tr = safepointself;
+	unsigned int state = atomic_load(&sf->sf_state);
+
+	/* disarmed since; the page is readable again */
+	if ((state & 1) == 0)
+		return 1;
+
+	/* not one of ours: wait it out without being counted */
+	if (tr == NULL || tr->tr_sf != sf ||
+	    atomic_load(&tr->tr_state) != SAFEPOINT_RUNNING) {
+		safepoint_wait(&sf->sf_state, state);
+		return 1;
+	}
+
+	atomic_store(&tr->tr_fi, fi);
+	atomic_store(&tr->tr_state, SAFEPOINT_PARKED);
+	atomic_fetch_add_explicit(&sf->sf_parks, 1, memory_order_relaxed);
+
+	safepoint_leave(sf);
+	safepoint_wait(&sf->sf_state, state);
+	safepoint_join(sf);
+
+	atomic_store(&tr->tr_state, SAFEPOINT_RUNNING);
+	atomic_store(&tr->tr_fi, NULL);
+
+	return 1;
+}
+
+/*
+ * A safepoint with its polling page.
+ */
+struct faultsafepoint *
+fault_safepoint_create(void)
+{
+	struct faultsafepoint *sf;
+
+	if ((sf = calloc(1, sizeof(*sf))) == NULL)
+		return NULL;
+
+	sf->sf_pagesz = sysconf(_SC_PAGESIZE);
+	pthread_mutex_init(&sf->sf_lock, NULL);
+
+	sf->sf_page = mmap(NULL, sf->sf_pagesz, PROT_READ,
+	    MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (sf->sf_page == MAP_FAILED)
+		goto fail;
+
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = sf->sf_page,
+		.fr_len = sf->sf_pagesz,
+		.fr_act = { .fa_fun = safepoint_fault, .fa_arg = sf }
+	    }) != 0) {
+		munmap(sf->sf_page, sf->sf_pagesz);
+		goto fail;
+	}
+
+	return sf;
+
+fail:
+	pthread_mutex_destroy(&sf->sf_lock);
+	free(sf);
+	return NULL;
+}
+
+/*
+ * The page to poll: FAULT_SAFEPOINT_POLL(page) is a single load.
+ */
+const void *
+fault_safepoint_page(const struct faultsafepoint *sf)
+{
+	return sf->sf_page;
+}
+
+/*
+ * Make the calling thread one that a safepoint waits for.  thread is
+ * whatever the VM wants to be handed back for it.  A thread can be
+ * attached to one safepoint at a time; attaching waits out a safepoint
+ * that is armed.
+ */
+int
+fault_safepoint_attach(struct faultsafepoint *sf, void *thread)
+{
+	struct safepointthread *tr, **threads;
+
+	if (safepointself != NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if ((tr = malloc(sizeof(*tr))) == NULL)
+		return -1;
+	tr->tr_sf = sf;
+	tr->tr_thread = thread;
+	atomic_init(&tr->tr_state, SAFEPOINT_RUNNING);
+	atomic_init(&tr->tr_fi, NULL);
+
+	pthread_mutex_lock(&sf->sf_lock);
+	if (sf->sf_nthreads == sf->sf_maxthreads) {
+		size_t max = sf->sf_maxthreads != 0 ?
+		    sf->sf_maxthreads * 2 : 16;
+
+		if ((threads = realloc(sf->sf_threads,
+		    max * sizeof(threads[0]))) == NULL) {
+			pthread_mutex_unlock(&sf->sf_lock);
+			free(tr);
+			return -1;
+		}
+		sf->sf_threads = threads;
+		sf->sf_maxthreads = max;
+	}
+	sf->sf_threads[sf->sf_nthreads++] = tr;
+	atomic_fetch_add(&sf->sf_running, 1);
+	pthread_mutex_unlock(&sf->sf_lock);
+
+	safepointself = tr;
+
+	return 0;
+}
+
+int
+fault_safepoint_detach(struct faultsafepoint *sf)
+{
+	struct safepointthread *tr = safepointself;
+
+	if (tr == NULL || tr->tr_sf != sf) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* stop counting towards a safepoint before waiting for it */
+	if (atomic_load(&tr->tr_state) == SAFEPOINT_RUNNING) {
+		atomic_store(&tr->tr_state, SAFEPOINT_BLOCKED);
+		safepoint_leave(sf);
+	}
+
+	pthread_mutex_lock(&sf->sf_lock);
+	for (size_t i = 0; i < sf->sf_nthreads; i++) {
+		if (sf->sf_threads[i] == tr) {
+			sf->sf_threads[i] = sf->sf_threads[--sf->sf_nthreads];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sf->sf_lock);
+
+	safepointself = NULL;
+	free(tr);
+
+	return 0;
+}
+
+/*
+ * Around anything that may take a while without polling (a blocking
+ * system call, say): in between, the thread counts as stopped and must
+ * not touch anything a safepoint protects.  Unblocking waits out a
+ * safepoint that is armed.
+ */
+int
+fault_safepoint_block(struct faultsafepoint *sf)
+{
+	struct safepointthread *tr = safepointself;
+
+	if (tr == NULL || tr->tr_sf != sf ||
+	    atomic_load(&tr->tr_state) != SAFEPOINT_RUNNING) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	atomic_store(&tr->tr_state, SAFEPOINT_BLOCKED);
+	safepoint_leave(sf);
+
+	return 0;
+}
+
+int
+fault_safepoint_unblock(struct faultsafepoint *sf)
+{
+	struct safepointthread *tr = safepointself;
+
+	if (tr == NULL || tr->tr_sf != sf ||
+	    atomic_load(&tr->tr_state) != SAFEPOINT_BLOCKED) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	safepoint_join(sf);
+	atomic_store(&tr->tr_state, SAFEPOINT_RUNNING);
+
+	return 0;
+}
+
+/*
+ * Arm the safepoint and return once every attached thread is parked at
+ * a poll or blocked.  The calling thread may be attached itself; it
+ * counts as blocked until it disarms.  Safepoints armed from different
+ * threads take turns.
+ */
+int
+fault_safepoint_arm(struct faultsafepoint *sf)
+{
+	struct safepointthread *tr = safepointself;
+	uint64_t stopped, ns;
+	unsigned int running;
+	int bucket;
+
+	if (tr != NULL && tr->tr_sf == sf &&
+	    atomic_load(&tr->tr_state) == SAFEPOINT_RUNNING) {
+		atomic_store(&tr->tr_state, SAFEPOINT_BLOCKED);
+		safepoint_leave(sf);
+	} else {
+		tr = NULL;
+	}
+
+	pthread_mutex_lock(&sf->sf_lock);
+	sf->sf_self = tr;
+	sf->sf_armed = safepoint_now();
+	atomic_fetch_add(&sf->sf_state, 1);
+
+	if (mprotect(sf->sf_page, sf->sf_pagesz, PROT_NONE) != 0) {
+		atomic_fetch_add(&sf->sf_state, 1);
+		safepoint_wake(&sf->sf_state);
+		sf->sf_self = NULL;
+		pthread_mutex_unlock(&sf->sf_lock);
+		if (tr != NULL)
+			fault_safepoint_unblock(sf);
+		return -1;
+	}
+
+	while ((running = atomic_load(&sf->sf_running)) != 0) {
+#if defined(__linux__)
+		syscall(SYS_futex, &sf->sf_running, FUTEX_WAIT_PRIVATE,
+		    running, NULL, NULL, 0);
+#else
+		sched_yield();
+#endif
+	}
+
+	/* nobody was left running to note the time */
+	if ((stopped = atomic_load(&sf->sf_stopped)) < sf->sf_armed)
+		stopped = safepoint_now();
+	ns = stopped - sf->sf_armed;
+	bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+	if (bucket >= FAULT_STATS_BUCKETS)
+		bucket = FAULT_STATS_BUCKETS - 1;
+
+	atomic_fetch_add(&sf->sf_count, 1);
+	atomic_fetch_add(&sf->sf_ns, ns);
+	atomic_fetch_add(&sf->sf_hist[bucket], 1);
+	atomic_store(&sf->sf_lastns, ns);
+	if (ns > atomic_load(&sf->sf_maxns))
+		atomic_store(&sf->sf_maxns, ns);
+
+	return 0;
+}
+
+/*
+ * Let everybody go again.  Only the thread that armed the safepoint may
+ * disarm it.
+ */
+int
+fault_safepoint_disarm(struct faultsafepoint *sf)
+{
+	struct safepointthread *tr = sf->sf_self;
+
+	if ((atomic_load(&sf->sf_state) & 1) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* readable first, so nobody parks again on the way out */
+	if (mprotect(sf->sf_page, sf->sf_pagesz, PROT_READ) != 0)
+		return -1;
+	atomic_fetch_add(&sf->sf_state, 1);
+	safepoint_wake(&sf->sf_state);
+
+	sf->sf_self = NULL;
+	pthread_mutex_unlock(&sf->sf_lock);
+
+	if (tr != NULL)
+		fault_safepoint_unblock(sf);
+
+	return 0;
+}
+
+/*
+ * While armed, from the arming thread: call fun for every attached
+ * thread but the caller, with the faultinfo of its poll if it is parked
+ * (fi_ctx holds its registers, which fun may change) or NULL if it is
+ * blocked, until fun returns non-zero.  Returns what fun last returned.
+ */
+int
+fault_safepoint_threads(struct faultsafepoint *sf,
+    int (*fun)(void *thread, const struct faultinfo *fi, void *arg),
+    void *arg)
+{
+	int res = 0;
+
+	if ((atomic_load(&sf->sf_state) & 1) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (size_t i = 0; i < sf->sf_nthreads && res == 0; i++) {
+		struct safepointthread *tr = sf->sf_threads[i];
+
+		if (tr == sf->sf_self)
+			continue;
+		res = fun(tr->tr_thread,
+		    atomic_load(&tr->tr_state) == SAFEPOINT_PARKED ?
+		    atomic_load(&tr->tr_fi) : NULL, arg);
+	}
+
+	return res;
+}
+
+/*
+ * Arm-to-stopped latency: how long from arming until the last attached
+ * thread parked or blocked.
+ */
+int
+fault_safepoint_stats(const struct faultsafepoint *sf,
+    struct faultsafepointstats *ps)
+{
+	ps->ps_safepoints = atomic_load(&sf->sf_count);
+	ps->ps_parks = atomic_load(&sf->sf_parks);
+	ps->ps_ns = atomic_load(&sf->sf_ns);
+	ps->ps_maxns = atomic_load(&sf->sf_maxns);
+	ps->ps_lastns = atomic_load(&sf->sf_lastns);
+	for (int b = 0; b < FAULT_STATS_BUCKETS; b++)
+		ps->ps_hist[b] = atomic_load(&sf->sf_hist[b]);
+
+	return 0;
+}
+
+/*
+ * All threads must have detached.
+ */
+void
+fault_safepoint_destroy(struct faultsafepoint *sf)
+{
+	fault_unregister(sf->sf_page);
+	munmap(sf->sf_page, sf->sf_pagesz);
+	pthread_mutex_destroy(&sf->sf_lock);
+	free(sf->sf_threads);
+	free(sf);
+}
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Copy-on-write snapshots.  Taking one makes the range read-only with a
+ * single mprotect; the first write to each page copies it to a shadow
+ * mapping of the same size before making the page writable again.  The
+ * snapshot is then the shadow page where there is one and the live page
+ * where there is not.
+ *
+ * Each page has a state word: a phase in the low bits and the number of
+ * readers copying out of the live page above them.
+ *
+ *	LIVE -> BUSY -> COPIED -> WRITABLE -> RELEASED	(a writer)
+ *	LIVE -> BUSY -> RELEASED			(the reader, done)
+ *	WRITABLE -> RELEASED				(the reader, done)
+ *
+ * Readers only read the live page while it is LIVE or BUSY; a writer
+ * copies it, moves to COPIED so that later readers go to the shadow,
+ * and waits for the readers already on the live page to leave before
+ * unprotecting it.
+ */
+
+#include "fault.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define SNAP_LIVE	0
+#define SNAP_BUSY	1
+#define SNAP_COPIED	2
+#define SNAP_WRITABLE	3
+#define SNAP_RELEASED	4
+
+#define SNAP_PHASE	0x7
+#define SNAP_READER	0x8
+
+struct faultsnap {
+	char			*sn_base,
+				*sn_shadow;
+	size_t			 sn_len,
+				 sn_npages,
+				 sn_pagesz;
+	atomic_uint		*sn_state;
+	atomic_size_t		 sn_copied;
+};
+
+static int
+snap_fault(int flt, const struct faultinfo *fi, void *arg)
+{
+	struct faultsnap *sn = arg;
+	size_t page = ((char *) fi->fi_addr - sn->sn_base) / sn->sn_pagesz;
+	char *addr = sn->sn_base + page * sn->sn_pagesz;
+	atomic_uint *state = &sn->sn_state[page];
+	unsigned int st = atomic_load(state);
+
+	while ((st & SNAP_PHASE) == SNAP_LIVE) {
+		if (atomic_compare_exchange_weak(state, &st, st + SNAP_BUSY)) {
+			memcpy(sn->sn_shadow + page * sn->sn_pagesz, addr,
+			    sn->sn_pagesz);
+			atomic_fetch_add(&sn->sn_copied, 1);
+			atomic_fetch_add(state, SNAP_COPIED - SNAP_BUSY);
+
+			while (atomic_load(state) >= SNAP_READER)
+				sched_yield();
+			if (mprotect(addr, sn->sn_pagesz,
+			    PROT_READ | PROT_WRITE) != 0)
+				return 0;
+			atomic_fetch_add(state, SNAP_WRITABLE - SNAP_COPIED);
+			return 1;
+		}
+	}
+
+	/* somebody else got there first; wait for the page to open up */
+	while ((st & SNAP_PHASE) < SNAP_WRITABLE) {
+		sched_yield();
+		st = atomic_load(state);
+	}
+
+	return 1;
+}
+
+/*
+ * Snapshot [addr, addr + len), which must be readable and writable and
+ * must not overlap another region.
+ */
+struct faultsnap *
+fault_snap_create(void *addr, size_t len)
+{
+	struct faultsnap *sn;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	if ((uintptr_t) addr % page_size != 0 || len == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((sn = calloc(1, sizeof(*sn))) == NULL)
+		return NULL;
+
+	sn->sn_base = addr;
+	sn->sn_pagesz = page_size;
+	sn->sn_npages = (len + page_size - 1) / page_size;
+	sn->sn_len = sn->sn_npages * page_size;
+	sn->sn_shadow = MAP_FAILED;
+
+	/* both of these stay untouched, and so unpopulated, until needed */
+	if ((sn->sn_state = calloc(sn->sn_npages,
+	    sizeof(sn->sn_state[0]))) == NULL)
+		goto fail;
+	sn->sn_shadow = mmap(NULL, sn->sn_len, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	if (sn->sn_shadow == MAP_FAILED)
+		goto fail;
+
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = sn->sn_base,
+		.fr_len = sn->sn_len,
+		.fr_act = { .fa_fun = snap_fault, .fa_arg = sn }
+	    }) != 0)
+		goto fail;
+
+	if (mprotect(sn->sn_base, sn->sn_len, PROT_READ) != 0) {
+		fault_unregister(sn->sn_base);
+		goto fail;
+	}
+
+	return sn;
+
+fail:
+	if (sn->sn_shadow != MAP_FAILED)
+		munmap(sn->sn_shadow, sn->sn_len);
+	free(sn->sn_state);
+	free(sn);
+	return NULL;
+}
+
+/*
+ * Copy len bytes at offset off as they were when the snapshot was taken.
+ * Fails with ESTALE if any of it has been released.
+ */
+int
+fault_snap_read(struct faultsnap *sn, size_t off, void *buf, size_t len)
+{
+	char *dst = buf;
+
+	if (off > sn->sn_len || len > sn->sn_len - off) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (len > 0) {
+		size_t page = off / sn->sn_pagesz,
+		    n = sn->sn_pagesz - off % sn->sn_pagesz;
+		atomic_uint *state = &sn->sn_state[page];
+		unsigned int st = atomic_load(state);
+
+		if (n > len)
+			n = len;
+
+		for (;;) {
+			if ((st & SNAP_PHASE) == SNAP_RELEASED) {
+				errno = ESTALE;
+				return -1;
+			} else if ((st & SNAP_PHASE) >= SNAP_COPIED) {
+				memcpy(dst, sn->sn_shadow + off, n);
+				break;
+			} else if (atomic_compare_exchange_weak(state, &st,
+			    st + SNAP_READER)) {
+				memcpy(dst, sn->sn_base + off, n);
+				atomic_fetch_sub(state, SNAP_READER);
+				break;
+			}
+		}
+
+		off += n;
+		dst += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * The reader is done with the whole pages in [off, off + len): free
+ * their copies, and stop protecting the ones that were never written.
+ */
+int
+fault_snap_release(struct faultsnap *sn, size_t off, size_t len)
+{
+	size_t first, last;
+
+	if (off > sn->sn_len || len > sn->sn_len - off) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	first = (off + sn->sn_pagesz - 1) / sn->sn_pagesz;
+	last = (off + len) / sn->sn_pagesz;
+
+	for (size_t page = first; page < last; page++) {
+		atomic_uint *state = &sn->sn_state[page];
+		unsigned int st = SNAP_LIVE;
+
+		if (atomic_compare_exchange_strong(state, &st, SNAP_BUSY)) {
+			if (mprotect(sn->sn_base + page * sn->sn_pagesz,
+			    sn->sn_pagesz, PROT_READ | PROT_WRITE) != 0) {
+				atomic_store(state, SNAP_LIVE);
+				return -1;
+			}
+			atomic_store(state, SNAP_RELEASED);
+			continue;
+		}
+
+		while ((st & SNAP_PHASE) < SNAP_WRITABLE) {
+			sched_yield();
+			st = atomic_load(state);
+		}
+		if (st == SNAP_WRITABLE) {
+			atomic_store(state, SNAP_RELEASED);
+			madvise(sn->sn_shadow + page * sn->sn_pagesz,
+			    sn->sn_pagesz, MADV_DONTNEED);
+			atomic_fetch_sub(&sn->sn_copied, 1);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Pages copied so far and not yet released.
+ */
+size_t
+fault_snap_copied(const struct faultsnap *sn)
+{
+	return atomic_load(&sn->sn_copied);
+}
+
+void
+fault_snap_destroy(struct faultsnap *sn)
+{
+	mprotect(sn->sn_base, sn->sn_len, PROT_READ | PROT_WRITE);
+	fault_unregister(sn->sn_base);
+	munmap(sn->sn_shadow, sn->sn_len);
+	free(sn->sn_state);
+	free(sn);
+}
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Growable stacks.  Stacks of the same size are carved out of pools of
+ * slots, each pool one reserved PROT_NONE mapping registered as a single
+ * region, so that hundreds of thousands of stacks do not mean as many
+ * regions.  A slot is a guard page with the stack above it; the stack is
+ * committed from the top down.
+ *
+ *	| guard | uncommitted ...	| committed	| guard | ...
+ *		^ st_base		^ st_low	^ st_top
+ *
+ * Only the thread running on a stack grows it, so the bottom of the
+ * committed part has a single writer.
+ */
+
+#include "fault.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define STACK_POOL_SLOTS	1024
+#define STACK_POOL_BYTES	((size_t) 256 << 20)
+
+/* how far below sp an access still counts as the thread's own */
+#define STACK_SLACK		(64 * 1024)
+
+/* most to commit in one go beyond the faulting page */
+#define STACK_STEP		(64 * 1024)
+
+struct stackpool {
+	struct stackpool	*pl_next;
+	char			*pl_base;
+	size_t			 pl_len,
+				 pl_slotsz,
+				 pl_nslots,
+				 pl_nfree,
+				 pl_pagesz;
+	size_t			*pl_free;
+	struct faultstack *_Atomic *pl_stacks;
+};
+
+struct faultstack {
+	struct stackpool	*st_pool;
+	size_t			 st_slot;
+	char			*st_base,
+				*st_top;
+	atomic_uintptr_t	 st_low;
+};
+
+static pthread_mutex_t
+stacklock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct stackpool *
+stackpools = NULL;
+
+static int
+stack_fault(int flt, const struct faultinfo *fi, void *arg)
+{
+	struct stackpool *pl = arg;
+	uintptr_t addr = (uintptr_t) fi->fi_addr, sp = (uintptr_t) fi->fi_sp,
+	    base, top, low, page, extra;
+	struct faultstack *st;
+
+	st = atomic_load(&pl->pl_stacks[(addr - (uintptr_t) pl->pl_base) /
+	    pl->pl_slotsz]);
+	if (st == NULL)
+		return 0;
+
+	base = (uintptr_t) st->st_base;
+	top = (uintptr_t) st->st_top;
+	low = atomic_load(&st->st_low);
+	page = addr & ~(pl->pl_pagesz - 1);
+
+	/* below the stack is the guard page: a real overflow */
+	if (addr < base)
+		return 0;
+	if (addr >= low)
+		return 1;
+	if (sp < base || sp > top || addr + STACK_SLACK < sp)
+		return 0;
+
+	/* the faulting page and as much again as is committed, within reason */
+	extra = top - low < STACK_STEP ? top - low : STACK_STEP;
+	page = page - base > extra ? page - extra : base;
+	if (mprotect((void *) page, low - page, PROT_READ | PROT_WRITE) != 0)
+		return 0;
+	atomic_store(&st->st_low, page);
+
+	return 1;
+}
+
+static struct stackpool *
+pool_create(size_t slotsz, size_t page_size)
+{
+	struct stackpool *pl;
+
+	if ((pl = calloc(1, sizeof(*pl))) == NULL)
+		return NULL;
+
+	pl->pl_slotsz = slotsz;
+	pl->pl_pagesz = page_size;
+	pl->pl_nslots = STACK_POOL_BYTES / slotsz;
+	if (pl->pl_nslots > STACK_POOL_SLOTS)
+		pl->pl_nslots = STACK_POOL_SLOTS;
+	else if (pl->pl_nslots == 0)
+		pl->pl_nslots = 1;
+	pl->pl_len = pl->pl_nslots * slotsz;
+	pl->pl_base = MAP_FAILED;
+
+	if ((pl->pl_free = calloc(pl->pl_nslots,
+	    sizeof(pl->pl_free[0]))) == NULL ||
+	    (pl->pl_stacks = calloc(pl->pl_nslots,
+	    sizeof(pl->pl_stacks[0]))) == NULL)
+		goto fail;
+	for (size_t i = 0; i < pl->pl_nslots; i++)
+		pl->pl_free[i] = pl->pl_nslots - 1 - i;
+	pl->pl_nfree = pl->pl_nslots;
+
+	pl->pl_base = mmap(NULL, pl->pl_len, PROT_NONE,
+	    MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	if (pl->pl_base == MAP_FAILED)
+		goto fail;
+
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = pl->pl_base,
+		.fr_len = pl->pl_len,
+		.fr_act = { .fa_fun = stack_fault, .fa_arg = pl }
+	    }) != 0)
+		goto fail;
+
+	return pl;
+
+fail:
+	if (pl->pl_base != MAP_FAILED)
+		munmap(pl->pl_base, pl->pl_len);
+	free(pl->pl_stacks);
+	free(pl->pl_free);
+	free(pl);
+	return NULL;
+}
+
+/*
+ * Uncommit everything below end.
+ */
+static int
+stack_release(struct faultstack *st, char *end)
+{
+	char *low = (char *) atomic_load(&st->st_low);
+
+	if (low >= end)
+		return 0;
+	if (mprotect(low, end - low, PROT_NONE) != 0)
+		return -1;
+	madvise(low, end - low, MADV_DONTNEED);
+	atomic_store(&st->st_low, (uintptr_t) end);
+
+	return 0;
+}
+
+/*
+ * A stack of up to max bytes, with its top page committed.  Also sets up
+ * an alternate signal stack for the calling thread.
+ */
+struct faultstack *
+fault_stack_create(size_t max)
+{
+	struct faultstack *st;
+	struct stackpool *pl;
+	size_t page_size = sysconf(_SC_PAGESIZE), size, slotsz;
+
+	if (max == 0 || max > SIZE_MAX / 2) {
+		errno = EINVAL;
+		return NULL;
+	}
+	size = (max + page_size - 1) & ~(page_size - 1);
+	slotsz = size + page_size;
+
+	if (fault_altstack() != 0 || (st = malloc(sizeof(*st))) == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&stacklock);
+	for (pl = stackpools; pl != NULL; pl = pl->pl_next)
+		if (pl->pl_slotsz == slotsz && pl->pl_nfree > 0)
+			break;
+	if (pl == NULL) {
+		if ((pl = pool_create(slotsz, page_size)) == NULL) {
+			pthread_mutex_unlock(&stacklock);
+			free(st);
+			return NULL;
+		}
+		pl->pl_next = stackpools;
+		stackpools = pl;
+	}
+	st->st_pool = pl;
+	st->st_slot = pl->pl_free[--pl->pl_nfree];
+	pthread_mutex_unlock(&stacklock);
+
+	st->st_base = pl->pl_base + st->st_slot * slotsz + page_size;
+	st->st_top = st->st_base + size;
+	atomic_init(&st->st_low, (uintptr_t) (st->st_top - page_size));
+
+	if (mprotect(st->st_top - page_size, page_size,
+	    PROT_READ | PROT_WRITE) != 0) {
+		pthread_mutex_lock(&stacklock);
+		pl->pl_free[pl->pl_nfree++] = st->st_slot;
+		pthread_mutex_unlock(&stacklock);
+		free(st);
+		return NULL;
+	}
+	atomic_store(&pl->pl_stacks[st->st_slot], st);
+
+	return st;
+}
+
+/*
+ * Lowest address of the stack; the stack pointer starts out at
+ * base + size.
+ */
+void *
+fault_stack_base(const struct faultstack *st)
+{
+	return st->st_base;
+}
+
+size_t
+fault_stack_size(const struct faultstack *st)
+{
+	return st->st_top - st->st_base;
+}
+
+size_t
+fault_stack_committed(const struct faultstack *st)
+{
+	return (uintptr_t) st->st_top - atomic_load(&st->st_low);
+}
+
+/*
+ * Give back all but the top page.  Nothing may be running on the stack.
+ */
+int
+fault_stack_trim(struct faultstack *st)
+{
+	return stack_release(st, st->st_top - st->st_pool->pl_pagesz);
+}
+
+void
+fault_stack_destroy(struct faultstack *st)
+{
+	struct stackpool *pl = st->st_pool;
+
+	atomic_store(&pl->pl_stacks[st->st_slot], NULL);
+	stack_release(st, st->st_top);
+
+	pthread_mutex_lock(&stacklock);
+	pl->pl_free[pl->pl_nfree++] = st->st_slot;
+	pthread_mutex_unlock(&stacklock);
+
+	free(st);
+}
@@ -5,9 +5,16 @@
 #include <setjmp.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ucontext.h>
 
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #define nitems(arr)	(sizeof(arr) / sizeof((arr)[0]))
 
@@ -279,6 +286,2187 @@ test_retry(void)
 	return *(volatile char *) addr == 42 ? 0 : -1;
 }
 
+int
+region_segv(int flt, const struct faultinfo *fi, void *arg)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	lastfault = *fi;
+	*(int *) arg += 1;
+
+	if (mprotect((void *) ((uintptr_t) fi->fi_addr & -page_size), page_size, PROT_READ | PROT_WRITE) != 0) {
+		perror("mprotect");
+		exit(1);
+	}
+
+	return 1;
+}
+
+static int
+test_region(void)
+{
+	char *addr;
+	long page_size = sysconf(_SC_PAGESIZE);
+	int hits[3] = { 0 }, global = 0;
+
+	addr = mmap(NULL, 4 * page_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	for (int i = 0; i < 3; i++) {
+		if (fault_register(&(struct faultregion) {
+			.fr_addr = addr + i * page_size,
+			.fr_len = page_size,
+			.fr_act = { .fa_fun = region_segv, .fa_arg = &hits[i] }
+		    }) != 0) {
+			perror("fault_register");
+			return -1;
+		}
+	}
+
+	/* overlapping regions are refused */
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = addr + page_size / 2,
+		.fr_len = page_size,
+		.fr_act = { .fa_fun = region_segv, .fa_arg = &global }
+	    }) == 0)
+		return -1;
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+		.fa_fun = region_segv,
+		.fa_arg = &global
+	}, NULL);
+
+	addr[2 * page_size] = 3;
+	addr[0] = 1;
+	addr[3 * page_size] = 4;
+
+	if (fault_unregister(addr + page_size) != 0)
+		return -1;
+	addr[page_size] = 2;
+
+	return hits[0] == 1 && hits[1] == 0 && hits[2] == 1 && global == 2 ? 0 : -1;
+}
+
+static int
+test_regions(void)
+{
+	enum { NREGIONS = 512 };
+	char *addr;
+	long page_size = sysconf(_SC_PAGESIZE);
+	int hits = 0;
+
+	addr = mmap(NULL, NREGIONS * page_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	/* register in a scrambled order to exercise sorted insertion */
+	for (int i = 0; i < NREGIONS; i++) {
+		if (fault_register(&(struct faultregion) {
+			.fr_addr = addr + ((i * 7) % NREGIONS) * page_size,
+			.fr_len = page_size,
+			.fr_act = { .fa_fun = region_segv, .fa_arg = &hits }
+		    }) != 0) {
+			perror("fault_register");
+			return -1;
+		}
+	}
+
+	for (int i = NREGIONS - 1; i >= 0; i--)
+		addr[i * page_size + i] = 1;
+
+	for (int i = 0; i < NREGIONS; i++)
+		if (fault_unregister(addr + i * page_size) != 0)
+			return -1;
+
+	return hits == NREGIONS ? 0 : -1;
+}
+
+static void *
+thread_main(void *arg)
+{
+	char *addr = arg;
+	int hits = 0;
+
+	fault_thread(FAULT_BAD_ACCESS, &(struct faultaction) {
+		.fa_fun = region_segv,
+		.fa_arg = &hits
+	}, NULL);
+
+	for (int i = 0; i < 1000; i++) {
+		mprotect(addr, sysconf(_SC_PAGESIZE), PROT_NONE);
+		*(volatile char *) addr = 1;
+	}
+
+	fault_thread(FAULT_BAD_ACCESS, &(struct faultaction) { 0 }, NULL);
+
+	return hits == 1000 ? arg : NULL;
+}
+
+static int
+test_thread(void)
+{
+	enum { NTHREADS = 4 };
+	pthread_t threads[NTHREADS];
+	char *addr;
+	long page_size = sysconf(_SC_PAGESIZE);
+	int global = 0, ok = 0;
+
+	addr = mmap(NULL, NTHREADS * page_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	/* thread handlers take precedence over the process-wide one */
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+		.fa_fun = region_segv,
+		.fa_arg = &global
+	}, NULL);
+
+	for (int i = 0; i < NTHREADS; i++)
+		pthread_create(&threads[i], NULL, thread_main, addr + i * page_size);
+
+	for (int i = 0; i < NTHREADS; i++) {
+		void *res;
+
+		pthread_join(threads[i], &res);
+		if (res == addr + i * page_size)
+			ok++;
+	}
+
+	return ok == NTHREADS && global == 0 ? 0 : -1;
+}
+
+int
+uffd_fill(int flt, const struct faultinfo *fi, void *arg)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	char *page = (char *) ((uintptr_t) fi->fi_addr & -page_size);
+	char buf[page_size];
+
+	if (fi->fi_flags & FI_WP) {
+		atomic_fetch_add((atomic_int *) arg, 1000);
+		return fault_uffd_protect(page, page_size, 0) == 0;
+	}
+
+	atomic_fetch_add((atomic_int *) arg, 1);
+	memset(buf, (int) (((uintptr_t) page / page_size) & 0x7f), page_size);
+
+	return fault_uffd_copy(page, buf, page_size) == 0;
+}
+
+static void *
+uffd_main(void *arg)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	char *page = arg;
+
+	return *(volatile char *) page == (char) (((uintptr_t) page / page_size) & 0x7f) ? arg : NULL;
+}
+
+static int
+test_uffd(void)
+{
+	enum { NTHREADS = 8 };
+	pthread_t threads[NTHREADS];
+	char *addr;
+	long page_size = sysconf(_SC_PAGESIZE);
+	atomic_int hits = 0;
+	int ok = 0;
+
+	addr = mmap(NULL, NTHREADS * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = addr,
+		.fr_len = NTHREADS * page_size,
+		.fr_act = { .fa_fun = uffd_fill, .fa_arg = &hits },
+		.fr_flags = FR_UFFD | FR_UFFD_WP
+	    }) != 0) {
+		perror("fault_register: skipping");
+		return 0;
+	}
+
+	for (int i = 0; i < NTHREADS; i++)
+		pthread_create(&threads[i], NULL, uffd_main, addr + i * page_size);
+
+	for (int i = 0; i < NTHREADS; i++) {
+		void *res;
+
+		pthread_join(threads[i], &res);
+		if (res == addr + i * page_size)
+			ok++;
+	}
+
+	/* write-protect the first page and catch the write */
+	if (fault_uffd_protect(addr, page_size, 1) != 0) {
+		perror("fault_uffd_protect");
+		return -1;
+	}
+	addr[0] = 42;
+
+	if (fault_unregister(addr) != 0)
+		return -1;
+
+	return ok == NTHREADS && atomic_load(&hits) == 1000 + NTHREADS && addr[0] == 42 ? 0 : -1;
+}
+
+int
+resolve_rw(void *addr, size_t len, void *arg)
+{
+	*(int *) arg += 1;
+
+	return mprotect(addr, len, PROT_READ | PROT_WRITE) == 0;
+}
+
+static int
+test_faultaround(void)
+{
+	enum { NPAGES = 1024 };
+	char *seq, *rev, *rnd;
+	long page_size = sysconf(_SC_PAGESIZE);
+	int nseq = 0, nrev = 0, nrnd = 0;
+
+	seq = mmap(NULL, NPAGES * page_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	rev = mmap(NULL, NPAGES * page_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	rnd = mmap(NULL, NPAGES * page_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (seq == MAP_FAILED || rev == MAP_FAILED || rnd == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = seq,
+		.fr_len = NPAGES * page_size,
+		.fr_act = { .fa_arg = &nseq },
+		.fr_resolve = resolve_rw,
+		.fr_window = 64
+	    }) != 0 || fault_register(&(struct faultregion) {
+		.fr_addr = rev,
+		.fr_len = NPAGES * page_size,
+		.fr_act = { .fa_arg = &nrev },
+		.fr_resolve = resolve_rw,
+		.fr_window = 64
+	    }) != 0 || fault_register(&(struct faultregion) {
+		.fr_addr = rnd,
+		.fr_len = NPAGES * page_size,
+		.fr_act = { .fa_arg = &nrnd },
+		.fr_resolve = resolve_rw,
+		.fr_window = 64
+	    }) != 0) {
+		perror("fault_register");
+		return -1;
+	}
+
+	for (int i = 0; i < NPAGES; i++)
+		seq[i * page_size] = 1;
+	for (int i = NPAGES - 1; i >= 0; i--)
+		rev[i * page_size] = 1;
+	for (int i = 0; i < 64; i++)
+		rnd[((i * 389) % NPAGES) * page_size] = 1;
+
+	printf("faultaround: sequential %d, reverse %d, random %d faults\n", nseq, nrev, nrnd);
+
+	fault_unregister(seq);
+	fault_unregister(rev);
+	fault_unregister(rnd);
+
+	return nseq < NPAGES / 16 && nrev < NPAGES / 16 && nrnd >= 32 ? 0 : -1;
+}
+
+static int
+test_arena(void)
+{
+	struct faultarena *fa;
+	size_t chunk = 16 * sysconf(_SC_PAGESIZE);
+	char *bufs[64];
+
+	if ((fa = fault_arena_create(1024 * chunk, chunk, FAULT_ARENA_ZERO)) == NULL) {
+		perror("fault_arena_create");
+		return -1;
+	}
+
+	for (int i = 0; i < 64; i++)
+		if ((bufs[i] = fault_arena_alloc(fa, chunk, chunk)) == NULL)
+			return -1;
+	if (fault_arena_committed(fa) != 0)
+		return -1;
+
+	/* touch every other buffer */
+	for (int i = 0; i < 64; i += 2)
+		bufs[i][chunk - 1] = bufs[i][0] = 1;
+	if (fault_arena_committed(fa) != 32 * chunk)
+		return -1;
+
+	if (fault_arena_decommit(fa, bufs[0], chunk) != 0 ||
+	    fault_arena_committed(fa) != 31 * chunk || bufs[0][0] != 0)
+		return -1;
+
+	/* everything is referenced now; only untouched chunks go cold */
+	if (fault_arena_trim(fa) != 0)
+		return -1;
+	for (int i = 0; i < 16; i += 2)
+		bufs[i][0] = 2;
+	if (fault_arena_trim(fa) != 24 || fault_arena_committed(fa) != 8 * chunk)
+		return -1;
+
+	fault_arena_destroy(fa);
+
+	return 0;
+}
+
+static atomic_int arenastop, arenalost;
+static atomic_ulong arenatrims;
+
+static void *
+arena_writer(void *arg)
+{
+	struct faultarena *fa = arg;
+	long page_size = sysconf(_SC_PAGESIZE);
+	volatile char *base = fault_arena_base(fa);
+	unsigned long written[64] = { 0 };
+
+	for (char k = 1; !atomic_load(&arenastop); k++) {
+		for (int c = 0; c < 64; c++) {
+			/*
+			 * A chunk may go cold and lose what was written once
+			 * two trims have come and gone since; not before.
+			 */
+			if (base[c * page_size] != (char) (k - 1) &&
+			    atomic_load(&arenatrims) < written[c] + 2)
+				atomic_fetch_add(&arenalost, 1);
+			base[c * page_size] = k;
+			written[c] = atomic_load(&arenatrims);
+		}
+		if (k % 4 == 0)
+			usleep(k % 16);
+	}
+
+	return NULL;
+}
+
+/*
+ * Trim an arena over and over while another thread keeps writing to it.
+ */
+static int
+test_arenarace(void)
+{
+	struct faultarena *fa;
+	pthread_t thr;
+	ssize_t trimmed = 0, n;
+
+	if ((fa = fault_arena_create(64 * sysconf(_SC_PAGESIZE), 0,
+	    FAULT_ARENA_ZERO)) == NULL)
+		return -1;
+	if (pthread_create(&thr, NULL, arena_writer, fa) != 0)
+		return -1;
+	for (int i = 0; i < 20000; i++) {
+		if ((n = fault_arena_trim(fa)) < 0)
+			return -1;
+		trimmed += n;
+		atomic_fetch_add(&arenatrims, 1);
+	}
+	atomic_store(&arenastop, 1);
+	pthread_join(thr, NULL);
+	fault_arena_destroy(fa);
+
+	printf("arenarace: %zd chunks trimmed, %d writes lost\n", trimmed,
+	    atomic_load(&arenalost));
+
+	return atomic_load(&arenalost) == 0 ? 0 : -1;
+}
+
+static int
+test_dirty(void)
+{
+	enum { NPAGES = 256 };
+	static const int backends[] = {
+		FAULT_DIRTY_MPROTECT, FAULT_DIRTY_SOFTDIRTY, FAULT_DIRTY_UFFD, FAULT_DIRTY_AUTO
+	};
+	long page_size = sysconf(_SC_PAGESIZE);
+	unsigned long bitmap[NPAGES / (sizeof(unsigned long) * 8)];
+
+	for (unsigned int b = 0; b < nitems(backends); b++) {
+		struct faultdirty *fd;
+		char *addr;
+		ssize_t page;
+		int n = 0;
+
+		addr = mmap(NULL, NPAGES * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (addr == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		memset(addr, 0, NPAGES * page_size);
+
+		if ((fd = fault_dirty_start(addr, NPAGES * page_size, backends[b])) == NULL) {
+			printf("dirty: backend %d unavailable\n", backends[b]);
+			continue;
+		}
+		printf("dirty: backend %d\n", fault_dirty_backend(fd));
+
+		for (int i = 3; i < NPAGES; i += 7)
+			addr[i * page_size + 5] = 1;
+		if (fault_dirty_collect(fd, bitmap, 1) != (NPAGES - 3 + 6) / 7)
+			return -1;
+		for (page = fault_dirty_next(bitmap, NPAGES, 0); page >= 0;
+		     page = fault_dirty_next(bitmap, NPAGES, page + 1), n++)
+			if (page % 7 != 3)
+				return -1;
+		if (n != (NPAGES - 3 + 6) / 7)
+			return -1;
+
+		/* a new interval only sees new writes */
+		addr[10 * page_size] = 1;
+		addr[NPAGES * page_size - 1] = 1;
+		if (fault_dirty_collect(fd, bitmap, 0) != 2 ||
+		    fault_dirty_next(bitmap, NPAGES, 0) != 10 ||
+		    fault_dirty_next(bitmap, NPAGES, 11) != NPAGES - 1)
+			return -1;
+
+		fault_dirty_stop(fd);
+		munmap(addr, NPAGES * page_size);
+	}
+
+	return 0;
+}
+
+static atomic_int dirtystop;
+
+static void *
+dirty_writer(void *arg)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	char *addr = arg;
+
+	for (uint64_t i = 1; !atomic_load(&dirtystop); i++)
+		*(volatile uint64_t *) (addr + i % 64 * page_size +
+		    i / 64 % 8 * sizeof(uint64_t)) = i;
+
+	return NULL;
+}
+
+/*
+ * Checkpoint a range while another thread keeps writing to it: copying
+ * out the pages each reset reports must never miss a write.
+ */
+static int
+test_dirtyrace(void)
+{
+	enum { NPAGES = 64 };
+	static const int backends[] = {
+		FAULT_DIRTY_MPROTECT, FAULT_DIRTY_UFFD, FAULT_DIRTY_AUTO
+	};
+	long page_size = sysconf(_SC_PAGESIZE);
+	unsigned long bitmap[NPAGES / (sizeof(unsigned long) * 8)];
+
+	for (unsigned int b = 0; b < nitems(backends); b++) {
+		struct faultdirty *fd;
+		pthread_t thr;
+		char *addr, *copy;
+		ssize_t page;
+
+		addr = mmap(NULL, NPAGES * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		copy = mmap(NULL, NPAGES * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (addr == MAP_FAILED || copy == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		memset(addr, 0, NPAGES * page_size);
+
+		if ((fd = fault_dirty_start(addr, NPAGES * page_size, backends[b])) == NULL) {
+			printf("dirtyrace: backend %d unavailable\n", backends[b]);
+			continue;
+		}
+
+		atomic_store(&dirtystop, 0);
+		if (pthread_create(&thr, NULL, dirty_writer, addr) != 0)
+			return -1;
+		for (int round = 0; round <= 200; round++) {
+			if (round == 200) {
+				atomic_store(&dirtystop, 1);
+				pthread_join(thr, NULL);
+			}
+			if (fault_dirty_collect(fd, bitmap, 1) < 0)
+				return -1;
+			for (page = fault_dirty_next(bitmap, NPAGES, 0); page >= 0;
+			     page = fault_dirty_next(bitmap, NPAGES, page + 1))
+				memcpy(copy + page * page_size, addr + page * page_size, page_size);
+		}
+		if (memcmp(copy, addr, NPAGES * page_size) != 0) {
+			printf("dirtyrace: backend %d lost a write\n", fault_dirty_backend(fd));
+			return -1;
+		}
+		printf("dirtyrace: backend %d\n", fault_dirty_backend(fd));
+
+		fault_dirty_stop(fd);
+		munmap(addr, NPAGES * page_size);
+		munmap(copy, NPAGES * page_size);
+	}
+
+	return 0;
+}
+
+static int
+test_stats(void)
+{
+	struct faultstats fs, all;
+	char *addr;
+	long page_size = sysconf(_SC_PAGESIZE);
+	int hits = 0;
+	uint64_t hist = 0;
+
+	addr = mmap(NULL, page_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	fault_stats_enable(1);
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+		.fa_fun = region_segv,
+		.fa_arg = &hits
+	}, NULL);
+	for (int i = 0; i < 100; i++) {
+		mprotect(addr, page_size, PROT_NONE);
+		addr[0] = 1;
+	}
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+		.fa_fun = segv,
+		.fa_arg = NULL
+	}, NULL);
+	for (int i = 0; i < 10; i++)
+		if (!sigsetjmp(env, 1))
+			(void) *(volatile char *) NULL;
+
+	fault_stats_enable(0);
+	addr[0] = 2;
+
+	if (fault_stats(region_segv, 0, &fs) != 0 || fault_stats(NULL, FAULT_STATS_THREAD, &all) != 0)
+		return -1;
+	for (int i = 0; i < FAULT_STATS_BUCKETS; i++)
+		hist += fs.fs_hist[i];
+
+	printf("stats: %llu faults, %llu retries, %llu ns; all: %llu faults, %llu escapes\n",
+	    (unsigned long long) fs.fs_faults, (unsigned long long) fs.fs_retries,
+	    (unsigned long long) fs.fs_ns, (unsigned long long) all.fs_faults,
+	    (unsigned long long) all.fs_escapes);
+
+	return fs.fs_faults == 100 && fs.fs_retries == 100 && fs.fs_escapes == 0 &&
+	    hist == 100 && all.fs_faults == 110 && all.fs_escapes == 10 ? 0 : -1;
+}
+
+static int
+test_trace(void)
+{
+	struct faulttracehdr hdr;
+	struct faultevent ev;
+	char *addr;
+	long page_size = sysconf(_SC_PAGESIZE);
+	int hits = 0, fd, retried = 0, escaped = 0;
+
+	addr = mmap(NULL, page_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	if (fault_trace_start("test.trace", 0) != 0) {
+		perror("fault_trace_start");
+		return -1;
+	}
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+		.fa_fun = region_segv,
+		.fa_arg = &hits
+	}, NULL);
+	for (int i = 0; i < 1000; i++) {
+		mprotect(addr, page_size, PROT_NONE);
+		addr[0] = 1;
+	}
+
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+		.fa_fun = segv,
+		.fa_arg = NULL
+	}, NULL);
+	if (!sigsetjmp(env, 1))
+		(void) *(volatile char *) NULL;
+
+	if (fault_trace_stop() != 0) {
+		perror("fault_trace_stop");
+		return -1;
+	}
+
+	if ((fd = open("test.trace", O_RDONLY)) < 0 ||
+	    read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.th_magic != FAULT_TRACE_MAGIC || hdr.th_evsize != sizeof(ev))
+		return -1;
+	while (read(fd, &ev, sizeof(ev)) == sizeof(ev)) {
+		if (ev.fe_result == FAULT_TRACE_RETRY && ev.fe_addr == (uintptr_t) addr)
+			retried++;
+		else if (ev.fe_result == FAULT_TRACE_ESCAPED && ev.fe_addr == 0)
+			escaped++;
+	}
+	close(fd);
+
+	return retried == 1000 && escaped == 1 ? 0 : -1;
+}
+
+static int
+test_probe(void)
+{
+	char *addr, buf[16];
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint32_t v32 = 0;
+	uint64_t v64 = 0;
+	int hits = 0;
+
+	addr = mmap(NULL, 3 * page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	memset(addr, 0x5a, 3 * page_size);
+	mprotect(addr + page_size, page_size, PROT_READ);
+	mprotect(addr + 2 * page_size, page_size, PROT_NONE);
+
+	if (fault_probe_init() != 0) {
+		perror("fault_probe_init");
+		return -1;
+	}
+
+	/* no handler installed, yet the process survives */
+	if (fault_fetch32(NULL, &v32) != -1 || fault_fetch64(BAD_ADDR, &v64) != -1)
+		return -1;
+	if (fault_fetch32(addr, &v32) != 0 || v32 != 0x5a5a5a5a ||
+	    fault_fetch64(addr + page_size, &v64) != 0 || v64 != 0x5a5a5a5a5a5a5a5aULL)
+		return -1;
+
+	if (fault_probe_read(addr, 2 * page_size) != 0 ||
+	    fault_probe_read(addr + 1, 3 * page_size - 1) != -1 ||
+	    fault_probe_read(NULL, 0) != 0)
+		return -1;
+
+	if (fault_probe_write(addr, page_size) != 0 ||
+	    fault_probe_write(addr + page_size - 1, 2) != -1 ||
+	    addr[0] != 0x5a || addr[page_size - 1] != 0x5a)
+		return -1;
+
+	memset(buf, 0, sizeof(buf));
+	if (fault_copy(buf, addr + page_size - 8, 16) != 0 || buf[15] != 0x5a ||
+	    fault_copy(buf, addr + 2 * page_size - 8, 16) != -1)
+		return -1;
+
+	/* a region handler gets to resolve the fault before the probe fails */
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = addr + 2 * page_size,
+		.fr_len = page_size,
+		.fr_act = { .fa_fun = region_segv, .fa_arg = &hits }
+	    }) != 0) {
+		perror("fault_register");
+		return -1;
+	}
+	if (fault_fetch32(addr + 2 * page_size, &v32) != 0 || v32 != 0x5a5a5a5a || hits != 1)
+		return -1;
+
+	return 0;
+}
+
+static int
+count_decline(int flt, const struct faultinfo *fi, void *arg)
+{
+	*(int *) arg += 1;
+
+	return 0;
+}
+
+/*
+ * What a JIT would emit for an implicit null check: load through p
+ * inside a small frame, and a landing pad that expects the frame gone.
+ */
+int
+fixup_load(const int *p);
+
+extern char fixup_load_insn[], fixup_load_end[], fixup_load_pad[];
+
+#if defined(__aarch64__)
+# define FIXUP_SP	16
+asm (
+	".text\n"
+	".p2align 2\n"
+	".globl " C(fixup_load) "\n"
+	C(fixup_load) ":\n"
+	"str	x19, [sp, #-16]!\n"
+	".globl " C(fixup_load_insn) "\n"
+	C(fixup_load_insn) ":\n"
+	"ldr	w0, [x0]\n"
+	".globl " C(fixup_load_end) "\n"
+	C(fixup_load_end) ":\n"
+	"ldr	x19, [sp], #16\n"
+	"ret\n"
+	".globl " C(fixup_load_pad) "\n"
+	C(fixup_load_pad) ":\n"
+	"mov	w0, #-1\n"
+	"ret\n"
+);
+#elif defined(__amd64__) || defined(__x86_64__)
+# define FIXUP_SP	8
+asm (
+	".text\n"
+	".globl " C(fixup_load) "\n"
+	C(fixup_load) ":\n"
+	"pushq	%rbx\n"
+	".globl " C(fixup_load_insn) "\n"
+	C(fixup_load_insn) ":\n"
+	"movl	(%rdi), %eax\n"
+	".globl " C(fixup_load_end) "\n"
+	C(fixup_load_end) ":\n"
+	"popq	%rbx\n"
+	"ret\n"
+	".globl " C(fixup_load_pad) "\n"
+	C(fixup_load_pad) ":\n"
+	"movl	$-1, %eax\n"
+	"ret\n"
+);
+#elif defined(__i386__)
+# define FIXUP_SP	4
+asm (
+	".text\n"
+	".globl " C(fixup_load) "\n"
+	C(fixup_load) ":\n"
+	"movl	4(%esp), %eax\n"
+	"pushl	%ebx\n"
+	".globl " C(fixup_load_insn) "\n"
+	C(fixup_load_insn) ":\n"
+	"movl	(%eax), %eax\n"
+	".globl " C(fixup_load_end) "\n"
+	C(fixup_load_end) ":\n"
+	"popl	%ebx\n"
+	"ret\n"
+	".globl " C(fixup_load_pad) "\n"
+	C(fixup_load_pad) ":\n"
+	"movl	$-1, %eax\n"
+	"ret\n"
+);
+#elif defined(__riscv64) || (defined(__riscv) && __riscv_xlen == 64)
+# define FIXUP_SP	16
+asm (
+	".text\n"
+	".globl " C(fixup_load) "\n"
+	C(fixup_load) ":\n"
+	"addi	sp, sp, -16\n"
+	".globl " C(fixup_load_insn) "\n"
+	C(fixup_load_insn) ":\n"
+	"lw	a0, 0(a0)\n"
+	".globl " C(fixup_load_end) "\n"
+	C(fixup_load_end) ":\n"
+	"addi	sp, sp, 16\n"
+	"ret\n"
+	".globl " C(fixup_load_pad) "\n"
+	C(fixup_load_pad) ":\n"
+	"li	a0, -1\n"
+	"ret\n"
+);
+#else
+# error "Unsupported architecture"
+#endif
+
+static int
+test_fixup(void)
+{
+	static const int one = 1;
+	static struct faultfixup tab[1];
+	int hits = 0;
+
+	tab[0] = (struct faultfixup) {
+		.ff_start = fixup_load_insn,
+		.ff_end = fixup_load_end,
+		.ff_fixup = fixup_load_pad,
+		.ff_sp = FIXUP_SP
+	};
+
+	if (fault_fixup_register(tab, 1) != 0) {
+		perror("fault_fixup_register");
+		return -1;
+	}
+	if (fault_fixup_register(tab, 1) != -1)
+		return -1;
+
+	if (fixup_load(&one) != 1 || fixup_load(NULL) != -1)
+		return -1;
+
+	/* the fixup wins over the process-wide handler */
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+		.fa_fun = count_decline,
+		.fa_arg = &hits
+	}, NULL);
+	if (fixup_load(BAD_ADDR) != -1 || hits != 0)
+		return -1;
+
+	if (fault_fixup_unregister(tab) != 0 || fault_fixup_unregister(tab) != -1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * A trap of each kind, with its length so that a handler can step over
+ * it, and a divide with a landing pad for when it traps.
+ */
+void	trap_ill(void);
+void	trap_brk(void);
+int	trap_div(int a, int b);
+
+extern char trap_ill_insn[], trap_brk_insn[], trap_div_insn[],
+    trap_div_end[], trap_div_pad[];
+
+#if defined(__aarch64__)
+# define TRAP_LEN	4
+# define TRAP_BRK_PC	0
+# define TRAP_BRK_LEN	4
+asm (
+	".text\n"
+	".p2align 2\n"
+	".globl " C(trap_ill) "\n"
+	C(trap_ill) ":\n"
+	".globl " C(trap_ill_insn) "\n"
+	C(trap_ill_insn) ":\n"
+	"udf	#0\n"
+	"ret\n"
+	".globl " C(trap_brk) "\n"
+	C(trap_brk) ":\n"
+	".globl " C(trap_brk_insn) "\n"
+	C(trap_brk_insn) ":\n"
+	"brk	#0\n"
+	"ret\n"
+	/* aarch64 divides by zero without trapping */
+	".globl " C(trap_div) "\n"
+	C(trap_div) ":\n"
+	".globl " C(trap_div_insn) "\n"
+	C(trap_div_insn) ":\n"
+	"sdiv	w0, w0, w1\n"
+	".globl " C(trap_div_end) "\n"
+	C(trap_div_end) ":\n"
+	"ret\n"
+	".globl " C(trap_div_pad) "\n"
+	C(trap_div_pad) ":\n"
+	"mov	w0, #-1\n"
+	"ret\n"
+);
+#elif defined(__amd64__) || defined(__x86_64__)
+# define TRAP_LEN	2
+# define TRAP_BRK_PC	1	/* int3 leaves the pc past itself */
+# define TRAP_BRK_LEN	1
+# define TRAP_DIV
+asm (
+	".text\n"
+	".globl " C(trap_ill) "\n"
+	C(trap_ill) ":\n"
+	".globl " C(trap_ill_insn) "\n"
+	C(trap_ill_insn) ":\n"
+	"ud2\n"
+	"ret\n"
+	".globl " C(trap_brk) "\n"
+	C(trap_brk) ":\n"
+	".globl " C(trap_brk_insn) "\n"
+	C(trap_brk_insn) ":\n"
+	"int3\n"
+	"ret\n"
+	".globl " C(trap_div) "\n"
+	C(trap_div) ":\n"
+	"movl	%edi, %eax\n"
+	"cltd\n"
+	".globl " C(trap_div_insn) "\n"
+	C(trap_div_insn) ":\n"
+	"idivl	%esi\n"
+	".globl " C(trap_div_end) "\n"
+	C(trap_div_end) ":\n"
+	"ret\n"
+	".globl " C(trap_div_pad) "\n"
+	C(trap_div_pad) ":\n"
+	"movl	$-1, %eax\n"
+	"ret\n"
+);
+#endif
+
+#if defined(TRAP_LEN)
+static int
+trap_skip(int flt, const struct faultinfo *fi, void *arg)
+{
+	int *hits = arg;
+
+	if (flt == FAULT_ILLEGAL_INSN && fi->fi_pc == trap_ill_insn) {
+		hits[flt]++;
+		return fault_resume(fi, trap_ill_insn + TRAP_LEN) == 0;
+	}
+	if (flt == FAULT_BREAKPOINT &&
+	    fi->fi_pc == trap_brk_insn + TRAP_BRK_PC) {
+		hits[flt]++;
+		return fault_resume(fi, trap_brk_insn + TRAP_BRK_LEN) == 0;
+	}
+
+	return 0;
+}
+#endif
+
+static int
+test_trap(void)
+{
+#if defined(TRAP_LEN)
+	static struct faultfixup tab[1];
+	int hits[FAULT_NKINDS] = { 0 };
+
+	if (fault(FAULT_NKINDS, &(struct faultaction) { 0 }, NULL) != -1 ||
+	    errno != EINVAL)
+		return -1;
+
+	fault_thread(FAULT_ILLEGAL_INSN, &(struct faultaction) {
+		.fa_fun = trap_skip,
+		.fa_arg = hits
+	}, NULL);
+	fault_thread(FAULT_BREAKPOINT, &(struct faultaction) {
+		.fa_fun = trap_skip,
+		.fa_arg = hits
+	}, NULL);
+	trap_ill();
+	trap_brk();
+	trap_ill();
+	if (hits[FAULT_ILLEGAL_INSN] != 2 || hits[FAULT_BREAKPOINT] != 1)
+		return -1;
+
+	/* a divide by zero goes to the landing pad, not the handler */
+	tab[0] = (struct faultfixup) {
+		.ff_start = trap_div_insn,
+		.ff_end = trap_div_end,
+		.ff_fixup = trap_div_pad
+	};
+	if (fault_fixup_register(tab, 1) != 0) {
+		perror("fault_fixup_register");
+		return -1;
+	}
+	fault(FAULT_ARITHMETIC, &(struct faultaction) {
+		.fa_fun = count_decline,
+		.fa_arg = &hits[FAULT_ARITHMETIC]
+	}, NULL);
+# if defined(TRAP_DIV)
+	if (trap_div(7, 2) != 3 || trap_div(7, 0) != -1 ||
+	    hits[FAULT_ARITHMETIC] != 0)
+		return -1;
+# else
+	if (trap_div(7, 2) != 3 || trap_div(7, 0) != 0)
+		return -1;
+# endif
+	fault(FAULT_ARITHMETIC, &(struct faultaction) { 0 }, NULL);
+	fault_fixup_unregister(tab);
+
+	fault_thread(FAULT_ILLEGAL_INSN, &(struct faultaction) { 0 }, NULL);
+	fault_thread(FAULT_BREAKPOINT, &(struct faultaction) { 0 }, NULL);
+#else
+	printf("trap: no traps to try on this architecture\n");
+#endif
+
+	return 0;
+}
+
+/*
+ * Service every access to a protected page from a shadow page instead.
+ */
+static int
+emulate_shadow(int flt, const struct faultinfo *fi, void *arg)
+{
+	char **pages = arg;
+	struct faultaccess fc;
+
+	if (fault_decode(fi, &fc) != 0) {
+		printf("emulate_shadow: %s at pc=%p\n", strerror(errno), fi->fi_pc);
+		exit(1);
+	}
+
+	return fault_emulate(fi, pages[1] + ((char *) fc.fc_addr - pages[0])) == 0;
+}
+
+static int
+test_emulate(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	char *pages[2], *volatile p;
+	volatile int64_t s64;
+	volatile uint64_t u64;
+	volatile uint32_t u32;
+	volatile uint16_t u16;
+	volatile uint8_t u8;
+	struct faultinfo fi = { 0 };
+
+#if !defined(__amd64__) && !defined(__x86_64__) && !defined(__aarch64__)
+	printf("emulation unavailable\n");
+	return 0;
+#endif
+	if (fault_decode(&fi, &(struct faultaccess) { 0 }) != -1 || errno != EINVAL)
+		return -1;
+
+	pages[0] = mmap(NULL, page_size, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	pages[1] = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (pages[0] == MAP_FAILED || pages[1] == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = pages[0],
+		.fr_len = page_size,
+		.fr_act = { .fa_fun = emulate_shadow, .fa_arg = pages }
+	    }) != 0) {
+		perror("fault_register");
+		return -1;
+	}
+
+	p = pages[0];
+	*(volatile uint8_t *) (p + 1) = 0x81;
+	*(volatile uint16_t *) (p + 2) = 0x8182;
+	*(volatile uint32_t *) (p + 4) = 0x81828384;
+	*(volatile uint64_t *) (p + 8) = 0x8182838485868788ULL;
+	if (memcmp(pages[1] + 1, "\x81\x82\x81\x84\x83\x82\x81"
+	    "\x88\x87\x86\x85\x84\x83\x82\x81", 15) != 0)
+		return -1;
+
+	for (int i = 16; i < 32; i++)
+		((volatile char *) p)[i] = i;
+	if (pages[1][16] != 16 || pages[1][31] != 31)
+		return -1;
+
+	u8 = *(volatile uint8_t *) (p + 1);
+	u16 = *(volatile uint16_t *) (p + 2);
+	u32 = *(volatile uint32_t *) (p + 4);
+	u64 = *(volatile uint64_t *) (p + 8);
+	s64 = *(volatile int8_t *) (p + 1);
+	if (u8 != 0x81 || u16 != 0x8182 || u32 != 0x81828384 ||
+	    u64 != 0x8182838485868788ULL || s64 != (int8_t) 0x81)
+		return -1;
+	s64 = *(volatile int32_t *) (p + 4);
+	if (s64 != (int32_t) 0x81828384)
+		return -1;
+
+	/* the page itself was never touched */
+	mprotect(pages[0], page_size, PROT_READ);
+	return pages[0][1] == 0 ? 0 : -1;
+}
+
+struct snapwriter {
+	pthread_t	 thread;
+	char		*addr;
+	size_t		 len;
+	atomic_int	*stop,
+			 started;
+};
+
+static void *
+snap_writer(void *arg)
+{
+	struct snapwriter *w = arg;
+
+	for (unsigned char gen = 1; !atomic_load(w->stop); gen++) {
+		for (size_t i = 0; i < w->len; i += 512)
+			((volatile char *) w->addr)[i] = gen;
+		atomic_store(&w->started, 1);
+	}
+
+	return NULL;
+}
+
+static int
+test_snap(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t npages = 256, len = npages * page_size;
+	struct faultsnap *sn;
+	struct snapwriter w;
+	atomic_int stop = 0;
+	char *addr, *buf;
+	int ok = 1;
+
+	addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (addr == MAP_FAILED || (buf = malloc(page_size)) == NULL) {
+		perror("mmap");
+		return -1;
+	}
+	for (size_t i = 0; i < npages; i++)
+		memset(addr + i * page_size, (int) (i & 0x7f) | 0x80, page_size);
+
+	if ((sn = fault_snap_create(addr, len)) == NULL) {
+		perror("fault_snap_create");
+		return -1;
+	}
+
+	w = (struct snapwriter) { .addr = addr, .len = len, .stop = &stop };
+	pthread_create(&w.thread, NULL, snap_writer, &w);
+	while (!atomic_load(&w.started))
+		sched_yield();
+
+	/* the snapshot holds still while the writer scribbles over the pages */
+	for (size_t i = 0; i < npages; i++) {
+		if (fault_snap_read(sn, i * page_size, buf, page_size) != 0) {
+			perror("fault_snap_read");
+			return -1;
+		}
+		for (long j = 0; j < page_size; j++)
+			if (buf[j] != (char) ((i & 0x7f) | 0x80))
+				ok = 0;
+		if (i % 2 == 0)
+			fault_snap_release(sn, i * page_size, page_size);
+	}
+
+	atomic_store(&stop, 1);
+	pthread_join(w.thread, NULL);
+
+	printf("snap: %zu pages copied\n", fault_snap_copied(sn));
+	if (fault_snap_copied(sn) == 0)
+		return -1;
+	if (fault_snap_read(sn, 0, buf, 1) != -1 || errno != ESTALE ||
+	    fault_snap_release(sn, 0, len) != 0 || fault_snap_copied(sn) != 0)
+		return -1;
+
+	fault_snap_destroy(sn);
+	addr[0] = 1;
+
+	return ok ? 0 : -1;
+}
+
+static char
+noise(uint64_t x)
+{
+	x = (x + 1) * 0x9e3779b97f4a7c15ULL;
+	x ^= x >> 31;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	return x >> 56;
+}
+
+static int
+test_comp(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t npages = 64;
+	struct faultcomp *fc;
+	struct faultcompstats cs;
+	char *addr;
+	ssize_t n;
+
+	if ((fc = fault_comp_create(npages * page_size)) == NULL) {
+		perror("fault_comp_create");
+		return -1;
+	}
+	addr = fault_comp_base(fc);
+
+	/* zero, same-filled, text and noise, a quarter each */
+	for (size_t i = 0; i < npages; i++) {
+		char *p = addr + i * page_size;
+
+		switch (i % 4) {
+		case 0:
+			break;
+		case 1:
+			memset(p, 0x5a, page_size);
+			break;
+		case 2:
+			for (long j = 0; j < page_size; j++)
+				p[j] = "fault handling, again and again. "[j % 33];
+			break;
+		case 3:
+			for (long j = 0; j < page_size; j++)
+				p[j] = noise(i * page_size + j);
+			break;
+		}
+	}
+
+	/* first scan only puts pages on probation; the second compresses */
+	if (fault_comp_scan(fc) != 0 || (n = fault_comp_scan(fc)) != (ssize_t) npages * 3 / 4)
+		return -1;
+
+	fault_comp_stats(fc, &cs);
+	printf("comp: %zu of %zu pages stored, %zu same-filled, %zu bytes\n",
+	    cs.cs_stored, cs.cs_pages, cs.cs_filled, cs.cs_bytes);
+	if (cs.cs_stored != npages * 3 / 4 || cs.cs_filled != npages / 2 ||
+	    cs.cs_bytes == 0 || cs.cs_bytes > npages / 4 * page_size / 4)
+		return -1;
+
+	for (size_t i = 0; i < npages; i++) {
+		char *p = addr + i * page_size;
+
+		for (long j = 0; j < page_size; j++) {
+			char c = i % 4 == 0 ? 0 : i % 4 == 1 ? 0x5a :
+			    i % 4 == 2 ? "fault handling, again and again. "[j % 33] :
+			    noise(i * page_size + j);
+
+			if (p[j] != c) {
+				printf("comp: page %zu byte %ld\n", i, j);
+				return -1;
+			}
+		}
+	}
+
+	fault_comp_stats(fc, &cs);
+	printf("comp: %llu decompressions, %llu ns\n",
+	    (unsigned long long) cs.cs_faults, (unsigned long long) cs.cs_ns);
+	if (cs.cs_stored != 0 || cs.cs_faults != npages * 3 / 4)
+		return -1;
+
+	fault_comp_destroy(fc);
+	return 0;
+}
+
+static struct faultguardreport
+lastguard;
+
+static void
+guard_caught(const struct faultguardreport *gr, void *arg)
+{
+	lastguard = *gr;
+
+	siglongjmp(env, 1);
+}
+
+static int
+guard_expect(struct faultguard *gu, int kind, char *p, ptrdiff_t off,
+    int freed)
+{
+	memset(&lastguard, 0, sizeof(lastguard));
+	if (!sigsetjmp(env, 1)) {
+		if (freed)
+			fault_guard_free(gu, p);
+		(void) *(volatile char *) (p + off);
+		return -1;
+	}
+
+	printf("guard: kind %d at %p, %zu bytes at %p, %d/%d frames\n",
+	    lastguard.gr_kind, lastguard.gr_addr, lastguard.gr_size,
+	    lastguard.gr_ptr, lastguard.gr_alloc.gt_nframes,
+	    lastguard.gr_free.gt_nframes);
+
+	return lastguard.gr_kind == kind && lastguard.gr_addr == p + off &&
+	    lastguard.gr_ptr == p && lastguard.gr_alloc.gt_nframes > 0 &&
+	    (lastguard.gr_free.gt_nframes > 0) == freed ? 0 : -1;
+}
+
+static void *
+guard_thread(void *arg)
+{
+	return fault_guard_malloc(arg, 64);
+}
+
+static int
+test_guard(void)
+{
+	struct faultguard *gu;
+	char *p, *q, *r, local;
+	size_t sampled = 0;
+
+	/* sample everything */
+	if ((gu = fault_guard_create(4, 1, guard_caught, NULL)) == NULL) {
+		perror("fault_guard_create");
+		return -1;
+	}
+
+	/* placement alternates between the start and the end of the page */
+	if ((p = fault_guard_malloc(gu, 32)) == NULL ||
+	    (q = fault_guard_malloc(gu, 48)) == NULL ||
+	    (r = fault_guard_malloc(gu, 16)) == NULL)
+		return -1;
+	memset(p, 1, 32);
+	memset(q, 2, 48);
+
+	if (guard_expect(gu, FAULT_GUARD_UNDERFLOW, p, -1, 0) != 0 ||
+	    guard_expect(gu, FAULT_GUARD_OVERFLOW, q, 48, 0) != 0 ||
+	    guard_expect(gu, FAULT_GUARD_USE_AFTER_FREE, r, 0, 1) != 0)
+		return -1;
+
+	if (fault_guard_free(gu, &local) != -1 ||
+	    fault_guard_free(gu, p) != 0 || fault_guard_free(gu, q) != 0)
+		return -1;
+	fault_guard_destroy(gu);
+
+	/* and now one in a hundred */
+	if ((gu = fault_guard_create(16, 100, NULL, NULL)) == NULL)
+		return -1;
+	for (int i = 0; i < 100000; i++) {
+		if ((p = fault_guard_malloc(gu, 64)) == NULL)
+			continue;
+		sampled++;
+		fault_guard_free(gu, p);
+	}
+	fault_guard_destroy(gu);
+
+	printf("guard: %zu of 100000 sampled\n", sampled);
+	if (sampled <= 500 || sampled >= 2000)
+		return -1;
+
+	/* a short-lived thread's first allocation is no more likely */
+	if ((gu = fault_guard_create(16, 1000, NULL, NULL)) == NULL)
+		return -1;
+	sampled = 0;
+	for (int i = 0; i < 100; i++) {
+		pthread_t thr;
+		void *res;
+
+		if (pthread_create(&thr, NULL, guard_thread, gu) != 0)
+			return -1;
+		pthread_join(thr, &res);
+		if (res != NULL) {
+			sampled++;
+			fault_guard_free(gu, res);
+		}
+	}
+	fault_guard_destroy(gu);
+	printf("guard: %zu of 100 first allocations sampled\n", sampled);
+
+	return sampled < 10 ? 0 : -1;
+}
+
+static ucontext_t
+maincontext, taskcontext;
+
+static int
+taskdepth, taskresult;
+
+__attribute__ ((noinline)) static int
+recurse(int n)
+{
+	volatile char frame[256];
+
+	frame[0] = n & 1;
+	if (n == 0)
+		return 0;
+	return recurse(n - 1) + frame[0];
+}
+
+static void
+task(void)
+{
+	taskresult = recurse(taskdepth);
+}
+
+static int
+run_task(struct faultstack *st, int depth)
+{
+	getcontext(&taskcontext);
+	taskcontext.uc_stack.ss_sp = fault_stack_base(st);
+	taskcontext.uc_stack.ss_size = fault_stack_size(st);
+	taskcontext.uc_link = &maincontext;
+	makecontext(&taskcontext, task, 0);
+
+	taskdepth = depth;
+	taskresult = -1;
+	swapcontext(&maincontext, &taskcontext);
+
+	return taskresult;
+}
+
+static int
+test_stack(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	struct faultstack *st, *many[10000];
+	size_t committed;
+
+	if ((st = fault_stack_create(1024 * 1024)) == NULL) {
+		perror("fault_stack_create");
+		return -1;
+	}
+	if (fault_stack_committed(st) != (size_t) page_size)
+		return -1;
+
+	/* a few hundred kilobytes deep */
+	if (run_task(st, 1000) != 500)
+		return -1;
+	committed = fault_stack_committed(st);
+	printf("stack: %zu bytes committed\n", committed);
+	if (committed < 1000 * 256 || committed > fault_stack_size(st))
+		return -1;
+
+	if (fault_stack_trim(st) != 0 ||
+	    fault_stack_committed(st) != (size_t) page_size ||
+	    run_task(st, 100) != 50)
+		return -1;
+
+	/* running into the guard page is still a fault */
+	if (!sigsetjmp(env, 1)) {
+		fault(FAULT_BAD_ACCESS, &(struct faultaction) {
+			.fa_fun = segv
+		}, NULL);
+		run_task(st, 100000);
+		return -1;
+	}
+	fault(FAULT_BAD_ACCESS, &(struct faultaction) { 0 }, NULL);
+	if ((char *) lastfault.fi_addr >= (char *) fault_stack_base(st) ||
+	    (char *) lastfault.fi_addr < (char *) fault_stack_base(st) - page_size)
+		return -1;
+	fault_stack_destroy(st);
+
+	/* lots of them, one page each */
+	for (size_t i = 0; i < nitems(many); i++) {
+		if ((many[i] = fault_stack_create(64 * 1024)) == NULL) {
+			perror("fault_stack_create");
+			return -1;
+		}
+	}
+	committed = 0;
+	for (size_t i = 0; i < nitems(many); i++) {
+		committed += fault_stack_committed(many[i]);
+		fault_stack_destroy(many[i]);
+	}
+	printf("stack: %zu stacks, %zu bytes committed\n", nitems(many),
+	    committed);
+
+	return committed == nitems(many) * page_size ? 0 : -1;
+}
+
+static int
+test_numa(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t npages = 256;
+	struct faultnuma *nm;
+	struct faultnumastats ns;
+	char *addr;
+
+	if ((nm = fault_numa_create(npages * page_size,
+	    FAULT_NUMA_MIGRATE)) == NULL) {
+		perror("fault_numa_create");
+		return -1;
+	}
+	addr = fault_numa_base(nm);
+
+	for (size_t i = 0; i < npages; i++)
+		addr[i * page_size] = i;
+	for (int round = 0; round < 4; round++) {
+		if (fault_numa_scan(nm, npages / 4) < 0)
+			return -1;
+		for (size_t i = 0; i < npages; i++)
+			if (addr[i * page_size] != (char) i)
+				return -1;
+	}
+
+	fault_numa_stats(nm, &ns);
+	printf("numa: %d nodes, %llu placed, %llu sampled, %llu migrated\n",
+	    ns.ns_nodes, (unsigned long long) ns.ns_placed,
+	    (unsigned long long) ns.ns_sampled,
+	    (unsigned long long) ns.ns_migrated);
+	fault_numa_destroy(nm);
+
+	/* one node: no faults at all */
+	if (ns.ns_nodes == 1)
+		return ns.ns_placed == 0 && ns.ns_sampled == 0 ? 0 : -1;
+
+	return ns.ns_placed == npages && ns.ns_sampled > 0 ? 0 : -1;
+}
+
+static int
+test_wss(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t npages = 1024, hot = npages / 4;
+	struct faultwss *ws;
+	struct faultwssstats wst;
+	char *addr;
+
+	addr = mmap(NULL, npages * page_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	for (size_t i = 0; i < npages; i++)
+		addr[i * page_size] = i;
+
+	if ((ws = fault_wss_start(addr, npages * page_size, 256, 0)) == NULL) {
+		perror("fault_wss_start");
+		return -1;
+	}
+
+	/* a quarter of the range stays hot */
+	for (int round = 0; round < 16; round++) {
+		for (size_t i = 0; i < hot; i++)
+			addr[i * page_size]++;
+		fault_wss_sample(ws);
+	}
+
+	fault_wss_stats(ws, &wst);
+	printf("wss: %llu of %zu bytes, %zu of %zu sampled pages touched\n",
+	    (unsigned long long) wst.wt_bytes, npages * page_size,
+	    wst.wt_touched, wst.wt_sampled);
+	printf("wss: heat");
+	for (int i = 0; i < FAULT_WSS_HEAT; i++)
+		printf(" %zu", wst.wt_heat[i]);
+	printf("\n");
+	fault_wss_stop(ws);
+
+	if (wst.wt_intervals != 16 || wst.wt_bytes < hot / 2 * page_size ||
+	    wst.wt_bytes > hot * 3 / 2 * page_size)
+		return -1;
+	for (int i = 1; i < FAULT_WSS_HEAT - 1; i++)
+		if (wst.wt_heat[i] != 0)
+			return -1;
+	if (wst.wt_heat[0] == 0 || wst.wt_heat[FAULT_WSS_HEAT - 1] == 0)
+		return -1;
+
+	for (size_t i = 0; i < npages; i++)
+		if (addr[i * page_size] != (char) (i + (i < hot ? 16 : 0)))
+			return -1;
+
+	/* and once more in the background */
+	if ((ws = fault_wss_start(addr, npages * page_size, 64, 5)) == NULL)
+		return -1;
+	for (int round = 0; round < 20; round++) {
+		for (size_t i = 0; i < hot; i++)
+			addr[i * page_size]++;
+		usleep(2000);
+	}
+	fault_wss_stats(ws, &wst);
+	fault_wss_stop(ws);
+	printf("wss: %llu intervals in the background\n",
+	    (unsigned long long) wst.wt_intervals);
+
+	return wst.wt_intervals > 0 ? 0 : -1;
+}
+
+struct granuleres {
+	size_t		 granule,
+			 calls;
+	int		 ok;
+};
+
+static int
+granule_resolve(void *addr, size_t len, void *arg)
+{
+	struct granuleres *gr = arg;
+
+	gr->calls++;
+	if ((uintptr_t) addr % gr->granule != 0 || len % gr->granule != 0)
+		gr->ok = 0;
+
+	return mprotect(addr, len, PROT_READ | PROT_WRITE) == 0;
+}
+
+static int
+test_granule(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t granules[] = { 64 * 1024, 2 * 1024 * 1024 }, len;
+	struct faultarena *fa;
+	char *addr;
+
+	for (size_t g = 0; g < nitems(granules); g++) {
+		struct granuleres gr = { granules[g], 0, 1 };
+
+		len = 16 * gr.granule;
+		if ((addr = fault_reserve(len, gr.granule)) == NULL) {
+			perror("fault_reserve");
+			return -1;
+		}
+		if ((uintptr_t) addr % gr.granule != 0)
+			return -1;
+
+		/* misaligned regions are turned away */
+		if (fault_register(&(struct faultregion) {
+			.fr_addr = addr + page_size,
+			.fr_len = gr.granule,
+			.fr_resolve = granule_resolve,
+			.fr_granule = gr.granule
+		    }) != -1 || errno != EINVAL)
+			return -1;
+
+		if (fault_register(&(struct faultregion) {
+			.fr_addr = addr,
+			.fr_len = len,
+			.fr_act = { .fa_arg = &gr },
+			.fr_resolve = granule_resolve,
+			.fr_window = 1,
+			.fr_granule = gr.granule
+		    }) != 0) {
+			perror("fault_register");
+			return -1;
+		}
+
+		/* one fault per granule, however many pages are touched */
+		for (size_t off = 0; off < len; off += page_size)
+			addr[off] = 1;
+		printf("granule: %zu KiB, %zu faults\n", gr.granule / 1024,
+		    gr.calls);
+		if (!gr.ok || gr.calls != 16)
+			return -1;
+
+		fault_unregister(addr);
+		munmap(addr, len);
+	}
+
+	if (fault_reserve(page_size, 3 * page_size) != NULL || errno != EINVAL)
+		return -1;
+
+	/* arenas with power-of-two chunks come aligned */
+	if ((fa = fault_arena_create(8 * granules[1], granules[1], 0)) == NULL)
+		return -1;
+	addr = fault_arena_base(fa);
+	addr[granules[1] + 1] = 1;
+	printf("granule: arena at %p, %zu committed\n", (void *) addr,
+	    fault_arena_committed(fa));
+	if ((uintptr_t) addr % granules[1] != 0 ||
+	    fault_arena_committed(fa) != granules[1])
+		return -1;
+	fault_arena_destroy(fa);
+
+	return 0;
+}
+
+static int
+test_file(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t npages = 16, len = npages * page_size;
+	char path[] = "/tmp/faultfile.XXXXXX", out[] = "/tmp/faultfile.XXXXXX",
+	    *buf;
+	struct faultfile *ff;
+	int fd, outfd;
+	ssize_t n;
+
+	if ((fd = mkstemp(path)) < 0 || (buf = malloc(len)) == NULL) {
+		perror("mkstemp");
+		return -1;
+	}
+	unlink(path);
+	for (size_t i = 0; i < len; i++)
+		buf[i] = noise(i);
+	if (write(fd, buf, len) != (ssize_t) len)
+		return -1;
+
+	if ((ff = fault_file_open(fd, 0, 4 * page_size)) == NULL) {
+		perror("fault_file_open");
+		return -1;
+	}
+
+	memset(buf, 0, len);
+	if (fault_file_read(ff, buf, len, 0) != (ssize_t) len ||
+	    fault_file_read(ff, buf, len, len) != 0)
+		return -1;
+	for (size_t i = 0; i < len; i++)
+		if (buf[i] != noise(i))
+			return -1;
+	if ((outfd = mkstemp(out)) < 0 ||
+	    fault_file_send(ff, outfd, len, 0) != (ssize_t) len)
+		return -1;
+	unlink(out);
+
+	/* cut the file short under the mapping: short reads, no SIGBUS */
+	if (ftruncate(fd, 4 * page_size + page_size / 2) != 0)
+		return -1;
+
+	n = fault_file_read(ff, buf, 4 * page_size, 3 * page_size);
+	printf("file: read %zd at page 3 of a file of 4.5 pages\n", n);
+	if (n != page_size + page_size / 2)
+		return -1;
+	for (long i = 0; i < page_size; i++)
+		if (buf[i] != noise(3 * page_size + i))
+			return -1;
+	if (fault_file_read(ff, buf, page_size, 8 * page_size) != 0)
+		return -1;
+	if (fault_file_check(ff, 0, len) != 4 * page_size + page_size / 2)
+		return -1;
+	n = fault_file_send(ff, outfd, len, page_size);
+	if (n < (ssize_t) (3 * page_size + page_size / 2) ||
+	    n > (ssize_t) (4 * page_size))
+		return -1;
+
+	/* a bad buffer is still the caller's problem */
+	if (fault_file_read(ff, BAD_ADDR, 16, 0) != -1 || errno != EFAULT)
+		return -1;
+
+	fault_file_close(ff);
+	close(outfd);
+	close(fd);
+	free(buf);
+
+	return 0;
+}
+
+struct spworker {
+	pthread_t		 thread;
+	struct faultsafepoint	*sf;
+	int			 id;
+	atomic_int		*stop;
+	atomic_ulong		 count;
+};
+
+static void *
+sp_worker(void *arg)
+{
+	struct spworker *w = arg;
+	const void *page = fault_safepoint_page(w->sf);
+
+	fault_safepoint_attach(w->sf, w);
+	while (!atomic_load_explicit(w->stop, memory_order_relaxed)) {
+		FAULT_SAFEPOINT_POLL(page);
+		atomic_fetch_add_explicit(&w->count, 1, memory_order_relaxed);
+
+		/* the first one spends most of its time blocked */
+		if (w->id == 0) {
+			fault_safepoint_block(w->sf);
+			usleep(100);
+			fault_safepoint_unblock(w->sf);
+		}
+	}
+	fault_safepoint_detach(w->sf);
+
+	return NULL;
+}
+
+static int
+sp_check(void *thread, const struct faultinfo *fi, void *arg)
+{
+	struct spworker *w = thread;
+	int *parked = arg;
+
+	if (fi != NULL) {
+		if (fi->fi_addr != fault_safepoint_page(w->sf) ||
+		    (fi->fi_ctx == NULL && !(fi->fi_flags & FI_UFFD)))
+			return -1;
+		(*parked)++;
+	}
+
+	return 0;
+}
+
+static int
+test_safepoint(void)
+{
+	struct spworker w[4];
+	struct faultsafepoint *sf;
+	struct faultsafepointstats ps;
+	atomic_int stop = 0;
+	unsigned long before[nitems(w)];
+	int parked = 0;
+
+	if ((sf = fault_safepoint_create()) == NULL) {
+		perror("fault_safepoint_create");
+		return -1;
+	}
+	/* not attached: polls are just loads */
+	FAULT_SAFEPOINT_POLL(fault_safepoint_page(sf));
+
+	for (int i = 0; i < (int) nitems(w); i++) {
+		w[i].sf = sf;
+		w[i].id = i;
+		w[i].stop = &stop;
+		atomic_init(&w[i].count, 0);
+		pthread_create(&w[i].thread, NULL, sp_worker, &w[i]);
+	}
+
+	for (int round = 0; round < 50; round++) {
+		usleep(1000);
+		if (fault_safepoint_arm(sf) != 0) {
+			perror("fault_safepoint_arm");
+			return -1;
+		}
+
+		if (fault_safepoint_threads(sf, sp_check, &parked) != 0)
+			return -1;
+		for (unsigned int i = 0; i < nitems(w); i++)
+			before[i] = atomic_load(&w[i].count);
+		usleep(200);
+
+		/* nobody moves while it is armed */
+		for (unsigned int i = 0; i < nitems(w); i++)
+			if (atomic_load(&w[i].count) != before[i])
+				return -1;
+
+		if (fault_safepoint_disarm(sf) != 0)
+			return -1;
+	}
+
+	atomic_store(&stop, 1);
+	for (unsigned int i = 0; i < nitems(w); i++) {
+		pthread_join(w[i].thread, NULL);
+		if (atomic_load(&w[i].count) == 0)
+			return -1;
+	}
+
+	fault_safepoint_stats(sf, &ps);
+	printf("safepoint: %llu safepoints, %llu parks, "
+	    "arm to stopped %llu ns on average, %llu ns at most\n",
+	    (unsigned long long) ps.ps_safepoints,
+	    (unsigned long long) ps.ps_parks,
+	    (unsigned long long) (ps.ps_ns / ps.ps_safepoints),
+	    (unsigned long long) ps.ps_maxns);
+	if (ps.ps_safepoints != 50 || ps.ps_parks == 0 || parked == 0)
+		return -1;
+
+	fault_safepoint_destroy(sf);
+
+	return 0;
+}
+
+static int
+pagesbad = 0;
+
+static int
+pages_fault(int flt, const struct faultinfo *fi, void *arg)
+{
+	struct faultpages *pt = arg;
+	int state = fault_pages_get(pt, fi->fi_addr);
+
+	/* declined either way; the probe fails */
+	if ((state & FAULT_PAGES_PENDING) || state == FAULT_PAGES_WRITE)
+		pagesbad++;
+
+	return 0;
+}
+
+static int
+test_pages(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t npages = 256, len = npages * page_size;
+	struct faultpages *pt;
+	struct faultpagesstats pg;
+	char *addr;
+	uint64_t calls = 0;
+
+	addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	if ((pt = fault_pages_create(addr, len, FAULT_PAGES_WRITE)) == NULL) {
+		perror("fault_pages_create");
+		return -1;
+	}
+	if (fault_probe_init() != 0 || fault_register(&(struct faultregion) {
+		.fr_addr = addr,
+		.fr_len = len,
+		.fr_act = { .fa_fun = pages_fault, .fa_arg = pt }
+	    }) != 0)
+		return -1;
+
+	/* a page at a time, applied in one go */
+	for (size_t i = 0; i < 32; i++)
+		fault_pages_set(pt, addr + i * page_size, page_size,
+		    FAULT_PAGES_NONE);
+	if (fault_pages_get(pt, addr) !=
+	    (FAULT_PAGES_NONE | FAULT_PAGES_PENDING) ||
+	    fault_probe_write(addr, 1) != 0)
+		return -1;
+	if (fault_pages_flush(pt) != 32 ||
+	    fault_pages_get(pt, addr) != FAULT_PAGES_NONE ||
+	    fault_pages_get(pt, addr + 32 * page_size) != FAULT_PAGES_WRITE ||
+	    fault_pages_get(pt, addr + len) != -1)
+		return -1;
+	fault_pages_stats(pt, &pg);
+	if (pg.pg_calls - calls != 1)
+		return -1;
+	calls = pg.pg_calls;
+
+	/* two runs to different states; a change undone costs nothing */
+	fault_pages_set(pt, addr + 32 * page_size, 8 * page_size,
+	    FAULT_PAGES_READ);
+	fault_pages_set(pt, addr + 50 * page_size, 10 * page_size,
+	    FAULT_PAGES_NONE);
+	fault_pages_set(pt, addr + 5 * page_size, page_size,
+	    FAULT_PAGES_READ);
+	fault_pages_set(pt, addr + 5 * page_size, page_size,
+	    FAULT_PAGES_NONE);
+	if (fault_pages_flush(pt) != 18)
+		return -1;
+	fault_pages_stats(pt, &pg);
+	if (pg.pg_calls - calls != 2)
+		return -1;
+	calls = pg.pg_calls;
+
+	/* a run carries on over pages that are already right */
+	fault_pages_set(pt, addr + 70 * page_size, page_size,
+	    FAULT_PAGES_NONE);
+	fault_pages_flush(pt);
+	fault_pages_set(pt, addr + 69 * page_size, page_size,
+	    FAULT_PAGES_NONE);
+	fault_pages_set(pt, addr + 71 * page_size, page_size,
+	    FAULT_PAGES_NONE);
+	if (fault_pages_flush(pt) != 2)
+		return -1;
+	fault_pages_stats(pt, &pg);
+	if (pg.pg_calls - calls != 2)
+		return -1;
+
+	for (size_t i = 0; i < npages; i++) {
+		int state = fault_pages_get(pt, addr + i * page_size);
+
+		if (fault_probe_read(addr + i * page_size, 1) !=
+		    (state == FAULT_PAGES_NONE ? -1 : 0) ||
+		    fault_probe_write(addr + i * page_size, 1) !=
+		    (state == FAULT_PAGES_WRITE ? 0 : -1))
+			return -1;
+	}
+	if (pagesbad != 0)
+		return -1;
+	printf("pages: %llu changes queued, %llu pages changed "
+	    "in %llu calls\n", (unsigned long long) pg.pg_queued,
+	    (unsigned long long) pg.pg_changed,
+	    (unsigned long long) pg.pg_calls);
+
+	fault_unregister(addr);
+	fault_pages_destroy(pt);
+	munmap(addr, len);
+
+	return 0;
+}
+
+#define COMPACT_PAGES	32	/* touched by the mutator */
+#define COMPACT_SELECT	16	/* evacuated */
+#define COMPACT_STRIDE	64	/* objects per page */
+
+static struct {
+	char			*heap,
+				*to;
+	atomic_size_t		 next;
+	char			*fwd[COMPACT_SELECT];
+	size_t			 pagesz;
+	atomic_int		 stop;
+	atomic_ulong		 rounds;
+	atomic_int		 hold,		/* keep copying the first page */
+				 holding;
+	uint64_t		 counts[COMPACT_PAGES * COMPACT_STRIDE];
+} compacttest;
+
+/* every object on the page is live: move the page as it is */
+static int
+compact_copy(const void *alias, void *page, size_t len, void *arg)
+{
+	char *to = compacttest.to + atomic_fetch_add(&compacttest.next, len);
+
+	if (page == compacttest.heap && atomic_load(&compacttest.hold)) {
+		atomic_store(&compacttest.holding, 1);
+		while (atomic_load(&compacttest.hold))
+			sched_yield();
+	}
+	memcpy(to, alias, len);
+	compacttest.fwd[((char *) page - compacttest.heap) / len] = to;
+
+	return 0;
+}
+
+static void *
+compact_forward(const void *addr, void *arg)
+{
+	size_t off = (const char *) addr - compacttest.heap;
+
+	return compacttest.fwd[off / compacttest.pagesz] +
+	    off % compacttest.pagesz;
+}
+
+static void *
+compact_mutator(void *arg)
+{
+	size_t nobj = COMPACT_PAGES * COMPACT_STRIDE,
+	    step = compacttest.pagesz / COMPACT_STRIDE / sizeof(uint64_t);
+	volatile uint64_t *objs = (volatile uint64_t *) compacttest.heap;
+
+	while (!atomic_load(&compacttest.stop)) {
+		for (size_t i = 0; i < nobj; i++) {
+			objs[i * step] = objs[i * step] + 1;
+			compacttest.counts[i]++;
+		}
+		atomic_fetch_add(&compacttest.rounds, 1);
+	}
+
+	return NULL;
+}
+
+static int
+test_compact(void)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE),
+	    step = page_size / COMPACT_STRIDE / sizeof(uint64_t);
+	struct faultcompact *cm;
+	struct faultcompactstats ct;
+	pthread_t thr;
+	uint64_t *objs;
+	unsigned long rounds;
+	ssize_t copied;
+
+#if !defined(__amd64__) && !defined(__x86_64__) && !defined(__aarch64__)
+	printf("emulation unavailable\n");
+	return 0;
+#endif
+	compacttest.pagesz = page_size;
+	compacttest.to = mmap(NULL, COMPACT_SELECT * page_size,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (compacttest.to == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	if ((cm = fault_compact_create(COMPACT_PAGES * page_size,
+	    &(struct faultcompactops) {
+		.co_copy = compact_copy,
+		.co_forward = compact_forward
+	    }, NULL)) == NULL) {
+		perror("fault_compact_create");
+		return -1;
+	}
+	objs = fault_compact_base(cm);
+	compacttest.heap = (char *) objs;
+	if (fault_compact_assist(cm, objs) != -1 || errno != EINVAL ||
+	    fault_compact_forward(cm, objs) != objs)
+		return -1;
+
+	if (pthread_create(&thr, NULL, compact_mutator, NULL) != 0)
+		return -1;
+	while (atomic_load(&compacttest.rounds) < 2)
+		sched_yield();
+
+	/* the mutator copies a page or two itself before the collector starts */
+	if (fault_compact_select(cm, objs, COMPACT_SELECT * page_size) !=
+	    COMPACT_SELECT)
+		return -1;
+	do
+		fault_compact_stats(cm, &ct);
+	while (ct.ct_assists == 0);
+	if ((copied = fault_compact_evacuate(cm, objs,
+	    COMPACT_SELECT * page_size)) < 0)
+		return -1;
+
+	/* then keeps going on the new copies */
+	rounds = atomic_load(&compacttest.rounds);
+	while (atomic_load(&compacttest.rounds) < rounds + 2)
+		sched_yield();
+	atomic_store(&compacttest.stop, 1);
+	pthread_join(thr, NULL);
+
+	fault_compact_stats(cm, &ct);
+	if (ct.ct_copied != (uint64_t) copied ||
+	    ct.ct_copied + ct.ct_assists != COMPACT_SELECT ||
+	    ct.ct_evacuated != COMPACT_SELECT || ct.ct_selected != 0 ||
+	    ct.ct_forwarded == 0)
+		return -1;
+	for (size_t i = 0; i < COMPACT_PAGES * COMPACT_STRIDE; i++) {
+		uint64_t *obj = fault_compact_forward(cm, &objs[i * step]);
+
+		if (obj == NULL || *obj != compacttest.counts[i] ||
+		    (i < COMPACT_SELECT * COMPACT_STRIDE) != (obj != &objs[i * step]))
+			return -1;
+	}
+
+	if (fault_compact_release(cm, objs, COMPACT_PAGES * page_size) !=
+	    COMPACT_SELECT)
+		return -1;
+#if defined(MADV_REMOVE)
+	if (objs[0] != 0)
+		return -1;
+#endif
+	objs[0] = 1;
+	fault_compact_stats(cm, &ct);
+	if (ct.ct_evacuated != 0)
+		return -1;
+	printf("compact: %zu pages evacuated, %llu by the mutator, "
+	    "%llu accesses forwarded\n", (size_t) COMPACT_SELECT,
+	    (unsigned long long) ct.ct_assists,
+	    (unsigned long long) ct.ct_forwarded);
+
+	fault_compact_destroy(cm);
+	munmap(compacttest.to, COMPACT_SELECT * page_size);
+
+	return 0;
+}
+
+static void *
+compact_toucher(void *arg)
+{
+	volatile uint64_t *obj = arg;
+
+	*obj = *obj + 1;
+
+	return NULL;
+}
+
+/*
+ * Release a range while a mutator is still copying one of its pages:
+ * that page is left alone, and released once it has been evacuated.
+ */
+static int
+test_compactrelease(void)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	struct faultcompact *cm;
+	struct faultcompactstats ct;
+	pthread_t thr;
+	uint64_t *objs, *obj;
+
+#if !defined(__amd64__) && !defined(__x86_64__) && !defined(__aarch64__)
+	printf("emulation unavailable\n");
+	return 0;
+#endif
+	compacttest.pagesz = page_size;
+	compacttest.to = mmap(NULL, COMPACT_SELECT * page_size,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (compacttest.to == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	if ((cm = fault_compact_create(4 * page_size,
+	    &(struct faultcompactops) {
+		.co_copy = compact_copy,
+		.co_forward = compact_forward
+	    }, NULL)) == NULL) {
+		perror("fault_compact_create");
+		return -1;
+	}
+	objs = fault_compact_base(cm);
+	compacttest.heap = (char *) objs;
+	objs[0] = 7;
+	objs[page_size / sizeof(uint64_t)] = 9;
+
+	if (fault_compact_select(cm, objs, 2 * page_size) != 2)
+		return -1;
+	atomic_store(&compacttest.hold, 1);
+	if (pthread_create(&thr, NULL, compact_toucher, objs) != 0)
+		return -1;
+	while (!atomic_load(&compacttest.holding))
+		sched_yield();
+
+	/* the second page goes; the first is still being copied */
+	if (fault_compact_evacuate(cm, (char *) objs + page_size,
+	    page_size) != 1 ||
+	    fault_compact_release(cm, objs, 4 * page_size) != 1)
+		return -1;
+	fault_compact_stats(cm, &ct);
+	if (ct.ct_selected != 1 || ct.ct_evacuated != 0)
+		return -1;
+
+	atomic_store(&compacttest.hold, 0);
+	pthread_join(thr, NULL);
+	if ((obj = fault_compact_forward(cm, objs)) == NULL || obj == objs ||
+	    *obj != 8 ||
+	    fault_compact_release(cm, objs, 4 * page_size) != 1)
+		return -1;
+#if defined(MADV_REMOVE)
+	if (objs[0] != 0)
+		return -1;
+#endif
+	objs[0] = 1;
+	fault_compact_stats(cm, &ct);
+	if (ct.ct_selected != 0 || ct.ct_evacuated != 0 ||
+	    ct.ct_assists != 1 || ct.ct_copied != 1)
+		return -1;
+
+	fault_compact_destroy(cm);
+	munmap(compacttest.to, COMPACT_SELECT * page_size);
+
+	return 0;
+}
+
 static struct {
 	const char	*name;
 	int		(*fun)(void);
@@ -292,6 +2480,33 @@ static struct {
 	{ "bad",	test_bad },
 	{ "unaligned",	test_unaligned },
 	{ "retry",	test_retry },
+	{ "region",	test_region },
+	{ "regions",	test_regions },
+	{ "thread",	test_thread },
+	{ "uffd",	test_uffd },
+	{ "faultaround", test_faultaround },
+	{ "arena",	test_arena },
+	{ "arenarace",	test_arenarace },
+	{ "dirty",	test_dirty },
+	{ "dirtyrace",	test_dirtyrace },
+	{ "stats",	test_stats },
+	{ "trace",	test_trace },
+	{ "probe",	test_probe },
+	{ "fixup",	test_fixup },
+	{ "trap",	test_trap },
+	{ "emulate",	test_emulate },
+	{ "snap",	test_snap },
+	{ "comp",	test_comp },
+	{ "guard",	test_guard },
+	{ "stack",	test_stack },
+	{ "numa",	test_numa },
+	{ "wss",	test_wss },
+	{ "granule",	test_granule },
+	{ "file",	test_file },
+	{ "safepoint",	test_safepoint },
+	{ "pages",	test_pages },
+	{ "compact",	test_compact },
+	{ "compactrelease", test_compactrelease },
 };
 
 int
@@ -0,0 +1,163 @@
+#include "fault.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+static long
+page_size = sysconf(_SC_PAGESIZE);
+
+static char *
+map(int prot)
+{
+	void *p = mmap(nullptr, page_size, prot, MAP_PRIVATE | MAP_ANON, -1, 0);
+
+	return p == MAP_FAILED ? nullptr : static_cast<char *>(p);
+}
+
+static int
+test_thread()
+{
+	char *page = map(PROT_NONE);
+	int faults = 0;
+
+	if (page == nullptr)
+		return -1;
+
+	{
+		libfault::scoped_thread_handler guard(
+		    [&](int, const struct faultinfo &fi) {
+			faults++;
+			return fi.fi_addr == page && mprotect(page, page_size,
+			    PROT_READ | PROT_WRITE) == 0;
+		});
+
+		page[0] = 1;
+	}
+
+	/* the guard is gone, and so is its handler */
+	struct faultaction act;
+	fault_thread(FAULT_BAD_ACCESS, nullptr, &act);
+
+	munmap(page, page_size);
+	return faults == 1 && act.fa_fun == nullptr ? 0 : -1;
+}
+
+static int
+test_region()
+{
+	char *page = map(PROT_NONE);
+	size_t resolved = 0;
+
+	if (page == nullptr)
+		return -1;
+
+	{
+		libfault::scoped_region region(page, page_size,
+		    [&](int, const struct faultinfo &) {
+			resolved++;
+			return mprotect(page, page_size, PROT_READ) == 0;
+		});
+
+		if (page[0] != 0)
+			return -1;
+	}
+
+	/* unregistered again */
+	if (fault_unregister(page) != -1)
+		return -1;
+
+	munmap(page, page_size);
+	return resolved == 1 ? 0 : -1;
+}
+
+static int
+test_guarded()
+{
+	char *page = map(PROT_NONE);
+	int reached = 0;
+
+	if (page == nullptr)
+		return -1;
+
+	/* the first faults, the second does not, and both leave no trace */
+	if (libfault::guarded([&] {
+		reached = 1;
+		(void) *(volatile char *) page;
+		reached = 2;
+	    }))
+		return -1;
+	if (!libfault::guarded([&] { reached += 10; }))
+		return -1;
+	if (libfault::guarded([&] { *(volatile char *) page = 1; }))
+		return -1;
+
+	munmap(page, page_size);
+	return reached == 11 ? 0 : -1;
+}
+
+static int
+test_probe()
+{
+	char *page = map(PROT_READ | PROT_WRITE);
+	char *none = map(PROT_NONE);
+	uint64_t val = 0x0123456789abcdef;
+
+	if (page == nullptr || none == nullptr)
+		return -1;
+
+	if (!libfault::store(reinterpret_cast<uint64_t *>(page), val) ||
+	    libfault::load(reinterpret_cast<const uint64_t *>(page)) != val)
+		return -1;
+	if (libfault::store(reinterpret_cast<uint64_t *>(none), val) ||
+	    libfault::load(reinterpret_cast<const uint64_t *>(none)).has_value())
+		return -1;
+
+	munmap(page, page_size);
+	munmap(none, page_size);
+	return 0;
+}
+
+static const struct {
+	const char	*name;
+	int		(*fun)();
+} tests[] = {
+	{ "thread",	test_thread },
+	{ "region",	test_region },
+	{ "guarded",	test_guarded },
+	{ "probe",	test_probe },
+};
+
+int
+main(int argc, const char *argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s name\n\n", argv[0]);
+
+		fprintf(stderr, "Available tests:\n");
+		for (const auto &t : tests)
+			fprintf(stderr, "\t%s\n", t.name);
+
+		return 1;
+	}
+
+	for (const auto &t : tests) {
+		if (strcmp(t.name, argv[1]) == 0) {
+			if (t.fun() != 0) {
+				fprintf(stderr, "%s: test `%s` failed\n", argv[0], argv[1]);
+				return 1;
+			}
+
+			printf("%s: test `%s' successful\n", argv[0], argv[1]);
+
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "%s: unknown test `%s'\n", argv[0], argv[1]);
+
+	return 1;
+}
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2022 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Working set estimation.  Every interval a random sample of pages is
+ * made PROT_NONE; the first access to a sampled page lets it back in and
+ * marks it touched.  At the end of the interval the pages that were not
+ * touched are let back in too, and the share that was touched, scaled up
+ * to the whole range, is the estimate.  Each page also keeps a history of
+ * its last eight samples for the heat histogram.
+ *
+ *	IDLE -> SAMPLED -> BUSY -> TOUCHED -> IDLE	(accessed)
+ *	IDLE -> SAMPLED -> BUSY -> IDLE			(not accessed)
+ *
+ * A fault costs one mprotect; an interval costs two per sampled page at
+ * most, whatever the size of the range.
+ */
+
+#include "fault.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#define WSS_IDLE	0
+#define WSS_SAMPLED	1
+#define WSS_BUSY	2
+#define WSS_TOUCHED	3
+
+#define WSS_HISTORY	8
+
+struct wsspage {
+	atomic_uchar		 wp_state;
+	uint8_t			 wp_hist,	/* one bit per sample, newest low */
+				 wp_nsamples;
+};
+
+struct faultwss {
+	char			*ws_base;
+	size_t			 ws_len,
+				 ws_npages,
+				 ws_pagesz,
+				 ws_nsample;
+	unsigned int		 ws_interval;	/* ms, or 0 for by hand */
+	struct wsspage		*ws_pages;
+	size_t			*ws_sample;
+	size_t			 ws_nsampled;
+	uint64_t		 ws_rand;
+	pthread_mutex_t		 ws_lock;
+	pthread_cond_t		 ws_cond;
+	pthread_t		 ws_thread;
+	int			 ws_stop;
+	struct faultwssstats	 ws_stats;
+	atomic_uint_least64_t	 ws_faults;
+};
+
+static int
+wss_fault(int flt, const struct faultinfo *fi, void *arg)
+{
+	struct faultwss *ws = arg;
+	size_t page = ((char *) fi->fi_addr - ws->ws_base) / ws->ws_pagesz;
+	struct wsspage *wp = &ws->ws_pages[page];
+	unsigned char st = WSS_SAMPLED;
+
+	if (atomic_compare_exchange_strong(&wp->wp_state, &st, WSS_BUSY)) {
+		if (mprotect(ws->ws_base + page * ws->ws_pagesz, ws->ws_pagesz,
+		    PROT_READ | PROT_WRITE) != 0) {
+			atomic_store(&wp->wp_state, WSS_SAMPLED);
+			return 0;
+		}
+		atomic_fetch_add(&ws->ws_faults, 1);
+		atomic_store(&wp->wp_state, WSS_TOUCHED);
+		return 1;
+	}
+
+	/* let in by another thread, or by the end of the interval */
+	while (atomic_load(&wp->wp_state) == WSS_BUSY)
+		sched_yield();
+
+	return 1;
+}
+
+static uint64_t
+wss_rand(struct faultwss *ws)
+{
+	ws->ws_rand ^= ws->ws_rand << 13;
+	ws->ws_rand ^= ws->ws_rand >> 7;
+	ws->ws_rand ^= ws->ws_rand << 17;
+
+	return ws->ws_rand;
+}
+
+/*
+ * Close the interval: score and let in the last sample, then take the
+ * next one.  Called with ws_lock held.
+ */
+static void
+wss_tick(struct faultwss *ws)
+{
+	size_t touched = 0;
+
+	for (size_t i = 0; i < ws->ws_nsampled; i++) {
+		size_t page = ws->ws_sample[i];
+		struct wsspage *wp = &ws->ws_pages[page];
+		unsigned char st = WSS_SAMPLED;
+		int hit;
+
+		/* wait out a handler letting it in; it ends up TOUCHED */
+		while (!atomic_compare_exchange_weak(&wp->wp_state, &st,
+		    st == WSS_TOUCHED ? WSS_IDLE : WSS_BUSY)) {
+			if (st == WSS_BUSY) {
+				sched_yield();
+				st = atomic_load(&wp->wp_state);
+			}
+		}
+		if (st == WSS_SAMPLED) {
+			mprotect(ws->ws_base + page * ws->ws_pagesz,
+			    ws->ws_pagesz, PROT_READ | PROT_WRITE);
+			atomic_store(&wp->wp_state, WSS_IDLE);
+			hit = 0;
+		} else {
+			hit = 1;
+			touched++;
+		}
+
+		wp->wp_hist = wp->wp_hist << 1 | hit;
+		if (wp->wp_nsamples < WSS_HISTORY)
+			wp->wp_nsamples++;
+	}
+
+	if (ws->ws_nsampled > 0) {
+		ws->ws_stats.wt_sampled = ws->ws_nsampled;
+		ws->ws_stats.wt_touched = touched;
+		ws->ws_stats.wt_bytes = (uint64_t) touched * ws->ws_npages /
+		    ws->ws_nsampled * ws->ws_pagesz;
+		ws->ws_stats.wt_intervals++;
+	}
+
+	/* duplicates are dropped, so a sample may come out a little short */
+	ws->ws_nsampled = 0;
+	for (size_t i = 0; i < ws->ws_nsample; i++) {
+		size_t page = wss_rand(ws) % ws->ws_npages;
+		struct wsspage *wp = &ws->ws_pages[page];
+
+		if (atomic_load(&wp->wp_state) != WSS_IDLE)
+			continue;
+		atomic_store(&wp->wp_state, WSS_SAMPLED);
+		if (mprotect(ws->ws_base + page * ws->ws_pagesz,
+		    ws->ws_pagesz, PROT_NONE) != 0) {
+			atomic_store(&wp->wp_state, WSS_IDLE);
+			continue;
+		}
+		ws->ws_sample[ws->ws_nsampled++] = page;
+	}
+}
+
+static void *
+wss_main(void *arg)
+{
+	struct faultwss *ws = arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&ws->ws_lock);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	while (!ws->ws_stop) {
+		ts.tv_sec += ws->ws_interval / 1000;
+		ts.tv_nsec += (long) (ws->ws_interval % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		while (!ws->ws_stop && pthread_cond_timedwait(&ws->ws_cond,
+		    &ws->ws_lock, &ts) != ETIMEDOUT)
+			;
+		if (!ws->ws_stop)
+			wss_tick(ws);
+	}
+	pthread_mutex_unlock(&ws->ws_lock);
+
+	return NULL;
+}
+
+/*
+ * Estimate the working set of [addr, addr + len), which must be readable
+ * and writable and must not overlap another region, from nsample pages
+ * every interval milliseconds.  With an interval of zero, intervals are
+ * ended by calling fault_wss_sample.
+ */
+struct faultwss *
+fault_wss_start(void *addr, size_t len, size_t nsample, unsigned int interval)
+{
+	struct faultwss *ws;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	int err;
+
+	if ((uintptr_t) addr % page_size != 0 || len == 0 || nsample == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((ws = calloc(1, sizeof(*ws))) == NULL)
+		return NULL;
+
+	ws->ws_base = addr;
+	ws->ws_pagesz = page_size;
+	ws->ws_npages = (len + page_size - 1) / page_size;
+	ws->ws_len = ws->ws_npages * page_size;
+	ws->ws_nsample = nsample < ws->ws_npages ? nsample : ws->ws_npages;
+	ws->ws_interval = interval;
+	ws->ws_rand = (uintptr_t) ws ^ 0x9e3779b97f4a7c15ULL;
+	ws->ws_stats.wt_pages = ws->ws_npages;
+	pthread_mutex_init(&ws->ws_lock, NULL);
+	pthread_cond_init(&ws->ws_cond, NULL);
+
+	if ((ws->ws_pages = calloc(ws->ws_npages,
+	    sizeof(ws->ws_pages[0]))) == NULL ||
+	    (ws->ws_sample = calloc(ws->ws_nsample,
+	    sizeof(ws->ws_sample[0]))) == NULL)
+		goto fail;
+
+	if (fault_register(&(struct faultregion) {
+		.fr_addr = ws->ws_base,
+		.fr_len = ws->ws_len,
+		.fr_act = { .fa_fun = wss_fault, .fa_arg = ws }
+	    }) != 0)
+		goto fail;
+
+	pthread_mutex_lock(&ws->ws_lock);
+	wss_tick(ws);
+	pthread_mutex_unlock(&ws->ws_lock);
+
+	if (interval != 0 &&
+	    (err = pthread_create(&ws->ws_thread, NULL, wss_main, ws)) != 0) {
+		ws->ws_interval = 0;
+		fault_wss_stop(ws);
+		errno = err;
+		return NULL;
+	}
+
+	return ws;
+
+fail:
+	pthread_cond_destroy(&ws->ws_cond);
+	pthread_mutex_destroy(&ws->ws_lock);
+	free(ws->ws_sample);
+	free(ws->ws_pages);
+	free(ws);
+	return NULL;
+}
+
+/*
+ * End the current interval by hand.
+ */
+int
+fault_wss_sample(struct faultwss *ws)
+{
+	pthread_mutex_lock(&ws->ws_lock);
+	wss_tick(ws);
+	pthread_mutex_unlock(&ws->ws_lock);
+
+	return 0;
+}
+
+/*
+ * The estimate from the last complete interval, and the heat histogram:
+ * wt_heat[i] counts the pages touched in i out of every FAULT_WSS_HEAT - 1
+ * of their last (up to eight) samples.
+ */
+int
+fault_wss_stats(struct faultwss *ws, struct faultwssstats *wst)
+{
+	pthread_mutex_lock(&ws->ws_lock);
+	*wst = ws->ws_stats;
+	wst->wt_faults = atomic_load(&ws->ws_faults);
+	for (size_t page = 0; page < ws->ws_npages; page++) {
+		const struct wsspage *wp = &ws->ws_pages[page];
+		unsigned int n = wp->wp_nsamples,
+		    hist = wp->wp_hist & ((1u << n) - 1);
+
+		if (n > 0)
+			wst->wt_heat[__builtin_popcount(hist) *
+			    (FAULT_WSS_HEAT - 1) / n]++;
+	}
+	pthread_mutex_unlock(&ws->ws_lock);
+
+	return 0;
+}
+
+/*
+ * Stop sampling and leave the range as it was.
+ */
+void
+fault_wss_stop(struct faultwss *ws)
+{
+	if (ws->ws_interval != 0) {
+		pthread_mutex_lock(&ws->ws_lock);
+		ws->ws_stop = 1;
+		pthread_cond_signal(&ws->ws_cond);
+		pthread_mutex_unlock(&ws->ws_lock);
+		pthread_join(ws->ws_thread, NULL);
+	}
+
+	mprotect(ws->ws_base, ws->ws_len, PROT_READ | PROT_WRITE);
+	fault_unregister(ws->ws_base);
+	pthread_cond_destroy(&ws->ws_cond);
+	pthread_mutex_destroy(&ws->ws_lock);
+	free(ws->ws_sample);
+	free(ws->ws_pages);
+	free(ws);
+}